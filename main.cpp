@@ -1,5 +1,7 @@
 #include <map>
+#include <set>
 #include <list>
+#include <forward_list>
 #include <mutex>
 #include <stack>
 #include <queue>
@@ -8,23 +10,49 @@
 #include <future>
 #include <thread>
 #include <string>
+#include <array>
 #include <vector>
 #include <memory>
+#include <new>
+#include <optional>
+#include <atomic>
 #include <climits>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cstdint>
 #include <numeric>
+#include <stdexcept>
+#include <functional>
 #include <utility>
+#include <tuple>
+#include <type_traits>
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <initializer_list>
 #include <algorithm>
 #include <exception>
 #include <shared_mutex>
+#include <unordered_map>
 #include <condition_variable>
+#include <coroutine>
+#if defined(HIERARCHIAL_MUTEX_LOCK_GRAPH) && defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 /*
  * Примеры из книжки.
  * Для работы нужно указать флаг для компилятора "-pthread".
- * Ещё нужно указать -std=c++17, иначе не соберётся.
+ * Ещё нужно указать -std=c++20 (сопрограммы), иначе не соберётся.
  * Инструкция для Code::Blocks здесь -
  *   https://askubuntu.com/questions/568068/multithreading-in-codeblocks
  *
@@ -33,1299 +61,5481 @@ using namespace std;
 
 
 
-/* Листинг 1.1 (стр 42) */
-void hello()
+/* Доработка: пул потоков с перехватом задач (work stealing)
+ * По мотивам главы 9 книжки. Стоит в самом начале, потому что им пользуются
+ * листинги ниже (spawn_async, parallel_quick_sort, process_data и т.д.) -
+ * вместо создания потока на каждую задачу всё крутится на фиксированном
+ * числе потоков, равном числу ядер.
+ */
+// Обёртка над вызываемым объектом, которую можно только перемещать
+// (std::function требует копируемости, а packaged_task не копируется)
+class function_wrapper
 {
-    cout << "Hello Concurrent World" << endl;
-}
+    struct impl_base
+    {
+        virtual void call() = 0;
+        virtual ~impl_base() {}
+    };
+    template<typename F>
+    struct impl_type: impl_base
+    {
+        F f;
+        impl_type(F&& f_):f(move(f_)){}
+        void call() { f(); }
+    };
+    unique_ptr<impl_base> impl;
+public:
+    function_wrapper() = default;
+    template<typename F,
+             typename = enable_if_t<!is_same<decay_t<F>, function_wrapper>::value>>
+    function_wrapper(F&& f):
+        impl(new impl_type<decay_t<F>>(decay_t<F>(forward<F>(f))))
+    {}
+    function_wrapper(function_wrapper&& other) noexcept:
+        impl(move(other.impl))
+    {}
+    function_wrapper& operator=(function_wrapper&& other) noexcept
+    {
+        impl = move(other.impl);
+        return *this;
+    }
+    function_wrapper(const function_wrapper&) = delete;
+    function_wrapper& operator=(const function_wrapper&) = delete;
+    void operator()() { impl->call(); }
+};
 
-// Запуск листинга (если надо запустить - вызываем в main(), далее - аналогично)
-void run()
+// Очередь задач одного потока пула.
+// Владелец кладёт и берёт с головы (LIFO - горячие данные в кэше),
+// остальные воруют с хвоста (самые старые и обычно самые крупные задачи)
+class work_stealing_queue
 {
-    thread t(hello);
-    t.join();
-}
-/* Конец листинга 1.1 */
+    deque<function_wrapper> the_queue;
+    mutable mutex the_mutex;
+public:
+    work_stealing_queue(){}
+    work_stealing_queue(const work_stealing_queue&) = delete;
+    work_stealing_queue& operator=(const work_stealing_queue&) = delete;
+    void push(function_wrapper data)
+    {
+        lock_guard<mutex> lock(the_mutex);
+        the_queue.push_front(move(data));
+    }
+    bool empty() const
+    {
+        lock_guard<mutex> lock(the_mutex);
+        return the_queue.empty();
+    }
+    bool try_pop(function_wrapper& res)
+    {
+        lock_guard<mutex> lock(the_mutex);
+        if (the_queue.empty()) return false;
+        res = move(the_queue.front());
+        the_queue.pop_front();
+        return true;
+    }
+    bool try_steal(function_wrapper& res)
+    {
+        lock_guard<mutex> lock(the_mutex);
+        if (the_queue.empty()) return false;
+        res = move(the_queue.back());
+        the_queue.pop_back();
+        return true;
+    }
+};
 
+// Кооперативная отмена: источник поднимает флаг, задачи с жетоном (token) сами
+// проверяют его, когда им удобно. Свои имена, чтобы не путать с std::stop_token
+class operation_cancelled: public runtime_error
+{
+public:
+    operation_cancelled(): runtime_error("operation cancelled") {}
+};
 
+class cancellation_token
+{
+    friend class cancellation_source;
+    struct state
+    {
+        atomic<bool> cancelled{false};
+    };
+    shared_ptr<state const> shared;
+    explicit cancellation_token(shared_ptr<state const> shared_): shared(move(shared_)) {}
+public:
+    // Пустой жетон никогда не отменяется
+    cancellation_token() = default;
+    bool can_be_cancelled() const
+    {
+        return shared != nullptr;
+    }
+    bool is_cancelled() const
+    {
+        return shared && shared->cancelled.load(memory_order_relaxed);
+    }
+    void throw_if_cancelled() const
+    {
+        if (is_cancelled()) throw operation_cancelled();
+    }
+};
 
-/* Листинг 2.1 (стр 47) */
-// Функция, выводит числа в консоль
-void do_something(unsigned& j_)
+class cancellation_source
 {
-    if (j_ % 100000 == 0) cout << "Value: " << j_ << endl;
-}
+    shared_ptr<cancellation_token::state> shared = make_shared<cancellation_token::state>();
+public:
+    cancellation_token token() const
+    {
+        return cancellation_token(shared);
+    }
+    // true - отменили именно мы
+    bool cancel()
+    {
+        return !shared->cancelled.exchange(true, memory_order_relaxed);
+    }
+    bool is_cancelled() const
+    {
+        return shared->cancelled.load(memory_order_relaxed);
+    }
+};
 
-struct func
+class work_stealing_pool
 {
-    int& i;
-    // Вырвиглазный конструктор с инициализацией поля
-    func(int& i_):i(i_){}
-    void operator()()
+    atomic<bool> done;
+    // Сколько задач лежит в очередях и ещё не взято - по нему потоки решают, спать или нет
+    atomic<size_t> pending;
+    mutex global_mutex;
+    deque<function_wrapper> global_queue;
+    vector<unique_ptr<work_stealing_queue>> queues;
+    vector<thread> threads;
+    mutex sleep_mutex;
+    condition_variable work_cond;
+    static thread_local work_stealing_pool* current_pool;
+    static thread_local work_stealing_queue* local_work_queue;
+    static thread_local unsigned my_index;
+
+    bool pop_task_from_local_queue(function_wrapper& task)
     {
-        for (unsigned j = 0; j < 1000000; ++j)
+        return current_pool == this && local_work_queue->try_pop(task);
+    }
+    bool pop_task_from_global_queue(function_wrapper& task)
+    {
+        lock_guard<mutex> lk(global_mutex);
+        if (global_queue.empty()) return false;
+        task = move(global_queue.front());
+        global_queue.pop_front();
+        return true;
+    }
+    bool pop_task_from_other_thread_queue(function_wrapper& task)
+    {
+        unsigned const start = (current_pool == this) ? my_index + 1 : 0;
+        for (unsigned i = 0; i < queues.size(); ++i)
         {
-            do_something(j);
+            unsigned const index = (start + i) % queues.size();
+            if (queues[index]->try_steal(task)) return true;
+        }
+        return false;
+    }
+    // pending растёт до того, как задача попадёт в очередь: иначе её успеют
+    // взять и уменьшить счётчик раньше, и size_t на миг завернётся в SIZE_MAX
+    void push_task(function_wrapper task)
+    {
+        pending.fetch_add(1);
+        try
+        {
+            if (current_pool == this)
+            {
+                local_work_queue->push(move(task));
+            }
+            else
+            {
+                lock_guard<mutex> lk(global_mutex);
+                global_queue.push_back(move(task));
+            }
+        }
+        catch(...)
+        {
+            pending.fetch_sub(1);
+            throw;
+        }
+        // Пустой лок нужен, чтобы не потерять пробуждение потока,
+        // который уже проверил pending, но ещё не уснул
+        { lock_guard<mutex> lk(sleep_mutex); }
+        work_cond.notify_one();
+    }
+    void worker_thread(unsigned index)
+    {
+        current_pool = this;
+        my_index = index;
+        local_work_queue = queues[index].get();
+        while (true)
+        {
+            if (run_pending_task()) continue;
+            unique_lock<mutex> lk(sleep_mutex);
+            if (done && !pending) break;
+            work_cond.wait(lk, [this]{ return done || pending; });
+        }
+        current_pool = nullptr;
+        local_work_queue = nullptr;
+    }
+public:
+    explicit work_stealing_pool(unsigned thread_count = 0):
+        done(false), pending(0)
+    {
+        if (!thread_count)
+        {
+            unsigned const hardware_threads = thread::hardware_concurrency();
+            thread_count = hardware_threads != 0 ? hardware_threads : 2;
+        }
+        for (unsigned i = 0; i < thread_count; ++i)
+            queues.push_back(unique_ptr<work_stealing_queue>(new work_stealing_queue));
+        try
+        {
+            for (unsigned i = 0; i < thread_count; ++i)
+                threads.push_back(thread(&work_stealing_pool::worker_thread, this, i));
+        }
+        catch(...)
+        {
+            done = true;
+            work_cond.notify_all();
+            for (auto& t : threads) t.join();
+            throw;
+        }
+    }
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+    // Перед выходом потоки дорабатывают всё, что уже поставлено в очередь
+    ~work_stealing_pool()
+    {
+        {
+            lock_guard<mutex> lk(sleep_mutex);
+            done = true;
+        }
+        work_cond.notify_all();
+        for (auto& t : threads) t.join();
+    }
+    unsigned size() const
+    {
+        return threads.size();
+    }
+    // Задача из потока пула идёт в его локальную очередь, снаружи - в общую
+    template<typename FunctionType>
+    future<invoke_result_t<decay_t<FunctionType>>> submit(FunctionType&& f)
+    {
+        typedef invoke_result_t<decay_t<FunctionType>> result_type;
+        packaged_task<result_type()> task(forward<FunctionType>(f));
+        future<result_type> res(task.get_future());
+        push_task(move(task));
+        return res;
+    }
+    // Задача без результата: ни packaged_task, ни future. Исключение из неё
+    // уронит поток пула, так что ловить их - забота вызывающего
+    template<typename FunctionType>
+    void post(FunctionType&& f)
+    {
+        push_task(function_wrapper(forward<FunctionType>(f)));
+    }
+    // То же с жетоном отмены: если к моменту запуска отменено, задача не
+    // выполняется, а future получает operation_cancelled
+    template<typename FunctionType>
+    future<invoke_result_t<decay_t<FunctionType>>> submit(FunctionType&& f, cancellation_token token)
+    {
+        return submit([f = decay_t<FunctionType>(forward<FunctionType>(f)), token = move(token)]() mutable
+            {
+                token.throw_if_cancelled();
+                return f();
+            });
+    }
+    template<typename FunctionType>
+    void post(FunctionType&& f, cancellation_token token)
+    {
+        post([f = decay_t<FunctionType>(forward<FunctionType>(f)), token = move(token)]() mutable
+            {
+                if (!token.is_cancelled()) f();
+            });
+    }
+    // Выполнить одну задачу из очередей, если есть. Можно звать из любого потока
+    bool run_pending_task()
+    {
+        function_wrapper task;
+        if (pop_task_from_local_queue(task) ||
+            pop_task_from_global_queue(task) ||
+            pop_task_from_other_thread_queue(task))
+        {
+            pending.fetch_sub(1);
+            task();
+            return true;
+        }
+        return false;
+    }
+    // Ждать future, попутно выполняя чужие задачи. Внутри задач пула ждать надо
+    // только так, иначе при рекурсии все потоки заснут на get() и пул встанет.
+    // Посторонний поток просто спит: если он начнёт хватать самые старые задачи
+    // из общей очереди, вложенность ожиданий растёт и стек кончается
+    template<typename FutureType>
+    void run_pending_until_ready(FutureType& f)
+    {
+        if (current_pool != this)
+        {
+            f.wait();
+            return;
+        }
+        while (f.wait_for(chrono::seconds(0)) == future_status::timeout)
+        {
+            if (!run_pending_task()) this_thread::yield();
         }
     }
 };
 
-// Запуск листинга
-void oops()
+thread_local work_stealing_pool* work_stealing_pool::current_pool(nullptr);
+thread_local work_stealing_queue* work_stealing_pool::local_work_queue(nullptr);
+thread_local unsigned work_stealing_pool::my_index(0);
+
+// Общий пул на всю программу, создаётся при первом обращении
+work_stealing_pool& default_thread_pool()
 {
-    // Ничего не выведет скорее всего, т.к.
-    // detach отсоединяет поток от главного,
-    // который сразу завершается
-    int some_local_state = 0;
-    func my_func(some_local_state);
-    thread my_thread(my_func);
-    my_thread.detach();
+    static work_stealing_pool pool;
+    return pool;
 }
-/* Конец листинга 2.1 */
 
+// Запуск: кидаем в пул кучу задач и смотрим, сколько разных потоков их выполнило
+void run_pool()
+{
+    unsigned const task_count = 10000;
+    mutex ids_mutex;
+    set<thread::id> ids;
+    vector<future<unsigned>> results;
+    for (unsigned i = 0; i < task_count; ++i)
+    {
+        results.push_back(default_thread_pool().submit([i, &ids_mutex, &ids]
+            {
+                lock_guard<mutex> lk(ids_mutex);
+                ids.insert(this_thread::get_id());
+                return i;
+            }));
+    }
+    unsigned long sum = 0;
+    for (auto& f : results)
+        sum += f.get();
+    cout << "tasks: " << task_count << ", sum: " << sum
+         << ", threads used: " << ids.size()
+         << " (pool size " << default_thread_pool().size() << ")" << endl;
+}
+/* Конец доработки: пул потоков */
 
 
-/* Листинг 2.2 (стр 49) */
-void do_something_in_current_thread()
+
+/* Доработка: общие мелочи для замеров
+ * Бенчмарки ниже - обычные функции запуска, вызываются из main() как и листинги.
+ * Собирать лучше с -O2, иначе цифры мало что значат.
+ */
+// Размер кэш-линии. hardware_destructive_interference_size в gcc ругается
+// предупреждениями, поэтому просто 64 - так почти везде на x86 и arm
+constexpr size_t cache_line_size = 64;
+
+// Сколько секунд выполнялась функция
+template<typename Func>
+double measure_seconds(Func&& f)
 {
-    // Пустая функция, которая вызовется один раз
-    cout << "do_something_in_current_thread() invoked" << endl;
+    auto const start = chrono::steady_clock::now();
+    f();
+    chrono::duration<double> const elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
 }
 
-// Запуск листинга
-void f22()
+// Сколько памяти процесса сейчас в RAM, КБ. Только Linux, иначе 0
+size_t resident_memory_kb()
 {
-    int some_local_state = 0;
-    // Создаём новый объект
-    func my_func(some_local_state);
-    // Создаём поток
-    thread t(my_func);
-    // Далее джойним поток, чтобы он выполнился
-    try
-    {
-        do_something_in_current_thread();
-    }
-    catch(...)
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
     {
-        t.join();
-        throw;
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return stoul(line.substr(6));
     }
-    t.join();
+    return 0;
 }
-/* Конец листинга 2.2 */
+/* Конец доработки: замеры */
 
 
 
-/* Листинг 2.3 (стр 50) */
-class thread_guard
+/* Доработка: сопрограммы (C++20)
+ * Ленивая задача task<T>, таймеры и событие для co_await. Пока сопрограмма
+ * ждёт, поток ею не занят - тысячи сессий крутятся на потоках пула.
+ * Продолжение после ожидания всегда уходит задачей в пул.
+ */
+template<typename T = void> class task;
+
+struct task_promise_base
 {
-    thread& t;
-public:
-    // Оч некрасиво
-    explicit thread_guard(thread& t_):t(t_){}
-    // Деструктор, в котором гарантируется (ну почти), что поток завершится
-    ~thread_guard()
+    // Кто ждёт эту задачу; по окончании управление передаётся ему напрямую
+    coroutine_handle<> continuation = noop_coroutine();
+    exception_ptr error;
+
+    struct final_awaiter
     {
-        if (t.joinable()) t.join();
-    }
-    thread_guard(thread_guard const&) = delete;
-    thread_guard& operator=(thread_guard const&) = delete;
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        coroutine_handle<> await_suspend(coroutine_handle<Promise> h) noexcept
+        {
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = current_exception(); }
 };
 
-// Запуск листинга
-void f23()
+template<typename T>
+struct task_promise: task_promise_base
 {
-    int some_local_state = 0;
-    // Аналогично f22()
-    func my_func(some_local_state);
-    thread t(my_func);
-    // Создаём экземпляр класса thread_guard,
-    // который после выполнения этой функции самовыпилится, вызвав деструктор
-    thread_guard g(t);
-    do_something_in_current_thread();
-}
-/* Конец листинга 2.3 */
-
-
+    optional<T> value;
+    task<T> get_return_object();
+    template<typename U>
+    void return_value(U&& v) { value.emplace(forward<U>(v)); }
+    T result()
+    {
+        if (error) rethrow_exception(error);
+        return move(*value);
+    }
+};
 
-/* Листинг 2.4 (стр 52) */
-// Функции и объекты-заглушки
-enum cmd
+template<>
+struct task_promise<void>: task_promise_base
 {
-    open_new_document,
-    something_else
+    task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (error) rethrow_exception(error);
+    }
 };
 
-struct user_command
+// Задача стартует только по co_await и владеет своим кадром
+template<typename T>
+class task
 {
-    cmd type;
 public:
-    user_command(cmd type_):type(type_){}
+    typedef task_promise<T> promise_type;
+private:
+    coroutine_handle<promise_type> handle;
+public:
+    explicit task(coroutine_handle<promise_type> h): handle(h) {}
+    task(task&& other) noexcept: handle(exchange(other.handle, nullptr)) {}
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle) handle.destroy();
+            handle = exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task()
+    {
+        if (handle) handle.destroy();
+    }
+    auto operator co_await() && noexcept
+    {
+        struct awaiter
+        {
+            coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return !handle || handle.done(); }
+            coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() { return handle.promise().result(); }
+        };
+        return awaiter{handle};
+    }
 };
 
-void open_document_and_display_gui(string const& filename)
+template<typename T>
+task<T> task_promise<T>::get_return_object()
 {
-    cout << "Open and display GUI for file " << filename << endl;
+    return task<T>(coroutine_handle<task_promise<T>>::from_promise(*this));
 }
 
-user_command get_user_input()
+inline task<void> task_promise<void>::get_return_object()
 {
-    int val;
-    cout << "Enter value (0 or 1): ";
-    cin >> val;
-    return {static_cast<cmd>(open_new_document)};
+    return task<void>(coroutine_handle<task_promise<void>>::from_promise(*this));
 }
 
-string const get_filename_from_user()
+// co_await resume_on(pool): дальше сопрограмма выполняется задачей пула
+inline auto resume_on(work_stealing_pool& pool)
 {
-    string new_name;
-    cout << "Enter new name: ";
-    cin >> new_name;
-    return new_name;
+    struct awaiter
+    {
+        work_stealing_pool& pool;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { pool.post([h]{ h.resume(); }); }
+        void await_resume() noexcept {}
+    };
+    return awaiter{pool};
 }
 
-bool done_editing()
+// Таймеры: один поток и упорядоченные сроки. Колбэк должен быть коротким -
+// сопрограммы из него только отправляются в пул
+class timer_queue
 {
-    int done;
-    cout << "Done editing (0|1)? ";
-    cin >> done;
-    return done == 1;
-}
-
-void process_user_input(user_command cmd)
-{
-    cout << "process_user_input(" << cmd.type << ") invoked" << endl;
-}
+    mutex m;
+    condition_variable cond;
+    multimap<chrono::steady_clock::time_point, function_wrapper> timers;
+    bool done = false;
+    thread worker;
 
-// Запуск листинга
-void edit_document(string const& filename)
-{
-    // Тут нам и пригодятся заглушки
-    cout << "edit_document(" << filename << ") invoked" << endl;
-    open_document_and_display_gui(filename);
-    while (!done_editing())
+    void run()
     {
-        user_command cmd = get_user_input();
-        if (cmd.type == open_new_document)
+        unique_lock<mutex> lk(m);
+        while (!done)
         {
-            string const new_name = get_filename_from_user();
-            thread t(edit_document, new_name);
-            t.detach();
+            if (timers.empty())
+            {
+                cond.wait(lk);
+                continue;
+            }
+            auto const first = timers.begin();
+            if (first->first > chrono::steady_clock::now())
+            {
+                cond.wait_until(lk, first->first);
+                continue;
+            }
+            function_wrapper callback = move(first->second);
+            timers.erase(first);
+            lk.unlock();
+            callback();
+            lk.lock();
         }
-        else
+    }
+public:
+    timer_queue():
+        worker(&timer_queue::run, this)
+    {}
+    timer_queue(const timer_queue&) = delete;
+    timer_queue& operator=(const timer_queue&) = delete;
+    // Несработавшие таймеры просто выбрасываются
+    ~timer_queue()
+    {
         {
-            process_user_input(cmd);
+            lock_guard<mutex> lk(m);
+            done = true;
         }
+        cond.notify_one();
+        worker.join();
     }
-}
-/* Конец листинга 2.4 */
-
-
-
-/* Листинг 2.5 (стр 56) */
-// Две функции для двух разных потоков, демонстрация
-void some_function()
-{
-    cout << "some_function() invoked" << endl;
-}
+    void schedule(chrono::steady_clock::time_point at, function_wrapper callback)
+    {
+        lock_guard<mutex> lk(m);
+        bool const earliest = timers.empty() || at < timers.begin()->first;
+        timers.emplace(at, move(callback));
+        if (earliest) cond.notify_one();
+    }
+};
 
-void some_other_function(int i)
+timer_queue& default_timer_queue()
 {
-    cout << "some_other_function(" << i << ") invoked" << endl;
+    static timer_queue timers;
+    return timers;
 }
 
-thread f25()
+// co_await sleep_until(срок) / sleep_for(время): поток не спит
+inline auto sleep_until(chrono::steady_clock::time_point deadline, work_stealing_pool& pool = default_thread_pool())
 {
-    return thread(some_function);
+    struct awaiter
+    {
+        chrono::steady_clock::time_point deadline;
+        work_stealing_pool& pool;
+        bool await_ready() const { return deadline <= chrono::steady_clock::now(); }
+        void await_suspend(coroutine_handle<> h)
+        {
+            work_stealing_pool* const target = &pool;
+            default_timer_queue().schedule(deadline, [h, target]{ target->post([h]{ h.resume(); }); });
+        }
+        void await_resume() noexcept {}
+    };
+    return awaiter{deadline, pool};
 }
 
-thread g25()
+template<typename Rep, typename Period>
+auto sleep_for(chrono::duration<Rep, Period> const& duration, work_stealing_pool& pool = default_thread_pool())
 {
-    void some_other_function(int);
-    thread t(some_other_function, 42);
-    return t;
+    return sleep_until(chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(duration), pool);
 }
 
-// Запуск листинга
-void run25()
+// Событие для сопрограмм. co_await wait_until(срок) возвращает true, если
+// событие наступило, и false по таймауту - как cv.wait_until() в цикле
+class async_event
 {
-    f25().join();
-    g25().join();
-}
-/* Конец листинга 2.5*/
-
-
+    struct waiter
+    {
+        coroutine_handle<> handle;
+        work_stealing_pool* pool;
+        atomic<bool> resumed{false};
+        bool signalled = false;
+        // Будит ровно один раз: либо set(), либо таймер
+        void resume(bool by_signal)
+        {
+            if (resumed.exchange(true)) return;
+            signalled = by_signal;
+            pool->post([h = handle]{ h.resume(); });
+        }
+    };
+    mutable mutex m;
+    bool signalled = false;
+    vector<shared_ptr<waiter>> waiters;
 
-/* Листинг 2.6 (стр 57) */
-// Оболочка для thread
-// При удалении джойнит поток
-class scoped_thread
-{
-    thread t;
+    class wait_awaiter
+    {
+        async_event& event;
+        optional<chrono::steady_clock::time_point> deadline;
+        work_stealing_pool& pool;
+        shared_ptr<waiter> state;
+    public:
+        wait_awaiter(async_event& event_, optional<chrono::steady_clock::time_point> deadline_, work_stealing_pool& pool_):
+            event(event_), deadline(deadline_), pool(pool_)
+        {}
+        bool await_ready() const { return event.is_set(); }
+        bool await_suspend(coroutine_handle<> h)
+        {
+            state = make_shared<waiter>();
+            state->handle = h;
+            state->pool = &pool;
+            // После выхода из-под мьютекса сопрограмму могут разбудить и кадр вместе
+            // с этим объектом исчезнет, так что дальше - только локальные копии
+            shared_ptr<waiter> const local_state = state;
+            optional<chrono::steady_clock::time_point> const local_deadline = deadline;
+            {
+                lock_guard<mutex> lk(event.m);
+                if (event.signalled)
+                {
+                    state->signalled = true;
+                    return false;
+                }
+                // Отработавшие по таймауту выкидываем, чтобы список не рос
+                if (event.waiters.size() >= 64)
+                    event.waiters.erase(remove_if(event.waiters.begin(), event.waiters.end(),
+                                                  [](shared_ptr<waiter> const& w){ return w->resumed.load(); }),
+                                        event.waiters.end());
+                event.waiters.push_back(local_state);
+            }
+            if (local_deadline)
+                default_timer_queue().schedule(*local_deadline, [local_state]{ local_state->resume(false); });
+            return true;
+        }
+        bool await_resume() const { return !state || state->signalled; }
+    };
 public:
-    explicit scoped_thread(thread t_):t(move(t_))
+    void set()
     {
-        if (!t.joinable())
-            throw logic_error("No thread");
+        vector<shared_ptr<waiter>> to_wake;
+        {
+            lock_guard<mutex> lk(m);
+            signalled = true;
+            to_wake.swap(waiters);
+        }
+        for (auto& w : to_wake)
+            w->resume(true);
     }
-    ~scoped_thread()
+    void reset()
     {
-        t.join();
+        lock_guard<mutex> lk(m);
+        signalled = false;
+    }
+    bool is_set() const
+    {
+        lock_guard<mutex> lk(m);
+        return signalled;
+    }
+    wait_awaiter wait(work_stealing_pool& pool = default_thread_pool())
+    {
+        return wait_awaiter(*this, nullopt, pool);
+    }
+    wait_awaiter wait_until(chrono::steady_clock::time_point deadline, work_stealing_pool& pool = default_thread_pool())
+    {
+        return wait_awaiter(*this, deadline, pool);
     }
-    scoped_thread(scoped_thread const&) = delete;
-    scoped_thread& operator=(scoped_thread const&) = delete;
 };
-
-// Запуск листинга
-void f26()
-{
-    int some_local_state;
-    // Создаём инстанс оболочки
-    scoped_thread t{thread(func(some_local_state))};
-    // Что-то делаем, а дальше функция завершается
-    do_something_in_current_thread();
-    // Где-то тут вызывается деструктор и джойнит поток
-}
-/* Конец листинга 2.6 */
+/* Конец доработки: сопрограммы */
 
 
 
-/* Листинг 2.7 (стр 58) */
-// Описание есть в книжке, весь класс оттуда
-class joining_thread
+/* Доработка: ожидание "покрутиться - уступить - уснуть"
+ * Замена condition_variable с тем же интерфейсом (wait, wait_until, notify_*),
+ * годится в шаблонный параметр очередей. Сначала крутимся на счётчике
+ * уведомлений, потом несколько раз отдаём процессор, и только потом спим
+ * прямо на futex (вне Linux - atomic::wait). Сколько крутиться, каждый объект
+ * подбирает сам по тому, как быстро его будили в последний раз: успели
+ * дождаться на кручении или проснулись вскоре после засыпания - крутимся
+ * дольше, спали долго - крутиться бесполезно, урезаем.
+ *
+ * Что ставить по умолчанию в листинги 4.1, 4.4, 4.5 и 4.11, выбирается флагом:
+ *   по умолчанию          - condition_variable, как в книжке
+ *   -DWAIT_POLICY_ADAPTIVE - adaptive_condition
+ */
+class adaptive_condition
 {
-    thread t;
-public:
-    joining_thread() noexcept = default;
-    template<typename Callable, typename ... Args>
-    explicit  joining_thread(Callable&& func, Args&& ... args):
-        t(std::forward<Callable>(func), std::forward<Args>(args)...)
-    {}
-    explicit joining_thread(thread t_) noexcept:
-        t(move(t_))
-    {}
-    joining_thread(joining_thread&& other) noexcept:
-        t(move(other.t))
-    {}
-    joining_thread& operator=(joining_thread&& other) noexcept
+    // Растёт на каждом notify - ждущий сравнивает с тем, что видел под мьютексом
+    alignas(cache_line_size) atomic<uint32_t> sequence{0};
+    atomic<uint32_t> sleepers{0};
+    atomic<uint32_t> spin_limit{multicore() ? initial_spins : 0};
+    static constexpr uint32_t min_spins = 16;
+    static constexpr uint32_t initial_spins = 256;
+    static constexpr uint32_t max_spins = 16384;
+    static constexpr unsigned yields = 4;
+    // Если после засыпания будят быстрее этого, крутиться стоило дольше
+    static constexpr chrono::microseconds short_sleep{50};
+
+    // На одном ядре крутиться бессмысленно: тот, кто должен разбудить, не работает,
+    // пока мы крутимся. Там сразу уступаем процессор
+    static bool multicore()
     {
-        if (joinable())
-            join();
-        t = move(other.t);
-        return *this;
+        static bool const result = thread::hardware_concurrency() > 1;
+        return result;
     }
-    joining_thread& operator=(thread other) noexcept
+    static void cpu_relax()
     {
-        if (joinable())
-            join();
-        t = move(other);
-        return *this;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
     }
-    ~joining_thread() noexcept
+    // Спит, пока sequence == seen. false - вышел дедлайн
+    bool park(uint32_t seen, optional<chrono::steady_clock::time_point> deadline)
     {
-        if (joinable())
-            join();
+#if defined(__linux__)
+        timespec relative{};
+        if (deadline)
+        {
+            auto const left = *deadline - chrono::steady_clock::now();
+            if (left <= chrono::steady_clock::duration::zero()) return false;
+            auto const secs = chrono::duration_cast<chrono::seconds>(left);
+            relative.tv_sec = secs.count();
+            relative.tv_nsec = chrono::duration_cast<chrono::nanoseconds>(left - secs).count();
+        }
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT_PRIVATE, seen,
+                deadline ? &relative : nullptr, nullptr, 0);
+        // Проснулись - по уведомлению, по сигналу или ложно; пусть вызывающий перепроверит
+        return !deadline || chrono::steady_clock::now() < *deadline;
+#else
+        if (!deadline)
+        {
+            sequence.wait(seen);
+            return true;
+        }
+        // atomic::wait без таймаута, так что с дедлайном - короткие сны
+        while (sequence.load() == seen)
+        {
+            if (chrono::steady_clock::now() >= *deadline) return false;
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        return true;
+#endif
     }
-    void swap(joining_thread& other) noexcept
+    void wake(bool all)
     {
-        t.swap(other.t);
+        sequence.fetch_add(1, memory_order_seq_cst);
+        // Пара к sleepers.fetch_add в wait_for_change: либо спящий увидит новый
+        // sequence и не уснёт, либо мы увидим его здесь
+        if (!sleepers.load(memory_order_seq_cst)) return;
+#if defined(__linux__)
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE_PRIVATE,
+                all ? INT_MAX : 1, nullptr, nullptr, 0);
+#else
+        if (all) sequence.notify_all();
+        else sequence.notify_one();
+#endif
     }
-    thread::id get_id() const noexcept
+    void adapt(uint32_t spins, bool caught_while_spinning, chrono::steady_clock::duration slept)
     {
-        return t.get_id();
+        if (!multicore()) return;
+        uint32_t limit = spins;
+        if (caught_while_spinning || slept < short_sleep)
+            limit = min(max_spins, spins * 2);
+        else
+            limit = max(min_spins, spins / 2);
+        spin_limit.store(limit, memory_order_relaxed);
     }
-    bool joinable() const noexcept
+    // Ждёт, пока sequence уйдёт от seen. false - вышел дедлайн
+    bool wait_for_change(uint32_t seen, optional<chrono::steady_clock::time_point> deadline)
     {
-        return t.joinable();
+        uint32_t const spins = spin_limit.load(memory_order_relaxed);
+        for (uint32_t i = 0; i < spins; ++i)
+        {
+            if (sequence.load(memory_order_acquire) != seen)
+            {
+                adapt(spins, true, {});
+                return true;
+            }
+            cpu_relax();
+        }
+        for (unsigned i = 0; i < yields; ++i)
+        {
+            if (sequence.load(memory_order_acquire) != seen) return true;
+            this_thread::yield();
+        }
+        auto const parked_at = chrono::steady_clock::now();
+        sleepers.fetch_add(1, memory_order_seq_cst);
+        bool const in_time = park(seen, deadline);
+        sleepers.fetch_sub(1, memory_order_relaxed);
+        adapt(spins, false, chrono::steady_clock::now() - parked_at);
+        return in_time;
     }
-    void join()
+public:
+    adaptive_condition() = default;
+    adaptive_condition(adaptive_condition const&) = delete;
+    adaptive_condition& operator=(adaptive_condition const&) = delete;
+
+    void notify_one() { wake(false); }
+    void notify_all() { wake(true); }
+    void wait(unique_lock<mutex>& lk)
     {
-        t.join();
+        uint32_t const seen = sequence.load(memory_order_acquire);
+        lk.unlock();
+        wait_for_change(seen, nullopt);
+        lk.lock();
     }
-    void detach()
+    template<typename Predicate>
+    void wait(unique_lock<mutex>& lk, Predicate pred)
     {
-        t.detach();
+        while (!pred()) wait(lk);
     }
-    const thread& as_thread() const noexcept
+    template<typename Clock, typename Duration>
+    cv_status wait_until(unique_lock<mutex>& lk, chrono::time_point<Clock, Duration> const& deadline)
     {
-        return t;
+        // Как и condition_variable, чужие часы приводим к steady_clock
+        auto const steady_deadline = chrono::steady_clock::now() +
+            chrono::duration_cast<chrono::steady_clock::duration>(deadline - Clock::now());
+        uint32_t const seen = sequence.load(memory_order_acquire);
+        lk.unlock();
+        bool const in_time = wait_for_change(seen, steady_deadline);
+        lk.lock();
+        return in_time || Clock::now() < deadline ? cv_status::no_timeout : cv_status::timeout;
+    }
+    template<typename Clock, typename Duration, typename Predicate>
+    bool wait_until(unique_lock<mutex>& lk, chrono::time_point<Clock, Duration> const& deadline, Predicate pred)
+    {
+        while (!pred())
+            if (wait_until(lk, deadline) == cv_status::timeout) return pred();
+        return true;
+    }
+    template<typename Rep, typename Period>
+    cv_status wait_for(unique_lock<mutex>& lk, chrono::duration<Rep, Period> const& timeout)
+    {
+        return wait_until(lk, chrono::steady_clock::now() + timeout);
+    }
+    template<typename Rep, typename Period, typename Predicate>
+    bool wait_for(unique_lock<mutex>& lk, chrono::duration<Rep, Period> const& timeout, Predicate pred)
+    {
+        return wait_until(lk, chrono::steady_clock::now() + timeout, pred);
     }
+    // Текущий бюджет кручения - для отладки и бенчмарка
+    uint32_t current_spin_limit() const { return spin_limit.load(memory_order_relaxed); }
 };
 
-// Запуск листинга
-void run27()
-{
-    // Ничего не придумал, просто вызовем какую-нибудь функцию
-    joining_thread jt(some_other_function, 55);
-}
-/* Конец листинга 2.7 */
+#if defined(WAIT_POLICY_ADAPTIVE)
+typedef adaptive_condition default_wait_condition;
+#else
+typedef condition_variable default_wait_condition;
+#endif
+/* Конец доработки: ожидание */
 
 
 
-/* Листинг 2.8 (стр 59) */
-// Функция, чёт делает
-void do_work(unsigned id)
+/* Листинг 1.1 (стр 42) */
+void hello()
 {
-    cout << "do_work(" << id << ") invoked" << endl;
+    cout << "Hello Concurrent World" << endl;
 }
 
-// Запуск потока
-void f28()
+// Запуск листинга (если надо запустить - вызываем в main(), далее - аналогично)
+void run()
 {
-    // Создаём массив потоков, потом в цикле вызываем
-    vector<thread> threads;
-    for (unsigned i = 0; i < 20; ++i)
-    {
-        threads.emplace_back(do_work, i);
-    }
-    for (auto& entry : threads)
-        entry.join();
+    thread t(hello);
+    t.join();
 }
-/* Конец листинга 2.8 */
+/* Конец листинга 1.1 */
 
 
 
-/* Листинг 2.9 (стр 60) */
-// Описание опять же в книжке, но я так и не понял до конца, чё этот блок кода делает
-template<typename Iterator, typename T>
-struct accumulate_block
+/* Листинг 2.1 (стр 47) */
+// Функция, выводит числа в консоль
+void do_something(unsigned& j_)
 {
-    void operator()(Iterator first, Iterator last, T& result)
+    if (j_ % 100000 == 0) cout << "Value: " << j_ << endl;
+}
+
+struct func
+{
+    int& i;
+    // Вырвиглазный конструктор с инициализацией поля
+    func(int& i_):i(i_){}
+    void operator()()
     {
-        result = accumulate(first, last, result);
+        for (unsigned j = 0; j < 1000000; ++j)
+        {
+            do_something(j);
+        }
     }
 };
 
-template<typename Iterator, typename T>
-T parallel_accumulate(Iterator first, Iterator last, T init)
+// Запуск листинга
+void oops()
 {
-    unsigned long const length = distance(first, last);
-    if (!length)
-        return init;
-    unsigned long const min_per_thread = 25;
-    unsigned long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-    unsigned long const hardware_threads = thread::hardware_concurrency();
-    unsigned long const num_threads = min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
-    unsigned long const block_size = length / num_threads;
-    vector<T> results(num_threads);
-    vector<thread> threads(num_threads - 1);
-    Iterator block_start = first;
-    for (unsigned long i = 0; i < (num_threads - 1); ++i)
-    {
-        Iterator block_end = block_start;
-        advance(block_end, block_size);
-        threads[i] = thread(accumulate_block<Iterator, T>(), block_start, block_end, ref(results[i]));
-        block_start = block_end;
-    }
-    accumulate_block<Iterator, T>()(block_start, last, results[num_threads - 1]);
-    for (auto& entry : threads)
-        entry.join();
-    return accumulate(results.begin(), results.end(), init);
+    // Ничего не выведет скорее всего, т.к.
+    // detach отсоединяет поток от главного,
+    // который сразу завершается
+    int some_local_state = 0;
+    func my_func(some_local_state);
+    thread my_thread(my_func);
+    my_thread.detach();
 }
+/* Конец листинга 2.1 */
 
-// Запуск листинга
-void run29()
+
+
+/* Листинг 2.2 (стр 49) */
+void do_something_in_current_thread()
 {
-    vector<int> v{1, 2, 3, 4};
-    int result = parallel_accumulate(v.begin(), v.end(), 10);
-    // возвращает 20, почему так - хз. разбираться лень
-    cout << "result is " << result << endl;
+    // Пустая функция, которая вызовется один раз
+    cout << "do_something_in_current_thread() invoked" << endl;
 }
-/* Конец листинга 2.9 */
-
 
-
-/* Листинг 3.1 (стр 71) */
-// Демонстрация мутексов, нужны для синхронизации объектов, можно ставить лок
-list<int> some_list;
-mutex some_mutex;
-
-void add_to_list(int new_value)
+// Запуск листинга
+void f22()
 {
-    // Вот тут лок ставится
-    lock_guard<mutex> guard(some_mutex);
-    some_list.push_back(new_value);
+    int some_local_state = 0;
+    // Создаём новый объект
+    func my_func(some_local_state);
+    // Создаём поток
+    thread t(my_func);
+    // Далее джойним поток, чтобы он выполнился
+    try
+    {
+        do_something_in_current_thread();
+    }
+    catch(...)
+    {
+        t.join();
+        throw;
+    }
+    t.join();
 }
+/* Конец листинга 2.2 */
 
-bool list_contains(int value_to_find)
+
+
+/* Листинг 2.3 (стр 50) */
+class thread_guard
 {
-    // Вот тут лок ставится
-    lock_guard<mutex> guard(some_mutex);
-    return find(some_list.begin(), some_list.end(), value_to_find) != some_list.end();
-}
+    thread& t;
+public:
+    // Оч некрасиво
+    explicit thread_guard(thread& t_):t(t_){}
+    // Деструктор, в котором гарантируется (ну почти), что поток завершится
+    ~thread_guard()
+    {
+        if (t.joinable()) t.join();
+    }
+    thread_guard(thread_guard const&) = delete;
+    thread_guard& operator=(thread_guard const&) = delete;
+};
 
 // Запуск листинга
-void run31()
+void f23()
 {
-    add_to_list(3);
-    add_to_list(4);
-    add_to_list(5);
-
-    cout << "Is list contains 6? " << (list_contains(6) ? "yes" : "no") << endl;
-    cout << "Is list contains 5? " << (list_contains(5) ? "yes" : "no") << endl;
+    int some_local_state = 0;
+    // Аналогично f22()
+    func my_func(some_local_state);
+    thread t(my_func);
+    // Создаём экземпляр класса thread_guard,
+    // который после выполнения этой функции самовыпилится, вызвав деструктор
+    thread_guard g(t);
+    do_something_in_current_thread();
 }
-/* Конец листинга 3.1 */
+/* Конец листинга 2.3 */
 
 
 
-/* Листинг 3.2 (стр 72) */
-// Опять синхронизация в другой обёртке
-class some_data
+/* Листинг 2.4 (стр 52) */
+// Функции и объекты-заглушки
+enum cmd
 {
-    int a;
-    string b;
-public:
-    void do_something()
-    {
-        cout << "instance of some_data do_something()" << endl;
-    }
+    open_new_document,
+    something_else
 };
 
-class data_wrapper
+struct user_command
 {
-private:
-    some_data data;
-    mutex m;
+    cmd type;
 public:
-    template<typename Function>
-    void process_data(Function func)
-    {
-        // Вот тут лок ставится
-        lock_guard<mutex> l(m);
-        func(data);
-    }
+    user_command(cmd type_):type(type_){}
 };
 
-some_data* unprotected;
-void malicious_function(some_data& protected_data)
+void open_document_and_display_gui(string const& filename)
 {
-    unprotected = &protected_data;
+    cout << "Open and display GUI for file " << filename << endl;
+}
+
+user_command get_user_input()
+{
+    int val;
+    cout << "Enter value (0 or 1): ";
+    cin >> val;
+    return {static_cast<cmd>(open_new_document)};
+}
+
+string const get_filename_from_user()
+{
+    string new_name;
+    cout << "Enter new name: ";
+    cin >> new_name;
+    return new_name;
+}
+
+bool done_editing()
+{
+    int done;
+    cout << "Done editing (0|1)? ";
+    cin >> done;
+    return done == 1;
+}
+
+void process_user_input(user_command cmd)
+{
+    cout << "process_user_input(" << cmd.type << ") invoked" << endl;
 }
 
-data_wrapper x;
 // Запуск листинга
-void foo()
+void edit_document(string const& filename)
 {
-    x.process_data(malicious_function);
-    unprotected->do_something();
+    // Тут нам и пригодятся заглушки
+    cout << "edit_document(" << filename << ") invoked" << endl;
+    open_document_and_display_gui(filename);
+    while (!done_editing())
+    {
+        user_command cmd = get_user_input();
+        if (cmd.type == open_new_document)
+        {
+            string const new_name = get_filename_from_user();
+            thread t(edit_document, new_name);
+            t.detach();
+        }
+        else
+        {
+            process_user_input(cmd);
+        }
+    }
 }
-/* Конец листинга 3.2 */
+/* Конец листинга 2.4 */
 
 
 
-/* Листинг 3.3 (стр 74)
- * Это просто интерфейс без реализованных методов, смысла нет его делать.
- * Код добавляю, чтобы показать, что он хотя бы собирается.
- */
-template<typename T, typename Container>
-class stack33
+/* Листинг 2.5 (стр 56) */
+// Две функции для двух разных потоков, демонстрация
+void some_function()
 {
-public:
-    explicit stack33(const Container&);
-    explicit stack33(Container&& = Container());
-    template<class Alloc> explicit stack33(const Alloc&);
-    template<class Alloc> stack33(const Container&, const Alloc&);
-    template<class Alloc> stack33(Container&&, const Alloc&);
-    template<class Alloc> stack33(stack33&&, const Alloc&);
-    bool empty() const;
-    size_t size() const;
-    T& top();
-    T const& top() const;
-    void push(T const&);
-    void push(T&&);
-    void pop();
-    void swap(stack33&&);
-    template<class... Args> void emplace(Args&&... args);
-};
-/* Конец листинга 3.3 */
+    cout << "some_function() invoked" << endl;
+}
 
+void some_other_function(int i)
+{
+    cout << "some_other_function(" << i << ") invoked" << endl;
+}
 
-/* Листинг 3.4 (стр 79)
- * Опять интерфейс. Собирается, пусть будет. Реализацию не делаю.
- */
-struct empty_stack: exception
+thread f25()
 {
-    const char* what() const noexcept;
-};
+    return thread(some_function);
+}
 
-template<typename T>
-class threadsafe_stack
+thread g25()
 {
-public:
-    threadsafe_stack();
-    threadsafe_stack(const threadsafe_stack&);
-    threadsafe_stack& operator=(const threadsafe_stack&) = delete;
-    void push(T new_value);
-    shared_ptr<T> pop();
-    void pop(T& value);
-    bool empty() const;
-};
-/* Конец листинга 3.4 */
+    void some_other_function(int);
+    thread t(some_other_function, 42);
+    return t;
+}
+
+// Запуск листинга
+void run25()
+{
+    f25().join();
+    g25().join();
+}
+/* Конец листинга 2.5*/
 
 
 
-/* Листинг 3.5 (стр 79) */
-struct empty_stack_35: exception
+/* Листинг 2.6 (стр 57) */
+// Оболочка для thread
+// При удалении джойнит поток
+class scoped_thread
 {
-    const char* what() const throw()
+    thread t;
+public:
+    explicit scoped_thread(thread t_):t(move(t_))
     {
-        return "Empty stack exception";
+        if (!t.joinable())
+            throw logic_error("No thread");
+    }
+    ~scoped_thread()
+    {
+        t.join();
     }
+    scoped_thread(scoped_thread const&) = delete;
+    scoped_thread& operator=(scoped_thread const&) = delete;
 };
 
-// Название говорит само за себя - потокобезопасный стэк
-// Лочим всё что можно когда изменяем данные
-template<typename T>
-class threadsafe_stack_35
+// Запуск листинга
+void f26()
 {
-private:
-    stack<T> data;
-    mutable mutex m;
+    int some_local_state;
+    // Создаём инстанс оболочки
+    scoped_thread t{thread(func(some_local_state))};
+    // Что-то делаем, а дальше функция завершается
+    do_something_in_current_thread();
+    // Где-то тут вызывается деструктор и джойнит поток
+}
+/* Конец листинга 2.6 */
+
+
+
+/* Листинг 2.7 (стр 58) */
+// Описание есть в книжке, весь класс оттуда
+class joining_thread
+{
+    thread t;
 public:
-    threadsafe_stack_35(){}
-    threadsafe_stack_35(const threadsafe_stack_35& other)
+    joining_thread() noexcept = default;
+    template<typename Callable, typename ... Args>
+    explicit  joining_thread(Callable&& func, Args&& ... args):
+        t(std::forward<Callable>(func), std::forward<Args>(args)...)
+    {}
+    explicit joining_thread(thread t_) noexcept:
+        t(move(t_))
+    {}
+    joining_thread(joining_thread&& other) noexcept:
+        t(move(other.t))
+    {}
+    joining_thread& operator=(joining_thread&& other) noexcept
     {
-        // Вот тут лок ставится
-        lock_guard<mutex> lock(other.m);
-        data = other.data;
+        if (joinable())
+            join();
+        t = move(other.t);
+        return *this;
     }
-    threadsafe_stack_35& operator=(const threadsafe_stack_35&) = delete;
-    void push(T new_value)
+    joining_thread& operator=(thread other) noexcept
     {
-        // Вот тут лок ставится
-        lock_guard<mutex> lock(m);
-        data.push(move(new_value));
+        if (joinable())
+            join();
+        t = move(other);
+        return *this;
     }
-    shared_ptr<T> pop()
+    ~joining_thread() noexcept
     {
-        lock_guard<mutex> lock(m);
-        if (data.empty()) throw empty_stack_35();
-        shared_ptr<T> const res(make_shared<T>(data.top()));
-        data.pop();
-        return res;
+        if (joinable())
+            join();
     }
-    void pop(T& value)
+    void swap(joining_thread& other) noexcept
     {
-        lock_guard<mutex> lock(m);
-        if (data.empty()) throw empty_stack_35();
-        value = data.top();
-        data.pop();
+        t.swap(other.t);
     }
-    bool empty() const
+    thread::id get_id() const noexcept
     {
-        lock_guard<mutex> lock(m);
-        return data.empty();
+        return t.get_id();
+    }
+    bool joinable() const noexcept
+    {
+        return t.joinable();
+    }
+    void join()
+    {
+        t.join();
+    }
+    void detach()
+    {
+        t.detach();
+    }
+    const thread& as_thread() const noexcept
+    {
+        return t;
     }
 };
 
 // Запуск листинга
-void run35()
+void run27()
 {
-    threadsafe_stack_35<int> st;
-    st.push(1);
-    st.push(3);
-    st.push(2);
-
-    int val;
-    st.pop(val);
-
-    cout << "Is stack empty? " << (st.empty() ? "yes" : "no") << endl;
-    cout << "stack.pop() == " << val << endl;
+    // Ничего не придумал, просто вызовем какую-нибудь функцию
+    joining_thread jt(some_other_function, 55);
 }
-/* Конец листинга 3.5 */
+/* Конец листинга 2.7 */
 
 
 
-/* Листинг 3.6 (стр 82) */
-// Реализацию класса some_big_object и метода swap(...) нам не показали,
-// поэтому функцию запуска не буду добавлять
-// добавлю только функцию do_something() в класс some_big_object - понадобится в 3.11
-class some_big_object
+/* Листинг 2.8 (стр 59) */
+// Функция, чёт делает
+void do_work(unsigned id)
 {
-public:
-    void do_something()
-    {
-        cout << "some_big_object#do_something() invoked" << endl;
-    }
-};
-void swap(some_big_object& lhs, some_big_object& rhs);
-class X
+    cout << "do_work(" << id << ") invoked" << endl;
+}
+
+// Запуск потока
+void f28()
 {
-private:
-    some_big_object some_detail;
-    mutex m;
-public:
-    X(some_big_object const& sd):some_detail(sd){}
-    friend void swap(X& lhs, X& rhs)
+    // Создаём массив потоков, потом в цикле вызываем
+    vector<thread> threads;
+    for (unsigned i = 0; i < 20; ++i)
     {
-        if (&lhs == &rhs)
-            return;
-        lock(lhs.m, rhs.m);
-        lock_guard<mutex> lock_a(lhs.m, adopt_lock);
-        lock_guard<mutex> lock_b(rhs.m, adopt_lock);
-        swap(lhs.some_detail, rhs.some_detail);
+        threads.emplace_back(do_work, i);
     }
+    for (auto& entry : threads)
+        entry.join();
+}
+/* Конец листинга 2.8 */
+
+
+
+/* Листинг 2.9 (стр 60) */
+// Описание опять же в книжке, но я так и не понял до конца, чё этот блок кода делает
+//
+// Доработка: в книжке частичные суммы лежат рядом в vector<T> results, и потоки
+// пишут в одну кэш-линию (false sharing), а поток заводится на каждые 25 элементов.
+// Теперь блоки считаются в общем пуле, каждая частичная сумма на своей кэш-линии,
+// число блоков - из размера и цены элемента (accumulate_policy), а для чисел в
+// непрерывной памяти внутренний цикл раскладывается на независимые дорожки,
+// которые компилятор векторизует.
+
+// Значение на отдельной кэш-линии
+template<typename T>
+struct alignas(cache_line_size) padded_value
+{
+    T value;
 };
-/* Конец листинга 3.6 */
 
+// Итератор по непрерывной памяти с числами: указатель или итератор vector
+// (кроме vector<bool> - там биты)
+template<typename Iterator>
+struct is_contiguous_arithmetic_iterator
+{
+    typedef typename iterator_traits<Iterator>::value_type value_type;
+    static constexpr bool value = is_arithmetic<value_type>::value && !is_same<value_type, bool>::value &&
+        (is_pointer<Iterator>::value ||
+         is_same<Iterator, typename vector<value_type>::iterator>::value ||
+         is_same<Iterator, typename vector<value_type>::const_iterator>::value);
+};
 
+// Восемь независимых сумм вместо одной цепочки - зависимость по сложению
+// разрывается, и цикл ложится на SIMD-регистры
+template<typename V, typename T>
+T simd_accumulate(V const* first, V const* last, T init)
+{
+    size_t const lanes_count = 8;
+    T lanes[lanes_count] = {};
+    size_t const length = last - first;
+    size_t i = 0;
+    for (; i + lanes_count <= length; i += lanes_count)
+        for (size_t k = 0; k < lanes_count; ++k)
+            lanes[k] += first[i + k];
+    for (; i < length; ++i)
+        init += first[i];
+    for (size_t k = 0; k < lanes_count; ++k)
+        init += lanes[k];
+    return init;
+}
 
-/* Листинг 3.8 (стр 89) (функции запуска нет) */
-// Какой-то хитровыделанный мутекс с иерархией
-class hierarchial_mutex
+template<typename Iterator, typename T>
+struct accumulate_block
 {
-    mutex internal_mutex;
-    unsigned long const hierarchy_value;
-    unsigned long previous_hierarchy_value;
-    static thread_local unsigned long this_thread_hierarchy_value;
-    void check_for_hierarchy_violation()
+    void operator()(Iterator first, Iterator last, T& result)
     {
-        if (this_thread_hierarchy_value <= hierarchy_value)
+        if constexpr (is_arithmetic<T>::value && is_contiguous_arithmetic_iterator<Iterator>::value)
         {
-            throw logic_error("mutex hierarchy violated");
+            if (first != last)
+                result = simd_accumulate(&*first, &*first + (last - first), result);
+        }
+        else
+        {
+            result = accumulate(first, last, result);
         }
     }
-    void update_hierarchy_value()
+};
+
+// Как делить работу. min_per_thread - сколько элементов "стоимостью 1" должно
+// достаться блоку, чтобы он окупил постановку в пул; cost_per_element - во сколько
+// раз элемент дороже сложения int (для тяжёлых T блоки мельче); max_threads - 0 значит
+// по размеру пула; pool - где считать, по умолчанию общий пул программы
+struct accumulate_policy
+{
+    unsigned long min_per_thread = 32768;
+    double cost_per_element = 1.0;
+    unsigned max_threads = 0;
+    work_stealing_pool* pool = nullptr;
+};
+
+// Границы блоков за один проход. Для произвольного доступа - арифметикой,
+// для однонаправленных итераторов (forward_list и т.п.) - одним обходом,
+// а не advance на каждый блок с начала
+template<typename Iterator>
+vector<Iterator> split_into_blocks(Iterator first, Iterator last, unsigned long length, unsigned long num_blocks)
+{
+    vector<Iterator> bounds;
+    bounds.reserve(num_blocks + 1);
+    unsigned long const block_size = length / num_blocks;
+    unsigned long const remainder = length % num_blocks;
+    bounds.push_back(first);
+    for (unsigned long i = 0; i + 1 < num_blocks; ++i)
     {
-        previous_hierarchy_value = this_thread_hierarchy_value;
-        this_thread_hierarchy_value = hierarchy_value;
+        // Первые remainder блоков на элемент длиннее
+        advance(first, block_size + (i < remainder ? 1 : 0));
+        bounds.push_back(first);
     }
-public:
-    explicit hierarchial_mutex(unsigned long value):
-        hierarchy_value(value),
-        previous_hierarchy_value(0)
-    {}
-    void lock()
+    bounds.push_back(last);
+    return bounds;
+}
+
+// Движок свёртки: block(b, e) сворачивает непустой блок, combine склеивает
+// результаты. Блоки склеиваются строго слева направо, init - самый левый,
+// поэтому combine должна быть ассоциативной, но не обязана быть коммутативной.
+// Исключение из любого блока долетает до вызывающего (в книжке был бы terminate),
+// но только после того, как все блоки закончат - они пишут в наш стек
+template<typename Iterator, typename T, typename BlockFunc, typename Combine>
+T parallel_reduce_blocks(Iterator first, Iterator last, T init,
+                         BlockFunc block, Combine combine, accumulate_policy const& policy)
+{
+    unsigned long const length = distance(first, last);
+    if (!length)
+        return init;
+    work_stealing_pool& pool = policy.pool ? *policy.pool : default_thread_pool();
+    unsigned long const min_per_thread =
+        max(1ul, (unsigned long)(policy.min_per_thread / max(policy.cost_per_element, 1e-9)));
+    unsigned long const max_threads = (length + min_per_thread - 1) / min_per_thread;
+    unsigned long const available_threads = policy.max_threads ? policy.max_threads : pool.size();
+    unsigned long const num_threads = min(available_threads, max_threads);
+    if (num_threads <= 1)
+        return combine(move(init), block(first, last));
+    vector<Iterator> const bounds = split_into_blocks(first, last, length, num_threads);
+    vector<padded_value<optional<T>>> results(num_threads);
+    vector<future<void>> blocks;
+    exception_ptr error;
+    try
     {
-        check_for_hierarchy_violation();
-        internal_mutex.lock();
-        update_hierarchy_value();
+        for (unsigned long i = 0; i + 1 < num_threads; ++i)
+        {
+            Iterator const block_start = bounds[i];
+            Iterator const block_end = bounds[i + 1];
+            optional<T>* const result = &results[i].value;
+            blocks.push_back(pool.submit([block_start, block_end, result, &block]
+                {
+                    result->emplace(block(block_start, block_end));
+                }));
+        }
+        results[num_threads - 1].value.emplace(block(bounds[num_threads - 1], last));
     }
-    void unlock()
+    catch(...)
     {
-        if (this_thread_hierarchy_value != hierarchy_value)
-            throw logic_error("mutex hierarchy violated");
-        this_thread_hierarchy_value = previous_hierarchy_value;
-        internal_mutex.unlock();
+        error = current_exception();
     }
-    bool try_lock()
+    for (auto& f : blocks)
     {
-        check_for_hierarchy_violation();
-        if (!internal_mutex.try_lock())
-            return false;
-        update_hierarchy_value();
-        return true;
+        pool.run_pending_until_ready(f);
+        try
+        {
+            f.get();
+        }
+        catch(...)
+        {
+            if (!error) error = current_exception();
+        }
     }
-};
-
-thread_local unsigned long hierarchial_mutex::this_thread_hierarchy_value(ULONG_MAX);
-/* Конец листинга 3.8 */
-
-
+    if (error)
+        rethrow_exception(error);
+    for (auto& result : results)
+        init = combine(move(init), move(*result.value));
+    return init;
+}
 
-/* Листинг 3.7 (стр 87)
- * Не работает обез листинга 3.8, поэтому идёт не по порядку
- */
-// Собственно демка предыдущего листинга
-hierarchial_mutex high_level_mutex(10000);
-hierarchial_mutex low_level_mutex(5000);
-hierarchial_mutex other_mutex(6000);
-int do_low_level_stuff()
+template<typename Iterator, typename T, typename BinaryOp, typename UnaryOp>
+T parallel_transform_reduce(Iterator first, Iterator last, T init, BinaryOp op, UnaryOp transform,
+                            accumulate_policy const& policy = accumulate_policy())
 {
-    cout << "do_low_level_stuff() invoke (return 0)" << endl;
-    return 0;
+    return parallel_reduce_blocks(first, last, move(init),
+        [&op, &transform](Iterator block_start, Iterator block_end)
+        {
+            // Начинаем с первого элемента, а не с T() - нейтральный элемент у op может и не быть
+            T result = transform(*block_start);
+            for (++block_start; block_start != block_end; ++block_start)
+                result = op(move(result), transform(*block_start));
+            return result;
+        }, op, policy);
 }
-int low_level_func()
+
+template<typename Iterator, typename T, typename BinaryOp>
+T parallel_reduce(Iterator first, Iterator last, T init, BinaryOp op,
+                  accumulate_policy const& policy = accumulate_policy())
 {
-    lock_guard<hierarchial_mutex> lk(low_level_mutex);
-    return do_low_level_stuff();
+    return parallel_transform_reduce(first, last, move(init), op,
+        [](typename iterator_traits<Iterator>::reference value) -> decltype(auto) { return value; },
+        policy);
 }
-void high_level_stuff(int some_param)
+
+// Сумма - частный случай свёртки со своим векторизованным блоком
+template<typename Iterator, typename T>
+T parallel_accumulate(Iterator first, Iterator last, T init, accumulate_policy const& policy)
 {
-    cout << "high_level_stuff(" << some_param << ") invoked" << endl;
+    return parallel_reduce_blocks(first, last, init,
+        [](Iterator block_start, Iterator block_end)
+        {
+            T result = T();
+            accumulate_block<Iterator, T>()(block_start, block_end, result);
+            return result;
+        },
+        [](T lhs, T rhs){ return lhs + rhs; }, policy);
 }
-void high_level_func()
+
+template<typename Iterator, typename T>
+T parallel_accumulate(Iterator first, Iterator last, T init)
 {
-    lock_guard<hierarchial_mutex> lk(high_level_mutex);
-    high_level_stuff(low_level_func());
+    return parallel_accumulate(first, last, init, accumulate_policy());
 }
-void thread_a()
+
+// Запуск листинга
+void run29()
 {
-    high_level_func();
-}
-void do_other_stuff()
+    vector<int> v{1, 2, 3, 4};
+    int result = parallel_accumulate(v.begin(), v.end(), 10);
+    // возвращает 20, почему так - хз. разбираться лень
+    cout << "result is " << result << endl;
+}
+
+// Запуск: свёртка на forward_list, некоммутативная операция и исключение из блока
+void run_parallel_reduce()
 {
-    cout << "do_other_stuff() invoked" << endl;
+    forward_list<int> numbers;
+    for (int i = 100000; i > 0; --i)
+        numbers.push_front(i);
+    accumulate_policy policy;
+    policy.min_per_thread = 1000;
+    long long const sum_of_squares = parallel_transform_reduce(numbers.begin(), numbers.end(), 0ll,
+        plus<long long>(), [](int x){ return (long long)x * x; }, policy);
+    cout << "sum of squares: " << sum_of_squares << endl;
+    // Склейка строк не коммутативна, порядок должен сохраниться
+    vector<string> words;
+    for (int i = 0; i < 5000; ++i)
+        words.push_back(string(1, char('a' + i % 26)));
+    string const joined = parallel_reduce(words.begin(), words.end(), string(">"), plus<string>(), policy);
+    cout << "joined starts with: " << joined.substr(0, 30) << endl;
+    try
+    {
+        // long long: сумма 1..100000 в int переполнится раньше, чем дойдёт до 77777
+        parallel_reduce(numbers.begin(), numbers.end(), 0ll, [](long long lhs, long long rhs)
+            {
+                if (rhs == 77777) throw runtime_error("bad element 77777");
+                return lhs + rhs;
+            }, policy);
+    }
+    catch (exception const& e)
+    {
+        cout << "caught: " << e.what() << endl;
+    }
 }
-void other_stuff()
+
+// Бенчмарк: std::accumulate против parallel_accumulate на размерах от 1e2 до max_size.
+// На 1e9 int нужно 4 ГБ памяти, поэтому верхнюю границу можно задать
+void bench_parallel_accumulate(unsigned long max_size = 1000000000ul)
 {
-    high_level_func();
-    do_other_stuff();
+    vector<int> data(max_size);
+    for (unsigned long i = 0; i < max_size; ++i)
+        data[i] = int(i % 1000);
+    cout << "size  std::accumulate s  parallel_accumulate s" << endl;
+    bool crossed = false;
+    for (unsigned long size = 100; size <= max_size; size *= 10)
+    {
+        // Мелкие размеры гоняем много раз, иначе таймер их не видит
+        unsigned const repeats = (unsigned)max(1ul, 10000000ul / size);
+        long long sequential_sum = 0, parallel_sum = 0;
+        double const sequential = measure_seconds([&]
+            {
+                for (unsigned r = 0; r < repeats; ++r)
+                    sequential_sum += accumulate(data.begin(), data.begin() + size, 0ll);
+            }) / repeats;
+        double const parallel = measure_seconds([&]
+            {
+                for (unsigned r = 0; r < repeats; ++r)
+                    parallel_sum += parallel_accumulate(data.begin(), data.begin() + size, 0ll);
+            }) / repeats;
+        cout << size << "  " << sequential << "  " << parallel
+             << (sequential_sum == parallel_sum ? "" : "  MISMATCH") << endl;
+        if (!crossed && parallel < sequential)
+        {
+            crossed = true;
+            cout << "parallel_accumulate is faster from size " << size << endl;
+        }
+    }
 }
-void thread_b()
+/* Конец листинга 2.9 */
+
+
+
+/* Листинг 3.1 (стр 71) */
+// Демонстрация мутексов, нужны для синхронизации объектов, можно ставить лок
+list<int> some_list;
+mutex some_mutex;
+
+void add_to_list(int new_value)
 {
-    lock_guard<hierarchial_mutex> lk(other_mutex);
-    other_stuff();
+    // Вот тут лок ставится
+    lock_guard<mutex> guard(some_mutex);
+    some_list.push_back(new_value);
+}
+
+bool list_contains(int value_to_find)
+{
+    // Вот тут лок ставится
+    lock_guard<mutex> guard(some_mutex);
+    return find(some_list.begin(), some_list.end(), value_to_find) != some_list.end();
 }
 
 // Запуск листинга
-void run37()
+void run31()
 {
-    // падает с "mutex hierarchy violated", но в принципе работает
-    thread_a();
-    thread_b();
+    add_to_list(3);
+    add_to_list(4);
+    add_to_list(5);
+
+    cout << "Is list contains 6? " << (list_contains(6) ? "yes" : "no") << endl;
+    cout << "Is list contains 5? " << (list_contains(5) ? "yes" : "no") << endl;
 }
-/* Конец листинга 3.7 */
+/* Конец листинга 3.1 */
 
 
 
-/* Листинг 3.9 (стр 91) (похож на 3.6, тоже без функции запуска) */
-// Какой-то мутный объект, опять с локами, есть функция свапа объектов (зачем?)
-class X2
+/* Листинг 3.2 (стр 72) */
+// Опять синхронизация в другой обёртке
+class some_data
 {
-private:
-    some_big_object some_detail;
-    mutex m;
+    int a;
+    string b;
 public:
-    X2(some_big_object const& sd):some_detail(sd){}
-    friend void swap(X2& lhs, X2& rhs)
+    void do_something()
     {
-        if (&lhs == &rhs)
-            return;
-        unique_lock<mutex> lock_a(lhs.m, defer_lock);
-        unique_lock<mutex> lock_b(rhs.m, defer_lock);
-        lock(lock_a, lock_b);
-        swap(lhs.some_detail, rhs.some_detail);
+        cout << "instance of some_data do_something()" << endl;
     }
 };
-/* Конец листинга 3.9 */
-
-
 
-/* Листинг 3.10 (стр 96) */
-// Просто класс, ничего особенного не происходит
-// Опять мутексы и локи, ещё перегружен оператор сравнения (там неявно мутексы используются)
-class Y
+class data_wrapper
 {
 private:
-    int some_detail;
-    mutable mutex m;
-    int get_detail() const
-    {
-        lock_guard<mutex> lock_a(m);
-        return some_detail;
-    }
+    some_data data;
+    mutex m;
 public:
-    Y(int sd):some_detail(sd){}
-    friend bool operator==(Y const& lhs, Y const& rhs)
+    template<typename Function>
+    void process_data(Function func)
     {
-        if (&lhs == &rhs)
-            return true;
-        int const lhs_value = lhs.get_detail();
-        int const rhs_value = rhs.get_detail();
-        return lhs_value == rhs_value;
+        // Вот тут лок ставится
+        lock_guard<mutex> l(m);
+        func(data);
     }
 };
 
-// Запуск листинга
-void run310()
+some_data* unprotected;
+void malicious_function(some_data& protected_data)
 {
-    Y y1(5);
-    Y y2(5);
-    Y y3(10);
-
-    cout << "y1(5), y2(5), y3(10)" << endl;
-
-    cout << "y1 == y2 ? " << (y1 == y2) << endl;
-    cout << "y1 == y3 ? " << (y1 == y3) << endl;
-    cout << "y2 == y3 ? " << (y2 == y3) << endl;
-    cout << "y2 == y2 ? " << (y2 == y2) << endl;
+    unprotected = &protected_data;
 }
-/* Конец листинга 3.10 */
-
-
-
-/* Листинг 3.11 (стр 98) */
-// Загадочный shared_ptr, гугл про него что-то знает...
-shared_ptr<some_big_object> resource_ptr;
-mutex resource_mutex;
 
+data_wrapper x;
 // Запуск листинга
-void foo311()
+void foo()
 {
-    unique_lock<mutex> lk(resource_mutex);
-    if (!resource_ptr)
-        resource_ptr.reset(new some_big_object());
-    lk.unlock();
-    resource_ptr->do_something();
+    x.process_data(malicious_function);
+    unprotected->do_something();
 }
-/* Конец листинга 3.11 */
+/* Конец листинга 3.2 */
 
 
 
-/* Листинг 3.12 (стр 99)
- * Какие-то непонятные объекты, либу не нашёл
+/* Листинг 3.3 (стр 74)
+ * Это просто интерфейс без реализованных методов, смысла нет его делать.
+ * Код добавляю, чтобы показать, что он хотя бы собирается.
  */
-// Какой-то менеджер соединений с передачей/получением данных
-template<typename connection_info,
-         typename connection_handle,
-         typename data_packet,
-         typename connection_manager>
-class X3
+template<typename T, typename Container>
+class stack33
 {
-private:
-    connection_info connection_details;
-    connection_handle connection;
-    once_flag connection_init_flag;
-    void open_connection()
-    {
-        connection_manager cm;
-        connection = cm.open(connection_details);
-    }
 public:
-    X3(connection_info const& connection_details_):
-        connection_details(connection_details_)
-    {}
-    void send_data(data_packet const& data)
-    {
-        call_once(connection_init_flag, &X3::open_connection, this);
-        connection.send_data(data);
-    }
-    data_packet receive_data()
-    {
-        call_once(connection_init_flag, &X3::open_connection, this);
-        return connection.receive_data();
-    }
+    explicit stack33(const Container&);
+    explicit stack33(Container&& = Container());
+    template<class Alloc> explicit stack33(const Alloc&);
+    template<class Alloc> stack33(const Container&, const Alloc&);
+    template<class Alloc> stack33(Container&&, const Alloc&);
+    template<class Alloc> stack33(stack33&&, const Alloc&);
+    bool empty() const;
+    size_t size() const;
+    T& top();
+    T const& top() const;
+    void push(T const&);
+    void push(T&&);
+    void pop();
+    void swap(stack33&&);
+    template<class... Args> void emplace(Args&&... args);
 };
-/* Конец листинга 3.12 */
+/* Конец листинга 3.3 */
 
 
+/* Листинг 3.4 (стр 79)
+ * Опять интерфейс. Собирается, пусть будет. Реализацию не делаю.
+ */
+struct empty_stack: exception
+{
+    const char* what() const noexcept;
+};
 
-/* Листинг 3.13 (стр 102) */
-class dns_entry
+template<typename T>
+class threadsafe_stack
 {
 public:
-    dns_entry(){}
+    threadsafe_stack();
+    threadsafe_stack(const threadsafe_stack&);
+    threadsafe_stack& operator=(const threadsafe_stack&) = delete;
+    void push(T new_value);
+    shared_ptr<T> pop();
+    void pop(T& value);
+    bool empty() const;
 };
+/* Конец листинга 3.4 */
 
-// Пример реализации кэша (не обязательно DNS, по факту вообще любой объект можно использовать)
-class dns_cache
+
+
+/* Листинг 3.5 (стр 79) */
+struct empty_stack_35: exception
 {
-    map<string, dns_entry> entries;
-    mutable shared_mutex entry_mutex;
-public:
-    dns_cache(){}
-    dns_entry find_entry(string const& domain) const
-    {
-        cout << "find entry(" << domain << ") invoked" << endl;
-        shared_lock<shared_mutex> lk(entry_mutex);
-        map<string, dns_entry>::const_iterator const it = entries.find(domain);
-        return (it == entries.end()) ? dns_entry() : it->second;
-    }
-    void update_or_add_entry(string const& domain, dns_entry const& dns_details)
+    const char* what() const throw()
     {
-        cout << "update or add \"" << domain << "\"..." << endl;
-        lock_guard<shared_mutex> lk(entry_mutex);
-        entries[domain] = dns_details;
+        return "Empty stack exception";
     }
 };
 
-// Запуск листинга
-void run313()
+// Название говорит само за себя - потокобезопасный стэк
+// Лочим всё что можно когда изменяем данные
+template<typename T>
+class threadsafe_stack_35
 {
-    dns_cache dns_cache_inst;
-    dns_cache_inst.update_or_add_entry("google.com", dns_entry());
-    dns_cache_inst.update_or_add_entry("yandex.ru", dns_entry());
-    dns_cache_inst.find_entry("ya.ru");
-}
-/* Конец листинга 3.13 */
-
-
-
-/* Листинг 4.1 (стр 108)
- * Реализацию класса data_chunk нам не предложили, а там довольно много методов используется
- * К тому же есть ещё какие-то методы без реализации
- */
-
-// Заглушки
-class data_chunk {};
-bool more_data_to_prepare() {return false; }
-data_chunk prepare_data() { data_chunk d; return d; }
-void process(data_chunk dc) {}
-bool is_last_chunk(data_chunk) {return true; }
-
-// Потокобезопасная обработка данных с локами
-mutex mut;
-queue<data_chunk> data_queue;
-condition_variable data_cond;
-void data_preparation_thread()
-{
-    while (more_data_to_prepare())
+private:
+    stack<T> data;
+    mutable mutex m;
+public:
+    threadsafe_stack_35(){}
+    threadsafe_stack_35(const threadsafe_stack_35& other)
     {
-        data_chunk const data = prepare_data();
-        {
-            lock_guard<mutex> lk(mut);
-            data_queue.push(data);
-        }
-        data_cond.notify_one();
+        // Вот тут лок ставится
+        lock_guard<mutex> lock(other.m);
+        data = other.data;
     }
-}
-void data_processing_thread()
-{
-    while (true)
+    threadsafe_stack_35& operator=(const threadsafe_stack_35&) = delete;
+    void push(T new_value)
     {
-        unique_lock<mutex> lk(mut);
-        data_cond.wait(lk, []{return !data_queue.empty();});
-        data_chunk data = data_queue.front();
-        data_queue.pop();
-        lk.unlock();
-        process(data);
-        if (is_last_chunk(data)) break;
+        // Вот тут лок ставится
+        lock_guard<mutex> lock(m);
+        data.push(move(new_value));
+    }
+    shared_ptr<T> pop()
+    {
+        lock_guard<mutex> lock(m);
+        if (data.empty()) throw empty_stack_35();
+        shared_ptr<T> const res(make_shared<T>(data.top()));
+        data.pop();
+        return res;
+    }
+    void pop(T& value)
+    {
+        lock_guard<mutex> lock(m);
+        if (data.empty()) throw empty_stack_35();
+        value = data.top();
+        data.pop();
+    }
+    bool empty() const
+    {
+        lock_guard<mutex> lock(m);
+        return data.empty();
     }
+};
+
+// Запуск листинга
+void run35()
+{
+    threadsafe_stack_35<int> st;
+    st.push(1);
+    st.push(3);
+    st.push(2);
+
+    int val;
+    st.pop(val);
+
+    cout << "Is stack empty? " << (st.empty() ? "yes" : "no") << endl;
+    cout << "stack.pop() == " << val << endl;
 }
-/* Конец листинга 4.1 */
+/* Конец листинга 3.5 */
 
 
 
-/* Листинг 4.2 (стр 110)
- * Интерфейс опять...
- * Метода запуска, естественно, не будет
+/* Доработка: lock-free стек Трайбера на смену threadsafe_stack_35
+ * По мотивам главы 7 книжки. Вершина - атомарный указатель, push/pop
+ * меняют его через compare_exchange. Узлы нельзя удалять сразу после pop -
+ * другой поток мог успеть прочитать указатель и сейчас лезет в node->next.
+ * Поэтому удаление через указатели опасности (hazard pointers): поток
+ * публикует, какой узел сейчас читает, а удаляются только узлы, на которые
+ * никто не указывает. Заодно это снимает проблему ABA - узел не может
+ * переиспользоваться, пока кто-то держит его адрес.
  */
-template<class T, class Container = deque<T>>
-class queue
+// Ячейки указателей опасности, по одной на поток. Каждая на своей кэш-линии
+unsigned const max_hazard_pointers = 100;
+struct alignas(cache_line_size) hazard_pointer
 {
-public:
-    explicit queue(const Container&);
-    explicit queue(Container&& = Container());
-    template<class Alloc> explicit queue(const Alloc&);
-    template<class Alloc> queue(const Container&, const Alloc&);
-    template<class Alloc> queue(Container&&, const Alloc&);
-    template<class Alloc> queue(queue&&, const Alloc&);
-    void swap(queue& q);
-    bool empty() const;
-    size_t size() const;
-    T& front();
-    const T& front() const;
-    T& back();
-    const T& back() const;
-    void push(const T& x);
-    void push(T&& x);
-    void pop();
-    template<class... Args> void emplace(Args&&... args);
+    atomic<thread::id> id;
+    atomic<void*> pointer;
 };
-/* Конец листинга 4.2 */
-
+hazard_pointer hazard_pointers[max_hazard_pointers];
 
-
-/* Листинг 4.3 (стр 111)
- * И снова интерфейс
- */
-template<typename T>
-class threadsafe_queue43
+// Захватывает свободную ячейку при первом обращении потока и отдаёт при выходе
+class hp_owner
 {
+    hazard_pointer* hp;
 public:
-    threadsafe_queue43();
-    threadsafe_queue43(const threadsafe_queue43&);
-    threadsafe_queue43& operator=(const threadsafe_queue43&) = delete;
-    void push(T new_value);
-    bool try_pop(T& value);
-    shared_ptr<T> try_pop();
-    void wait_and_pop(T& value);
-    shared_ptr<T> wait_and_pop();
-    bool empty() const;
+    hp_owner(hp_owner const&) = delete;
+    hp_owner& operator=(hp_owner const&) = delete;
+    hp_owner():
+        hp(nullptr)
+    {
+        for (unsigned i = 0; i < max_hazard_pointers; ++i)
+        {
+            thread::id old_id;
+            if (hazard_pointers[i].id.compare_exchange_strong(old_id, this_thread::get_id()))
+            {
+                hp = &hazard_pointers[i];
+                break;
+            }
+        }
+        if (!hp)
+            throw runtime_error("No hazard pointers available");
+    }
+    atomic<void*>& get_pointer()
+    {
+        return hp->pointer;
+    }
+    ~hp_owner()
+    {
+        hp->pointer.store(nullptr);
+        hp->id.store(thread::id());
+    }
 };
-/* Конец листинга 4.3 */
 
+atomic<void*>& get_hazard_pointer_for_current_thread()
+{
+    thread_local static hp_owner hazard;
+    return hazard.get_pointer();
+}
 
+// Отложенное удаление. В книжке общий список и проход по всем указателям
+// на каждый pop, здесь у потока свой список, и чистим его пачкой, когда он
+// вырос вдвое больше числа ячеек - так проход окупается
+struct retired_node
+{
+    void* data;
+    void (*deleter)(void*);
+};
 
-/* Листинг 4.4 (стр 112) */
 template<typename T>
-class threadsafe_queue44
+void do_delete(void* p)
 {
-private:
-    mutex mut;
-    std::queue<T> data_queue;
-    condition_variable data_cond;
+    delete static_cast<T*>(p);
+}
+
+// Сюда сваливают недочищенное потоки, которые завершились
+mutex orphan_retired_mutex;
+vector<retired_node> orphan_retired_nodes;
+
+class retired_list
+{
+    vector<retired_node> nodes;
 public:
-    void push(T new_value)
+    void add(retired_node node)
     {
-        lock_guard<mutex> lk(mut);
-        data_queue.push(new_value);
-        data_cond.notify_one();
+        nodes.push_back(node);
+        if (nodes.size() >= 2 * max_hazard_pointers)
+            scan();
     }
-    void wait_and_pop(T& value)
+    void scan()
     {
-        unique_lock<mutex> lk(mut);
-        data_cond.wait(lk, [this]{return !data_queue.empty();});
-        value = data_queue.front();
-        data_queue.pop();
+        {
+            unique_lock<mutex> lk(orphan_retired_mutex, try_to_lock);
+            if (lk.owns_lock() && !orphan_retired_nodes.empty())
+            {
+                nodes.insert(nodes.end(), orphan_retired_nodes.begin(), orphan_retired_nodes.end());
+                orphan_retired_nodes.clear();
+            }
+        }
+        vector<void*> hazards;
+        hazards.reserve(max_hazard_pointers);
+        for (unsigned i = 0; i < max_hazard_pointers; ++i)
+        {
+            void* const p = hazard_pointers[i].pointer.load();
+            if (p) hazards.push_back(p);
+        }
+        sort(hazards.begin(), hazards.end());
+        auto const still_hazardous = partition(nodes.begin(), nodes.end(),
+            [&](retired_node const& n){ return binary_search(hazards.begin(), hazards.end(), n.data); });
+        for (auto it = still_hazardous; it != nodes.end(); ++it)
+            it->deleter(it->data);
+        nodes.erase(still_hazardous, nodes.end());
     }
-};
-
-// Опять загадочный data_chunk без реализации
-threadsafe_queue44<data_chunk> data_queue44;
-void data_preparation_thread44()
-{
-    while (more_data_to_prepare())
+    ~retired_list()
     {
-        data_chunk const data = prepare_data();
-        data_queue44.push(data);
+        scan();
+        if (!nodes.empty())
+        {
+            lock_guard<mutex> lk(orphan_retired_mutex);
+            orphan_retired_nodes.insert(orphan_retired_nodes.end(), nodes.begin(), nodes.end());
+        }
     }
-}
-void data_processing_thread44()
+};
+
+template<typename T>
+void reclaim_later(T* data)
 {
-    while (true)
-    {
-        data_chunk data;
-        data_queue44.wait_and_pop(data);
-        process(data);
-        if (is_last_chunk(data)) break;
-    }
+    thread_local static retired_list retired;
+    retired.add(retired_node{data, &do_delete<T>});
 }
-/* Конец листинга 4.4 */
-
 
-
-/* Листинг 4.5 (стр 113) */
-// Потокобезопасная очередь, похожа на стэк
 template<typename T>
-class threadsafe_queue45
+class lock_free_stack
 {
 private:
-    mutable mutex mut;
-    std::queue<T> data_queue;
-    condition_variable data_cond;
-public:
-    threadsafe_queue45(){}
-    threadsafe_queue45(threadsafe_queue45 const& other)
+    struct node
     {
-        lock_guard<mutex> lk(other.mut);
-        data_queue = other.data_queue;
+        shared_ptr<T> data;
+        node* next;
+        node(T data_):
+            data(make_shared<T>(move(data_))), next(nullptr)
+        {}
+    };
+    // Массив исключения (elimination backoff): при неудачном CAS на вершине
+    // push оставляет узел в случайной ячейке, а pop может забрать его оттуда -
+    // операции гасят друг друга, не трогая вершину
+    struct alignas(cache_line_size) elimination_slot
+    {
+        atomic<node*> offered;
+        elimination_slot():offered(nullptr){}
+    };
+    static unsigned const elimination_slots = 8;
+    static unsigned const elimination_spins = 128;
+
+    alignas(cache_line_size) atomic<node*> head;
+    bool const use_elimination;
+    unique_ptr<elimination_slot[]> elimination;
+
+    static unsigned random_slot()
+    {
+        thread_local unsigned state = hash<thread::id>()(this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % elimination_slots;
     }
-    void push(T new_value)
+    // Узел берём под свой указатель опасности до того, как выложить его в
+    // ячейку: забравший pop отдаёт его в reclaim_later, и адрес не
+    // переиспользуется, пока мы смотрим на ячейку
+    bool try_eliminate_push(node* new_node)
     {
-        lock_guard<mutex> lk(mut);
-        data_queue.push(new_value);
-        data_cond.notify_one();
+        atomic<node*>& slot = elimination[random_slot()].offered;
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread();
+        hp.store(new_node);
+        node* expected = nullptr;
+        if (!slot.compare_exchange_strong(expected, new_node))
+        {
+            hp.store(nullptr);
+            return false;
+        }
+        bool taken = false;
+        for (unsigned i = 0; i < elimination_spins && !taken; ++i)
+            taken = slot.load() != new_node;
+        if (!taken)
+        {
+            expected = new_node;
+            taken = !slot.compare_exchange_strong(expected, nullptr);
+        }
+        hp.store(nullptr);
+        return taken;
     }
-    void wait_and_pop(T& value)
+    node* try_eliminate_pop()
     {
-        unique_lock<mutex> lk(mut);
-        data_cond.wait(lk, [this]{return !data_queue.empty();});
-        value = data_queue.front();
-        data_queue.pop();
+        atomic<node*>& slot = elimination[random_slot()].offered;
+        node* offered = slot.load();
+        if (offered && slot.compare_exchange_strong(offered, nullptr))
+            return offered;
+        return nullptr;
     }
-    shared_ptr<T> wait_and_pop()
+    node* pop_node()
     {
-        unique_lock<mutex> lk(mut);
-        data_cond.wait(lk, [this]{return !data_queue.empty();});
-        shared_ptr<T> res(make_shared<T>(data_queue.front()));
-        data_queue.pop();
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread();
+        node* old_head = head.load();
+        for (;;)
+        {
+            // Публикуем указатель и проверяем, что вершина не сменилась,
+            // пока мы это делали - иначе узел могли уже удалить
+            node* temp;
+            do
+            {
+                temp = old_head;
+                hp.store(old_head);
+                old_head = head.load();
+            } while (old_head != temp);
+            if (!old_head) break;
+            if (head.compare_exchange_strong(old_head, old_head->next)) break;
+            if (use_elimination)
+            {
+                hp.store(nullptr);
+                if (node* const eliminated = try_eliminate_pop()) return eliminated;
+                old_head = head.load();
+            }
+        }
+        hp.store(nullptr);
+        return old_head;
+    }
+    shared_ptr<T> take_data(node* n)
+    {
+        shared_ptr<T> res;
+        res.swap(n->data);
+        reclaim_later(n);
         return res;
     }
-    bool try_pop(T& value)
+public:
+    explicit lock_free_stack(bool use_elimination_ = false):
+        head(nullptr), use_elimination(use_elimination_)
     {
-        lock_guard<mutex> lk(mut);
-        if (data_queue.empty()) return false;
-        value = data_queue.front();
-        data_queue.pop();
-        return true;
+        if (use_elimination)
+            elimination.reset(new elimination_slot[elimination_slots]);
     }
-    shared_ptr<T> try_pop()
+    lock_free_stack(const lock_free_stack&) = delete;
+    lock_free_stack& operator=(const lock_free_stack&) = delete;
+    ~lock_free_stack()
     {
-        lock_guard<mutex> lk(mut);
-        if (data_queue.empty()) return shared_ptr<T>();
-        shared_ptr<T> res(make_shared<T>(data_queue.front()));
-        data_queue.pop();
-        return res;
+        node* n = head.load();
+        while (n)
+        {
+            node* const next = n->next;
+            delete n;
+            n = next;
+        }
     }
-    bool empty() const
+    void push(T new_value)
     {
-        lock_guard<mutex> lk(mut);
-        return data_queue.empty();
+        node* const new_node = new node(move(new_value));
+        new_node->next = head.load();
+        while (!head.compare_exchange_weak(new_node->next, new_node))
+        {
+            if (use_elimination && try_eliminate_push(new_node)) return;
+            new_node->next = head.load();
+        }
     }
-};
-
-// Запуск листинга
-void run45()
+    // Как у threadsafe_stack_35: на пустом стеке исключение
+    shared_ptr<T> pop()
+    {
+        node* const old_head = pop_node();
+        if (!old_head) throw empty_stack_35();
+        return take_data(old_head);
+    }
+    void pop(T& value)
+    {
+        if (!try_pop(value)) throw empty_stack_35();
+    }
+    bool try_pop(T& value)
+    {
+        node* const old_head = pop_node();
+        if (!old_head) return false;
+        value = move(*take_data(old_head));
+        return true;
+    }
+    bool empty() const
+    {
+        return head.load() == nullptr;
+    }
+};
+
+// Запуск
+void run_lock_free_stack()
 {
-    threadsafe_queue45<int> tq;
-    tq.push(5);
-    tq.push(10);
-    tq.push(15);
+    lock_free_stack<int> st;
+    st.push(1);
+    st.push(3);
+    st.push(2);
 
-    cout << "Is empty? " << (tq.empty()) << endl;
-    cout << "push 5, 10, 15" << endl;
-    cout << "Is empty? " << (tq.empty()) << endl;
-    int pvar;
-    tq.try_pop(pvar);
-    cout << "try_pop(int): " << pvar << endl; // pvar == 5
+    int val;
+    st.pop(val);
+
+    cout << "Is stack empty? " << (st.empty() ? "yes" : "no") << endl;
+    cout << "stack.pop() == " << val << endl;
 }
-/* Конец листинга 4.5 */
 
-/* Листинг 4.6 (стр 117) */
-// Пример работы с future task (как я понял, это типа запланированные операции, ленивое выполнение и всё такое)
-int find_the_answer_to_ltuae()
+// Бенчмарк: потоки поровну делают push и pop. Пустой стек ловим через исключение,
+// как и положено для threadsafe_stack_35
+template<typename Stack>
+double stack_throughput(Stack& st, unsigned threads_count, unsigned ops_per_thread)
 {
-    return 123;
+    double const seconds = measure_seconds([&]
+        {
+            vector<thread> threads;
+            for (unsigned t = 0; t < threads_count; ++t)
+                threads.emplace_back([&st, ops_per_thread]
+                    {
+                        int value = 0;
+                        for (unsigned i = 0; i < ops_per_thread; ++i)
+                        {
+                            st.push(int(i));
+                            try
+                            {
+                                st.pop(value);
+                            }
+                            catch (empty_stack_35 const&) {}
+                        }
+                    });
+            for (auto& t : threads) t.join();
+        });
+    return 2.0 * threads_count * ops_per_thread / seconds;
 }
 
-// Запуск листинга
-void run46()
+void bench_lock_free_stack()
 {
-    future<int> the_answer = async(find_the_answer_to_ltuae);
-    do_other_stuff();
-    cout << "The answer is " << the_answer.get() << endl;
+    unsigned const ops_per_thread = 100000;
+    cout << "threads  threadsafe_stack_35 ops/s  lock_free_stack ops/s  with elimination ops/s" << endl;
+    for (unsigned n = 1; n <= 32; n *= 2)
+    {
+        threadsafe_stack_35<int> locked;
+        lock_free_stack<int> plain;
+        lock_free_stack<int> eliminating(true);
+        cout << n << "  " << (unsigned long)stack_throughput(locked, n, ops_per_thread)
+             << "  " << (unsigned long)stack_throughput(plain, n, ops_per_thread)
+             << "  " << (unsigned long)stack_throughput(eliminating, n, ops_per_thread) << endl;
+    }
 }
-/* Конец листинга 4.6 */
+/* Конец доработки: lock-free стек */
 
-/* Листинг 4.7 (стр 117) */
-// Опять интерфейсы и какие-то поля, всё в куче, ничего не понятно
-struct X47
-{
-    void foo(int, string const&) {}
-    string bar(string const&) { return ""; }
-};
-X47 x47;
-auto f1 = async(&X47::foo, &x47, 42, "hello");
-auto f2 = async(&X47::bar, x47, "goodbye");
-struct Y47
+
+
+/* Листинг 3.6 (стр 82) */
+// Реализацию класса some_big_object и метода swap(...) нам не показали,
+// поэтому функцию запуска не буду добавлять
+// добавлю только функцию do_something() в класс some_big_object - понадобится в 3.11
+class some_big_object
 {
-    double operator()(double) {return 0.0;}
+public:
+    void do_something()
+    {
+        cout << "some_big_object#do_something() invoked" << endl;
+    }
 };
-Y47 y47;
-auto f3 = async(Y47(), 3.141);
-auto f4 = async(ref(y47), 2.718);
-X47 baz(X&);
-// async(baz, ref(x47));
-class move_only
+void swap(some_big_object& lhs, some_big_object& rhs);
+class X
 {
+private:
+    some_big_object some_detail;
+    mutex m;
 public:
-    move_only();
-    move_only(move_only&&);
-    move_only(move_only const&) = delete;
-    move_only& operator=(move_only&&);
-    move_only& operator=(move_only const&) = delete;
-    void operator()();
+    X(some_big_object const& sd):some_detail(sd){}
+    friend void swap(X& lhs, X& rhs)
+    {
+        if (&lhs == &rhs)
+            return;
+        lock(lhs.m, rhs.m);
+        lock_guard<mutex> lock_a(lhs.m, adopt_lock);
+        lock_guard<mutex> lock_b(rhs.m, adopt_lock);
+        swap(lhs.some_detail, rhs.some_detail);
+    }
 };
-// Требует реализации move_only...
-// auto f5 = async(move_only());
-/* Конец листинга 4.7 */
+/* Конец листинга 3.6 */
 
-/* Листинг 4.8 (стр 119) */
-// Интерфейс...
-class packaged_task48
+
+
+/* Листинг 3.8 (стр 89) */
+// Какой-то хитровыделанный мутекс с иерархией
+//
+// Доработка: три варианта сборки, выбираются флагом компилятора
+//   по умолчанию                   - проверка иерархии из книжки, бросает logic_error
+//   -DHIERARCHIAL_MUTEX_RELEASE    - голый mutex, никаких thread_local, для проверенных сборок
+//   -DHIERARCHIAL_MUTEX_LOCK_GRAPH - граф порядка захвата как в TSan: запоминает рёбра
+//                                    "держал A - взял B" между всеми мутексами и один раз
+//                                    на ребро сообщает о цикле (потенциальном дедлоке) со стеками
+#if defined(HIERARCHIAL_MUTEX_RELEASE)
+class hierarchial_mutex
 {
+    mutex internal_mutex;
+    unsigned long const hierarchy_value;
 public:
-    template<typename Callable>
-    explicit packaged_task48(Callable&& f);
-    future<string> get_future();
-    void operator()(vector<char>*, int);
+    explicit hierarchial_mutex(unsigned long value):
+        hierarchy_value(value)
+    {}
+    unsigned long get_hierarchy_value() const
+    {
+        return hierarchy_value;
+    }
+    void lock()
+    {
+        internal_mutex.lock();
+    }
+    void unlock()
+    {
+        internal_mutex.unlock();
+    }
+    bool try_lock()
+    {
+        return internal_mutex.try_lock();
+    }
 };
-/* Конец листинга 4.8 */
-
-/* Листинг 4.9 (стр 120) */
-// Собирается, но реализаций для функций не предоставили
-// Поэтому запускать не будем
-mutex m49;
-deque<packaged_task<void()>> tasks;
-bool gui_shutdown_message_received()
+#elif defined(HIERARCHIAL_MUTEX_LOCK_GRAPH)
+// Общий граф для всех мутексов. Рёбра - битовая матрица, поэтому на быстром
+// пути (ребро уже известно) только чтение одного слова без блокировок.
+// Новое ребро - под мутексом: запоминаем стек и ищем путь обратно (цикл)
+class lock_order_graph
 {
-    return true;
-}
-void get_and_process_gui_message(){}
-void gui_thread()
-{
-    while (!gui_shutdown_message_received())
+public:
+    static constexpr unsigned max_tracked_locks = 1024;
+    static constexpr unsigned max_stack_depth = 32;
+private:
+    atomic<uint64_t> edge_bits[max_tracked_locks * max_tracked_locks / 64];
+    mutex graph_mutex;
+    vector<vector<unsigned>> successors;
+    map<pair<unsigned, unsigned>, vector<void*>> edge_stacks;
+    vector<unsigned long> hierarchy_values;
+    // Номера живых мутексов; освободившиеся идут в free_ids и выдаются снова
+    unsigned next_id;
+    vector<unsigned> free_ids;
+    bool limit_reported;
+
+    static vector<void*> capture_stack()
     {
-        get_and_process_gui_message();
-        packaged_task<void()> task;
+        vector<void*> frames(max_stack_depth);
+#if defined(__GLIBC__)
+        frames.resize(backtrace(frames.data(), max_stack_depth));
+#else
+        frames.clear();
+#endif
+        return frames;
+    }
+    static void print_stack(vector<void*> const& frames)
+    {
+#if defined(__GLIBC__)
+        backtrace_symbols_fd(frames.data(), frames.size(), 2);
+#else
+        cerr << "  (stack unavailable)" << endl;
+#endif
+    }
+    // Путь from -> to по известным рёбрам, под graph_mutex
+    bool find_path(unsigned from, unsigned to, vector<unsigned>& path)
+    {
+        vector<unsigned> parent(successors.size(), UINT_MAX);
+        vector<unsigned> pending{from};
+        parent[from] = from;
+        while (!pending.empty())
         {
-            lock_guard<mutex> lk(m49);
-            if (tasks.empty()) continue;
-            task = move(tasks.front());
-            tasks.pop_front();
+            unsigned const current = pending.back();
+            pending.pop_back();
+            if (current == to)
+            {
+                for (unsigned n = to; n != from; n = parent[n])
+                    path.push_back(n);
+                path.push_back(from);
+                reverse(path.begin(), path.end());
+                return true;
+            }
+            for (unsigned next : successors[current])
+            {
+                if (parent[next] == UINT_MAX)
+                {
+                    parent[next] = current;
+                    pending.push_back(next);
+                }
+            }
         }
-        task();
+        return false;
     }
-}
-// Вот эта строчка гадость делает - этот поток висит в воздухе
-// Лучше закомментировать, всё равно не используется нигде
-// thread gui_bg_thread(gui_thread);
-template<typename Func>
-future<void> post_task_for_gui_thread(Func f)
-{
-    packaged_task<void()> task(f);
-    future<void> res = task.get_future();
-    lock_guard<mutex> lk(m49);
-    tasks.push_back(move(task));
-    return res;
-}
-/* Конец листинга 4.9 */
-
-/* Листинг 4.10 (стр 122) */
-// Откуда connection_set?
-// Обработка соединений с promise
-template<typename connection_set,
-         typename connection_iterator,
-         typename data_packet,
-         typename payload_type,
-         typename outgoing_packet>
-void process_connections(connection_set& connections)
-{
-    while (!done(connections))
+    void add_edge(unsigned from, unsigned to)
     {
-        for(connection_iterator
-                connection = connections.begin(), end = connections.end();
-            connection != end;
-            ++connection)
+        if (from == to) return;
+        lock_guard<mutex> lk(graph_mutex);
+        uint64_t const bit = uint64_t(1) << ((from * max_tracked_locks + to) % 64);
+        atomic<uint64_t>& word = edge_bits[(from * max_tracked_locks + to) / 64];
+        if (word.load() & bit) return;
+        word.fetch_or(bit);
+        if (successors.size() < max_tracked_locks) successors.resize(max_tracked_locks);
+        vector<void*> stack = capture_stack();
+        vector<unsigned> path;
+        // Уже был путь to -> ... -> from, а теперь from -> to: цикл
+        if (find_path(to, from, path))
         {
-            if (connection->has_incoming_data())
+            cerr << "potential deadlock: lock order cycle";
+            for (unsigned n : path)
+                cerr << " #" << n << "(" << hierarchy_values[n] << ")";
+            cerr << " #" << to << "(" << hierarchy_values[to] << ")" << endl;
+            cerr << "new edge #" << from << " -> #" << to << " acquired at:" << endl;
+            print_stack(stack);
+            for (size_t i = 0; i + 1 < path.size(); ++i)
             {
-                data_packet data = connection->incoming();
-                promise<payload_type>& p = connection->get_promise(data.id);
-                p.set_value(data.payload);
+                cerr << "edge #" << path[i] << " -> #" << path[i + 1] << " first acquired at:" << endl;
+                print_stack(edge_stacks[make_pair(path[i], path[i + 1])]);
             }
-            if (connection->has_outgoing_data())
+        }
+        successors[from].push_back(to);
+        edge_stacks[make_pair(from, to)] = move(stack);
+    }
+public:
+    lock_order_graph():
+        next_id(0), limit_reported(false)
+    {
+        for (auto& word : edge_bits) word.store(0, memory_order_relaxed);
+        hierarchy_values.resize(max_tracked_locks);
+    }
+    // Номер для нового мутекса. Если живых уже max_tracked_locks, новый не
+    // отслеживается (номер max_tracked_locks) - об этом пишем один раз
+    unsigned register_lock(unsigned long hierarchy_value)
+    {
+        lock_guard<mutex> lk(graph_mutex);
+        unsigned id;
+        if (!free_ids.empty())
+        {
+            id = free_ids.back();
+            free_ids.pop_back();
+        }
+        else if (next_id < max_tracked_locks)
+        {
+            id = next_id++;
+        }
+        else
+        {
+            if (!limit_reported)
             {
-                outgoing_packet data = connection->top_of_outgoing_queue();
-                connection->send(data.payload);
-                data.promise.set_value(true);
+                limit_reported = true;
+                cerr << "lock order graph: more than " << max_tracked_locks
+                     << " live hierarchial_mutex, new ones are not tracked" << endl;
             }
+            return max_tracked_locks;
         }
+        hierarchy_values[id] = hierarchy_value;
+        return id;
     }
-}
-/* Конец листинга 4.10 */
-
-/* Листинг 4.11 (стр 133) */
-// Без функции запуска
-condition_variable cv411;
-bool done411;
-mutex m411;
-bool wait_loop()
-{
-    auto const timeout = chrono::steady_clock::now() + chrono::milliseconds(500);
-    unique_lock<mutex> lk(m411);
-    while (!done411)
+    // Мутекс разрушен: стираем его рёбра в обе стороны и отдаём номер
+    void unregister_lock(unsigned id)
     {
-        if (cv411.wait_until(lk, timeout) == cv_status::timeout) break;
+        if (id >= max_tracked_locks) return;
+        lock_guard<mutex> lk(graph_mutex);
+        unsigned const words_per_row = max_tracked_locks / 64;
+        uint64_t const column_bit = uint64_t(1) << (id % 64);
+        for (unsigned i = 0; i < words_per_row; ++i)
+            edge_bits[id * words_per_row + i].store(0, memory_order_relaxed);
+        for (unsigned from = 0; from < max_tracked_locks; ++from)
+            edge_bits[from * words_per_row + id / 64].fetch_and(~column_bit, memory_order_relaxed);
+        if (id < successors.size())
+        {
+            successors[id].clear();
+            for (auto& next : successors)
+                next.erase(remove(next.begin(), next.end(), id), next.end());
+        }
+        for (auto it = edge_stacks.begin(); it != edge_stacks.end();)
+        {
+            if (it->first.first == id || it->first.second == id)
+                it = edge_stacks.erase(it);
+            else
+                ++it;
+        }
+        free_ids.push_back(id);
     }
-    return done411;
+    // Оба номера меньше max_tracked_locks - это проверяет вызывающий
+    void on_acquire(unsigned from, unsigned to)
+    {
+        size_t const index = from * max_tracked_locks + to;
+        if (!(edge_bits[index / 64].load(memory_order_relaxed) & (uint64_t(1) << (index % 64))))
+            add_edge(from, to);
+    }
+};
+
+lock_order_graph& global_lock_order_graph()
+{
+    static lock_order_graph graph;
+    return graph;
 }
-/* Конец листинга 4.11 */
 
-/* Листинг 4.12 (стр ) */
-// Быстрая сортировка в один поток
-template<typename T>
-list<T> sequential_quick_sort(list<T> input)
+// Ребро пишем только от последнего обычного захвата (и от взятых через
+// try_lock поверх него): от остальных удерживаемых мутексов к нему путь
+// в графе уже есть, так что цикл через них всё равно найдётся. На быстром
+// пути это одно чтение бита, как одно сравнение в проверке иерархии
+class hierarchial_mutex
 {
-    if (input.empty()) return input;
-    list<T> result;
-    result.splice(result.begin(), input, input.begin());
-    T const& pivot = *result.begin();
-    auto divide_point = partition(input.begin(), input.end(),
-                                  [&](T const& t){return t < pivot;});
-    list<T> lower_part;
+    // Что держит текущий поток. Глубже 32 вложенных захватов не следим
+    static constexpr unsigned max_held = 32;
+    // Помечает мутексы, взятые через try_lock
+    static constexpr unsigned try_locked_bit = 1u << 31;
+    // Всё инициализировано константой - иначе каждое обращение к
+    // thread_local проверяет флаг ленивой инициализации
+    struct held_locks
+    {
+        unsigned ids[max_held] = {};
+        unsigned count = 0;
+    };
+    static thread_local held_locks this_thread_held;
+    mutex internal_mutex;
+    unsigned long const hierarchy_value;
+    lock_order_graph& graph;
+    unsigned const id;
+
+    void push_held(unsigned entry)
+    {
+        if (this_thread_held.count < max_held)
+            this_thread_held.ids[this_thread_held.count] = entry;
+        ++this_thread_held.count;
+    }
+public:
+    explicit hierarchial_mutex(unsigned long value):
+        hierarchy_value(value),
+        graph(global_lock_order_graph()),
+        id(graph.register_lock(value))
+    {}
+    ~hierarchial_mutex()
+    {
+        graph.unregister_lock(id);
+    }
+    unsigned long get_hierarchy_value() const
+    {
+        return hierarchy_value;
+    }
+    bool tracked() const
+    {
+        return id < lock_order_graph::max_tracked_locks;
+    }
+    // Рёбра пишем до захвата - чтобы отчёт успел выйти, даже если тут и зависнем.
+    // Мутексы сверх max_tracked_locks в списке удерживаемых не появляются
+    void lock()
+    {
+        unsigned const held = this_thread_held.count;
+        if (tracked() && held <= max_held)
+        {
+            for (unsigned i = held; i-- > 0;)
+            {
+                unsigned const entry = this_thread_held.ids[i];
+                graph.on_acquire(entry & ~try_locked_bit, id);
+                if (!(entry & try_locked_bit)) break;
+            }
+        }
+        internal_mutex.lock();
+        if (tracked()) push_held(id);
+    }
+    void unlock()
+    {
+        if (!tracked())
+        {
+            internal_mutex.unlock();
+            return;
+        }
+        // Обычно отпускают в обратном порядке - тогда просто снимаем вершину.
+        // Иначе ищем свой номер с конца и сдвигаем остальные
+        unsigned const tracked = min(this_thread_held.count, max_held);
+        if (tracked != 0 && (this_thread_held.ids[tracked - 1] & ~try_locked_bit) != id)
+        {
+            for (unsigned i = tracked - 1; i-- > 0;)
+            {
+                if ((this_thread_held.ids[i] & ~try_locked_bit) == id)
+                {
+                    copy(this_thread_held.ids + i + 1, this_thread_held.ids + tracked, this_thread_held.ids + i);
+                    break;
+                }
+            }
+        }
+        --this_thread_held.count;
+        internal_mutex.unlock();
+    }
+    // try_lock сам дедлок не создаёт, ребро не пишем
+    bool try_lock()
+    {
+        if (!internal_mutex.try_lock())
+            return false;
+        if (tracked()) push_held(id | try_locked_bit);
+        return true;
+    }
+};
+
+thread_local hierarchial_mutex::held_locks hierarchial_mutex::this_thread_held;
+#else
+class hierarchial_mutex
+{
+    mutex internal_mutex;
+    unsigned long const hierarchy_value;
+    unsigned long previous_hierarchy_value;
+    static thread_local unsigned long this_thread_hierarchy_value;
+    void check_for_hierarchy_violation()
+    {
+        if (this_thread_hierarchy_value <= hierarchy_value)
+        {
+            throw logic_error("mutex hierarchy violated");
+        }
+    }
+    void update_hierarchy_value()
+    {
+        previous_hierarchy_value = this_thread_hierarchy_value;
+        this_thread_hierarchy_value = hierarchy_value;
+    }
+public:
+    explicit hierarchial_mutex(unsigned long value):
+        hierarchy_value(value),
+        previous_hierarchy_value(0)
+    {}
+    unsigned long get_hierarchy_value() const
+    {
+        return hierarchy_value;
+    }
+    void lock()
+    {
+        check_for_hierarchy_violation();
+        internal_mutex.lock();
+        update_hierarchy_value();
+    }
+    void unlock()
+    {
+        if (this_thread_hierarchy_value != hierarchy_value)
+            throw logic_error("mutex hierarchy violated");
+        this_thread_hierarchy_value = previous_hierarchy_value;
+        internal_mutex.unlock();
+    }
+    bool try_lock()
+    {
+        check_for_hierarchy_violation();
+        if (!internal_mutex.try_lock())
+            return false;
+        update_hierarchy_value();
+        return true;
+    }
+};
+
+thread_local unsigned long hierarchial_mutex::this_thread_hierarchy_value(ULONG_MAX);
+#endif
+
+// Запуск: сначала правильный порядок, потом обратный.
+// Проверка иерархии бросит исключение, граф сообщит о цикле, release промолчит
+void run38()
+{
+    hierarchial_mutex first(100);
+    hierarchial_mutex second(50);
+    {
+        lock_guard<hierarchial_mutex> lk_first(first);
+        lock_guard<hierarchial_mutex> lk_second(second);
+    }
+    try
+    {
+        lock_guard<hierarchial_mutex> lk_second(second);
+        lock_guard<hierarchial_mutex> lk_first(first);
+        cout << "reverse order locked" << endl;
+    }
+    catch (logic_error const& e)
+    {
+        cout << "reverse order: " << e.what() << endl;
+    }
+}
+
+// Бенчмарк быстрого пути: один поток берёт три мутекса сверху вниз и
+// отпускает. Вариант выбран при сборке, поэтому для сравнения собираем
+// с разными флагами; std::mutex - точка отсчёта в том же запуске.
+// Разница в единицы наносекунд, так что берём лучший из нескольких замеров
+void bench_hierarchial_mutex(unsigned long rounds = 10000000, unsigned repeats = 5)
+{
+#if defined(HIERARCHIAL_MUTEX_RELEASE)
+    char const* const flavour = "release";
+#elif defined(HIERARCHIAL_MUTEX_LOCK_GRAPH)
+    char const* const flavour = "lock graph";
+#else
+    char const* const flavour = "hierarchy check";
+#endif
+    mutex plain[3];
+    hierarchial_mutex high(300);
+    hierarchial_mutex middle(200);
+    hierarchial_mutex low(100);
+    double plain_seconds = numeric_limits<double>::max();
+    double seconds = numeric_limits<double>::max();
+    for (unsigned r = 0; r < repeats; ++r)
+    {
+        plain_seconds = min(plain_seconds, measure_seconds([&]
+            {
+                for (unsigned long i = 0; i < rounds; ++i)
+                {
+                    lock_guard<mutex> lk_high(plain[0]);
+                    lock_guard<mutex> lk_middle(plain[1]);
+                    lock_guard<mutex> lk_low(plain[2]);
+                }
+            }));
+        seconds = min(seconds, measure_seconds([&]
+            {
+                for (unsigned long i = 0; i < rounds; ++i)
+                {
+                    lock_guard<hierarchial_mutex> lk_high(high);
+                    lock_guard<hierarchial_mutex> lk_middle(middle);
+                    lock_guard<hierarchial_mutex> lk_low(low);
+                }
+            }));
+    }
+    double const pairs = 3.0 * rounds;
+    cout << "std::mutex  " << plain_seconds * 1e9 / pairs << " ns per lock/unlock" << endl;
+    cout << "hierarchial_mutex (" << flavour << ")  " << seconds * 1e9 / pairs << " ns per lock/unlock" << endl;
+}
+/* Конец листинга 3.8 */
+
+
+
+/* Листинг 3.7 (стр 87)
+ * Не работает обез листинга 3.8, поэтому идёт не по порядку
+ */
+// Собственно демка предыдущего листинга
+hierarchial_mutex high_level_mutex(10000);
+hierarchial_mutex low_level_mutex(5000);
+hierarchial_mutex other_mutex(6000);
+int do_low_level_stuff()
+{
+    cout << "do_low_level_stuff() invoke (return 0)" << endl;
+    return 0;
+}
+int low_level_func()
+{
+    lock_guard<hierarchial_mutex> lk(low_level_mutex);
+    return do_low_level_stuff();
+}
+void high_level_stuff(int some_param)
+{
+    cout << "high_level_stuff(" << some_param << ") invoked" << endl;
+}
+void high_level_func()
+{
+    lock_guard<hierarchial_mutex> lk(high_level_mutex);
+    high_level_stuff(low_level_func());
+}
+void thread_a()
+{
+    high_level_func();
+}
+void do_other_stuff()
+{
+    cout << "do_other_stuff() invoked" << endl;
+}
+void other_stuff()
+{
+    high_level_func();
+    do_other_stuff();
+}
+void thread_b()
+{
+    lock_guard<hierarchial_mutex> lk(other_mutex);
+    other_stuff();
+}
+
+// Запуск листинга
+void run37()
+{
+    // падает с "mutex hierarchy violated", но в принципе работает
+    thread_a();
+    thread_b();
+}
+/* Конец листинга 3.7 */
+
+
+
+/* Листинг 3.9 (стр 91) (похож на 3.6, тоже без функции запуска) */
+// Какой-то мутный объект, опять с локами, есть функция свапа объектов (зачем?)
+class X2
+{
+private:
+    some_big_object some_detail;
+    mutex m;
+public:
+    X2(some_big_object const& sd):some_detail(sd){}
+    friend void swap(X2& lhs, X2& rhs)
+    {
+        if (&lhs == &rhs)
+            return;
+        unique_lock<mutex> lock_a(lhs.m, defer_lock);
+        unique_lock<mutex> lock_b(rhs.m, defer_lock);
+        lock(lock_a, lock_b);
+        swap(lhs.some_detail, rhs.some_detail);
+    }
+};
+/* Конец листинга 3.9 */
+
+
+
+/* Доработка: захват произвольного набора мутексов без дедлока
+ * swap из 3.6 и 3.9 умеет лочить только два мутекса через std::lock, а тот
+ * на каждом неудачном try_lock отпускает всё и начинает заново - под
+ * нагрузкой это может крутиться долго. Здесь мутексы сортируются по рангу
+ * и берутся строго по порядку, обычным lock(), без откатов: раз все потоки
+ * берут в одном порядке, цикла ожидания не бывает. Ранг по умолчанию - адрес,
+ * для hierarchial_mutex - уровень иерархии (старшие первыми), тогда и
+ * проверка иерархии не падает.
+ */
+template<typename Lockable>
+struct lock_rank
+{
+    static uintptr_t of(Lockable const&)
+    {
+        return 0;
+    }
+};
+
+template<>
+struct lock_rank<hierarchial_mutex>
+{
+    static uintptr_t of(hierarchial_mutex const& m)
+    {
+        return ULONG_MAX - m.get_hierarchy_value();
+    }
+};
+
+template<typename Lockable>
+class scoped_multi_lock
+{
+    // До 16 мутексов обходимся без кучи
+    static size_t const inline_capacity = 16;
+    Lockable* inline_locks[inline_capacity];
+    vector<Lockable*> overflow_locks;
+    Lockable** locks;
+    size_t count;
+
+    static bool lock_before(Lockable* lhs, Lockable* rhs)
+    {
+        uintptr_t const lhs_rank = lock_rank<Lockable>::of(*lhs);
+        uintptr_t const rhs_rank = lock_rank<Lockable>::of(*rhs);
+        if (lhs_rank != rhs_rank) return lhs_rank < rhs_rank;
+        return less<Lockable*>()(lhs, rhs);
+    }
+    template<typename Iterator>
+    void lock_all(Iterator first, Iterator last)
+    {
+        count = distance(first, last);
+        if (count <= inline_capacity)
+        {
+            copy(first, last, inline_locks);
+            locks = inline_locks;
+        }
+        else
+        {
+            overflow_locks.assign(first, last);
+            locks = overflow_locks.data();
+        }
+        sort(locks, locks + count, &scoped_multi_lock::lock_before);
+        // Один и тот же объект в наборе дважды лочить нельзя
+        count = unique(locks, locks + count) - locks;
+        size_t locked = 0;
+        try
+        {
+            for (; locked < count; ++locked)
+                locks[locked]->lock();
+        }
+        catch(...)
+        {
+            while (locked) locks[--locked]->unlock();
+            throw;
+        }
+    }
+public:
+    scoped_multi_lock(initializer_list<Lockable*> to_lock)
+    {
+        lock_all(to_lock.begin(), to_lock.end());
+    }
+    explicit scoped_multi_lock(vector<Lockable*> const& to_lock)
+    {
+        lock_all(to_lock.begin(), to_lock.end());
+    }
+    template<typename Iterator>
+    scoped_multi_lock(Iterator first, Iterator last)
+    {
+        lock_all(first, last);
+    }
+    // Отпускаем в обратном порядке - hierarchial_mutex иначе ругается
+    ~scoped_multi_lock()
+    {
+        while (count) locks[--count]->unlock();
+    }
+    scoped_multi_lock(scoped_multi_lock const&) = delete;
+    scoped_multi_lock& operator=(scoped_multi_lock const&) = delete;
+};
+
+// Выполнить func, держа все мутексы из набора
+template<typename Lockable, typename Func>
+decltype(auto) with_all_locked(vector<Lockable*> const& to_lock, Func&& func)
+{
+    scoped_multi_lock<Lockable> lk(to_lock);
+    return func();
+}
+
+// Пакетные транзакции на примере переводов между счетами
+struct account_record
+{
+    mutex m;
+    long balance;
+    explicit account_record(long balance_):balance(balance_){}
+};
+
+struct transfer
+{
+    account_record* from;
+    account_record* to;
+    long amount;
+};
+
+// Все счета пачки лочатся разом. Если где-то не хватает денег,
+// не применяется ни один перевод
+bool apply_transfers(vector<transfer> const& batch)
+{
+    vector<mutex*> to_lock;
+    for (auto const& t : batch)
+    {
+        to_lock.push_back(&t.from->m);
+        to_lock.push_back(&t.to->m);
+    }
+    return with_all_locked(to_lock, [&]
+        {
+            unordered_map<account_record*, long> delta;
+            for (auto const& t : batch)
+            {
+                delta[t.from] -= t.amount;
+                delta[t.to] += t.amount;
+            }
+            for (auto const& d : delta)
+                if (d.first->balance + d.second < 0) return false;
+            for (auto const& d : delta)
+                d.first->balance += d.second;
+            return true;
+        });
+}
+
+// Запуск
+void run_multi_lock()
+{
+    account_record a(100), b(50), c(0);
+    bool const ok = apply_transfers({{&a, &b, 30}, {&b, &c, 70}, {&a, &c, 10}});
+    cout << "batch 1 applied? " << ok << ", balances " << a.balance << " " << b.balance << " " << c.balance << endl;
+    bool const failed = apply_transfers({{&c, &a, 500}});
+    cout << "batch 2 applied? " << failed << ", balances " << a.balance << " " << b.balance << " " << c.balance << endl;
+    // Иерархические мутексы из 3.7 в любом порядке - берутся сверху вниз
+    scoped_multi_lock<hierarchial_mutex> lk({&low_level_mutex, &high_level_mutex, &other_mutex});
+    cout << "locked three hierarchial_mutex" << endl;
+}
+
+// Бенчмарк: случайные четвёрки из 16 счетов, std::lock против scoped_multi_lock
+void bench_multi_lock()
+{
+    unsigned const accounts_count = 16;
+    unsigned const ops_per_thread = 200000;
+    cout << "threads  std::lock ops/s  scoped_multi_lock ops/s" << endl;
+    for (unsigned n = 1; n <= 16; n *= 2)
+    {
+        double results[2];
+        for (int variant = 0; variant < 2; ++variant)
+        {
+            vector<unique_ptr<account_record>> accounts;
+            for (unsigned i = 0; i < accounts_count; ++i)
+                accounts.emplace_back(new account_record(1000));
+            double const seconds = measure_seconds([&]
+                {
+                    vector<thread> threads;
+                    for (unsigned t = 0; t < n; ++t)
+                        threads.emplace_back([&, t]
+                            {
+                                unsigned state = t * 2654435761u + 7;
+                                account_record* picked[4];
+                                for (unsigned i = 0; i < ops_per_thread; ++i)
+                                {
+                                    // Четыре разных счёта
+                                    unsigned used = 0;
+                                    while (used < 4)
+                                    {
+                                        state = state * 1664525u + 1013904223u;
+                                        account_record* const candidate = accounts[(state >> 8) % accounts_count].get();
+                                        if (find(picked, picked + used, candidate) == picked + used)
+                                            picked[used++] = candidate;
+                                    }
+                                    if (variant == 0)
+                                    {
+                                        lock(picked[0]->m, picked[1]->m, picked[2]->m, picked[3]->m);
+                                        for (auto p : picked) p->balance += 1;
+                                        for (auto p : picked) p->m.unlock();
+                                    }
+                                    else
+                                    {
+                                        scoped_multi_lock<mutex> lk({&picked[0]->m, &picked[1]->m, &picked[2]->m, &picked[3]->m});
+                                        for (auto p : picked) p->balance += 1;
+                                    }
+                                }
+                            });
+                    for (auto& t : threads) t.join();
+                });
+            results[variant] = double(n) * ops_per_thread / seconds;
+        }
+        cout << n << "  " << (unsigned long)results[0] << "  " << (unsigned long)results[1] << endl;
+    }
+}
+/* Конец доработки: захват набора мутексов */
+
+
+
+/* Листинг 3.10 (стр 96) */
+// Просто класс, ничего особенного не происходит
+// Опять мутексы и локи, ещё перегружен оператор сравнения (там неявно мутексы используются)
+class Y
+{
+private:
+    int some_detail;
+    mutable mutex m;
+    int get_detail() const
+    {
+        lock_guard<mutex> lock_a(m);
+        return some_detail;
+    }
+public:
+    Y(int sd):some_detail(sd){}
+    friend bool operator==(Y const& lhs, Y const& rhs)
+    {
+        if (&lhs == &rhs)
+            return true;
+        int const lhs_value = lhs.get_detail();
+        int const rhs_value = rhs.get_detail();
+        return lhs_value == rhs_value;
+    }
+};
+
+// Запуск листинга
+void run310()
+{
+    Y y1(5);
+    Y y2(5);
+    Y y3(10);
+
+    cout << "y1(5), y2(5), y3(10)" << endl;
+
+    cout << "y1 == y2 ? " << (y1 == y2) << endl;
+    cout << "y1 == y3 ? " << (y1 == y3) << endl;
+    cout << "y2 == y3 ? " << (y2 == y3) << endl;
+    cout << "y2 == y2 ? " << (y2 == y2) << endl;
+}
+/* Конец листинга 3.10 */
+
+
+
+/* Листинг 3.11 (стр 98) */
+// Загадочный shared_ptr, гугл про него что-то знает...
+shared_ptr<some_big_object> resource_ptr;
+mutex resource_mutex;
+
+// Запуск листинга
+void foo311()
+{
+    unique_lock<mutex> lk(resource_mutex);
+    if (!resource_ptr)
+        resource_ptr.reset(new some_big_object());
+    lk.unlock();
+    resource_ptr->do_something();
+}
+/* Конец листинга 3.11 */
+
+
+
+/* Листинг 3.12 (стр 99)
+ * Какие-то непонятные объекты, либу не нашёл
+ */
+// Какой-то менеджер соединений с передачей/получением данных
+template<typename connection_info,
+         typename connection_handle,
+         typename data_packet,
+         typename connection_manager>
+class X3
+{
+private:
+    connection_info connection_details;
+    connection_handle connection;
+    once_flag connection_init_flag;
+    void open_connection()
+    {
+        connection_manager cm;
+        connection = cm.open(connection_details);
+    }
+public:
+    X3(connection_info const& connection_details_):
+        connection_details(connection_details_)
+    {}
+    void send_data(data_packet const& data)
+    {
+        call_once(connection_init_flag, &X3::open_connection, this);
+        connection.send_data(data);
+    }
+    data_packet receive_data()
+    {
+        call_once(connection_init_flag, &X3::open_connection, this);
+        return connection.receive_data();
+    }
+};
+/* Конец листинга 3.12 */
+
+
+
+/* Листинг 3.13 (стр 102) */
+class dns_entry
+{
+public:
+    // Адрес добавлен для доработок ниже, в книжке класс пустой
+    string address;
+    dns_entry(){}
+    explicit dns_entry(string address_):address(move(address_)){}
+};
+
+// Пример реализации кэша (не обязательно DNS, по факту вообще любой объект можно использовать)
+class dns_cache
+{
+    map<string, dns_entry> entries;
+    mutable shared_mutex entry_mutex;
+public:
+    dns_cache(){}
+    dns_entry find_entry(string const& domain) const
+    {
+        cout << "find entry(" << domain << ") invoked" << endl;
+        shared_lock<shared_mutex> lk(entry_mutex);
+        map<string, dns_entry>::const_iterator const it = entries.find(domain);
+        return (it == entries.end()) ? dns_entry() : it->second;
+    }
+    void update_or_add_entry(string const& domain, dns_entry const& dns_details)
+    {
+        cout << "update or add \"" << domain << "\"..." << endl;
+        lock_guard<shared_mutex> lk(entry_mutex);
+        entries[domain] = dns_details;
+    }
+};
+
+// Запуск листинга
+void run313()
+{
+    dns_cache dns_cache_inst;
+    dns_cache_inst.update_or_add_entry("google.com", dns_entry());
+    dns_cache_inst.update_or_add_entry("yandex.ru", dns_entry());
+    dns_cache_inst.find_entry("ya.ru");
+}
+/* Конец листинга 3.13 */
+
+
+
+/* Доработка: шардированный кэш вместо одного map под одним shared_mutex
+ * Ключи раскладываются по N независимым хэш-таблицам, у каждой свой
+ * shared_mutex на своей кэш-линии, поэтому потоки с разными доменами
+ * почти не пересекаются. Хэш считается один раз: по нему выбирается шард,
+ * и он же хранится в ключе, чтобы таблица не хэшировала строку заново.
+ * Поиск идёт по dns_key_ref (string_view + хэш) без копирования строки.
+ * Никакого вывода в консоль внутри - это горячий путь.
+ */
+struct dns_key
+{
+    string domain;
+    size_t hash;
+    explicit dns_key(string domain_):
+        domain(move(domain_)), hash(std::hash<string>()(domain))
+    {}
+    friend bool operator==(dns_key const& lhs, dns_key const& rhs)
+    {
+        return lhs.hash == rhs.hash && lhs.domain == rhs.domain;
+    }
+};
+
+// Ключ для поиска: ссылается на чужую строку, хэш совпадает с dns_key,
+// т.к. hash<string_view> и hash<string> дают одно и то же
+struct dns_key_ref
+{
+    string_view domain;
+    size_t hash;
+    explicit dns_key_ref(string_view domain_):
+        domain(domain_), hash(std::hash<string_view>()(domain_))
+    {}
+    dns_key_ref(dns_key const& key):
+        domain(key.domain), hash(key.hash)
+    {}
+};
+
+// Прозрачные хэш и сравнение - таблица ищет по dns_key_ref без dns_key
+struct dns_key_hash
+{
+    typedef void is_transparent;
+    size_t operator()(dns_key_ref key) const
+    {
+        return key.hash;
+    }
+};
+
+struct dns_key_equal
+{
+    typedef void is_transparent;
+    bool operator()(dns_key_ref lhs, dns_key_ref rhs) const
+    {
+        return lhs.hash == rhs.hash && lhs.domain == rhs.domain;
+    }
+};
+
+// Ограничение по размеру и время жизни записей (TTL).
+// Записи шарда лежат в deque ячеек, по которым ходит стрелка CLOCK: при
+// нехватке места она сбрасывает флаг referenced у недавно читанных и
+// выселяет первую запись без флага (или просроченную). Чтение только
+// взводит флаг - атомарно под shared_lock, эксклюзивный лок не нужен.
+// Просроченное удаляется лениво при чтении и фоновым чистильщиком.
+class sharded_dns_cache
+{
+    typedef chrono::steady_clock clock_type;
+    struct entry_slot
+    {
+        dns_key key;
+        dns_entry value;
+        clock_type::time_point expires;
+        // Взводится читателями из-под shared_lock
+        mutable atomic<bool> referenced;
+        bool used;
+        entry_slot():key(string()), referenced(false), used(false){}
+    };
+    struct alignas(cache_line_size) shard
+    {
+        mutable shared_mutex entry_mutex;
+        unordered_map<dns_key, size_t, dns_key_hash, dns_key_equal> index;
+        // deque не переносит элементы при росте, atomic внутри это и нужно
+        deque<entry_slot> slots;
+        vector<size_t> free_slots;
+        size_t clock_hand = 0;
+    };
+    size_t const shard_mask;
+    size_t const shard_capacity;
+    clock_type::duration const default_ttl;
+    unique_ptr<shard[]> shards;
+
+    thread sweeper;
+    mutex sweeper_mutex;
+    condition_variable sweeper_cond;
+    bool sweeper_stop = false;
+
+    shard& shard_for(size_t hash) const
+    {
+        // Подмешиваем старшую половину, чтобы шард зависел от всего хэша
+        return shards[(hash ^ (hash >> 32)) & shard_mask];
+    }
+    static size_t round_up_to_power_of_two(size_t n)
+    {
+        size_t result = 1;
+        while (result < n) result <<= 1;
+        return result;
+    }
+    clock_type::time_point expiry_for(clock_type::duration ttl) const
+    {
+        return ttl == clock_type::duration::zero() ? clock_type::time_point::max() : clock_type::now() + ttl;
+    }
+    // Дальше - только под эксклюзивным локом шарда
+    static void release_slot(shard& s, size_t slot_index)
+    {
+        entry_slot& slot = s.slots[slot_index];
+        s.index.erase(slot.key);
+        slot.used = false;
+        slot.value = dns_entry();
+        s.free_slots.push_back(slot_index);
+    }
+    size_t acquire_slot(shard& s, clock_type::time_point now)
+    {
+        if (!s.free_slots.empty())
+        {
+            size_t const slot_index = s.free_slots.back();
+            s.free_slots.pop_back();
+            return slot_index;
+        }
+        if (s.slots.size() < shard_capacity)
+        {
+            s.slots.emplace_back();
+            return s.slots.size() - 1;
+        }
+        // За два круга стрелка точно найдёт жертву: на первом флаги сбрасываются
+        for (;;)
+        {
+            size_t const slot_index = s.clock_hand;
+            s.clock_hand = (s.clock_hand + 1) % s.slots.size();
+            entry_slot& slot = s.slots[slot_index];
+            if (slot.expires > now && slot.referenced.exchange(false, memory_order_relaxed))
+                continue;
+            release_slot(s, slot_index);
+            s.free_slots.pop_back();
+            return slot_index;
+        }
+    }
+    void erase_if_expired(shard& s, dns_key_ref key) const
+    {
+        lock_guard<shared_mutex> lk(s.entry_mutex);
+        auto const it = s.index.find(key);
+        if (it != s.index.end() && s.slots[it->second].expires <= clock_type::now())
+            release_slot(s, it->second);
+    }
+    void sweeper_thread(clock_type::duration interval)
+    {
+        unique_lock<mutex> lk(sweeper_mutex);
+        while (!sweeper_cond.wait_for(lk, interval, [this]{ return sweeper_stop; }))
+        {
+            lk.unlock();
+            remove_expired();
+            lk.lock();
+        }
+    }
+public:
+    // max_entries делится поровну между шардами, нулевой TTL - записи вечные
+    explicit sharded_dns_cache(size_t max_entries = 1 << 20,
+                               clock_type::duration default_ttl_ = clock_type::duration::zero(),
+                               size_t shard_count = 64):
+        shard_mask(round_up_to_power_of_two(shard_count) - 1),
+        shard_capacity(max(size_t(1), max_entries / (shard_mask + 1))),
+        default_ttl(default_ttl_),
+        shards(new shard[shard_mask + 1])
+    {}
+    sharded_dns_cache(const sharded_dns_cache&) = delete;
+    sharded_dns_cache& operator=(const sharded_dns_cache&) = delete;
+    ~sharded_dns_cache()
+    {
+        stop_sweeper();
+    }
+    dns_entry find_entry(dns_key_ref key) const
+    {
+        shard& s = shard_for(key.hash);
+        {
+            shared_lock<shared_mutex> lk(s.entry_mutex);
+            auto const it = s.index.find(key);
+            if (it == s.index.end()) return dns_entry();
+            entry_slot const& slot = s.slots[it->second];
+            if (slot.expires > clock_type::now())
+            {
+                // Пишем флаг, только если он сброшен - не гоняем линию зря
+                if (!slot.referenced.load(memory_order_relaxed))
+                    slot.referenced.store(true, memory_order_relaxed);
+                return slot.value;
+            }
+        }
+        erase_if_expired(s, key);
+        return dns_entry();
+    }
+    dns_entry find_entry(string const& domain) const
+    {
+        return find_entry(dns_key_ref(domain));
+    }
+    void update_or_add_entry(dns_key key, dns_entry const& dns_details, clock_type::duration ttl)
+    {
+        shard& s = shard_for(key.hash);
+        lock_guard<shared_mutex> lk(s.entry_mutex);
+        auto const it = s.index.find(key);
+        size_t slot_index;
+        if (it != s.index.end())
+        {
+            slot_index = it->second;
+        }
+        else
+        {
+            slot_index = acquire_slot(s, clock_type::now());
+            s.index.emplace(key, slot_index);
+            s.slots[slot_index].key = move(key);
+            s.slots[slot_index].used = true;
+        }
+        entry_slot& slot = s.slots[slot_index];
+        slot.value = dns_details;
+        slot.expires = expiry_for(ttl);
+        slot.referenced.store(false, memory_order_relaxed);
+    }
+    void update_or_add_entry(dns_key key, dns_entry const& dns_details)
+    {
+        update_or_add_entry(move(key), dns_details, default_ttl);
+    }
+    void update_or_add_entry(string const& domain, dns_entry const& dns_details)
+    {
+        update_or_add_entry(dns_key(domain), dns_details, default_ttl);
+    }
+    void update_or_add_entry(string const& domain, dns_entry const& dns_details, clock_type::duration ttl)
+    {
+        update_or_add_entry(dns_key(domain), dns_details, ttl);
+    }
+    bool remove_entry(dns_key_ref key)
+    {
+        shard& s = shard_for(key.hash);
+        lock_guard<shared_mutex> lk(s.entry_mutex);
+        auto const it = s.index.find(key);
+        if (it == s.index.end()) return false;
+        release_slot(s, it->second);
+        return true;
+    }
+    bool remove_entry(string const& domain)
+    {
+        return remove_entry(dns_key_ref(domain));
+    }
+    // Пачкой: сортируем запросы по шардам и берём каждый лок один раз.
+    // Просроченное здесь просто не возвращается, подчистит чистильщик
+    vector<dns_entry> find_entries(vector<string> const& domains) const
+    {
+        vector<dns_key_ref> keys;
+        keys.reserve(domains.size());
+        for (auto const& domain : domains)
+            keys.emplace_back(domain);
+        vector<size_t> order(keys.size());
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](size_t a, size_t b)
+            {
+                return &shard_for(keys[a].hash) < &shard_for(keys[b].hash);
+            });
+        clock_type::time_point const now = clock_type::now();
+        vector<dns_entry> result(keys.size());
+        for (size_t i = 0; i < order.size();)
+        {
+            shard& s = shard_for(keys[order[i]].hash);
+            shared_lock<shared_mutex> lk(s.entry_mutex);
+            for (; i < order.size() && &shard_for(keys[order[i]].hash) == &s; ++i)
+            {
+                auto const it = s.index.find(keys[order[i]]);
+                if (it == s.index.end()) continue;
+                entry_slot const& slot = s.slots[it->second];
+                if (slot.expires <= now) continue;
+                if (!slot.referenced.load(memory_order_relaxed))
+                    slot.referenced.store(true, memory_order_relaxed);
+                result[order[i]] = slot.value;
+            }
+        }
+        return result;
+    }
+    // Удалить всё просроченное, шард за шардом
+    size_t remove_expired()
+    {
+        size_t removed = 0;
+        for (size_t i = 0; i <= shard_mask; ++i)
+        {
+            shard& s = shards[i];
+            lock_guard<shared_mutex> lk(s.entry_mutex);
+            clock_type::time_point const now = clock_type::now();
+            for (size_t slot_index = 0; slot_index < s.slots.size(); ++slot_index)
+            {
+                if (s.slots[slot_index].used && s.slots[slot_index].expires <= now)
+                {
+                    release_slot(s, slot_index);
+                    ++removed;
+                }
+            }
+        }
+        return removed;
+    }
+    void start_sweeper(clock_type::duration interval)
+    {
+        stop_sweeper();
+        sweeper_stop = false;
+        sweeper = thread(&sharded_dns_cache::sweeper_thread, this, interval);
+    }
+    void stop_sweeper()
+    {
+        if (!sweeper.joinable()) return;
+        {
+            lock_guard<mutex> lk(sweeper_mutex);
+            sweeper_stop = true;
+        }
+        sweeper_cond.notify_one();
+        sweeper.join();
+    }
+    size_t size() const
+    {
+        size_t total = 0;
+        for (size_t i = 0; i <= shard_mask; ++i)
+        {
+            shared_lock<shared_mutex> lk(shards[i].entry_mutex);
+            total += shards[i].index.size();
+        }
+        return total;
+    }
+};
+
+// Запуск
+void run_sharded_dns_cache()
+{
+    sharded_dns_cache cache;
+    cache.update_or_add_entry("google.com", dns_entry("142.250.74.46"));
+    cache.update_or_add_entry("yandex.ru", dns_entry("77.88.55.88"));
+    cout << "yandex.ru -> \"" << cache.find_entry("yandex.ru").address << "\"" << endl;
+    cout << "ya.ru -> \"" << cache.find_entry("ya.ru").address << "\"" << endl;
+    cache.remove_entry("yandex.ru");
+    vector<dns_entry> const batch = cache.find_entries({"google.com", "yandex.ru"});
+    cout << "batch: \"" << batch[0].address << "\", \"" << batch[1].address << "\"" << endl;
+}
+
+// Запуск: TTL и вытеснение
+void run_dns_cache_ttl()
+{
+    // Один шард на 2 записи, чтобы вытеснение было видно
+    sharded_dns_cache cache(2, chrono::milliseconds(50), 1);
+    cache.update_or_add_entry("a.com", dns_entry("1.1.1.1"));
+    cache.update_or_add_entry("b.com", dns_entry("2.2.2.2"));
+    cache.find_entry("a.com");
+    // a.com недавно читали, вытеснится b.com
+    cache.update_or_add_entry("c.com", dns_entry("3.3.3.3"));
+    cout << "a.com -> \"" << cache.find_entry("a.com").address << "\", b.com -> \""
+         << cache.find_entry("b.com").address << "\", size " << cache.size() << endl;
+    cache.update_or_add_entry("forever.com", dns_entry("4.4.4.4"), chrono::hours(24));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    cout << "after 100ms: a.com -> \"" << cache.find_entry("a.com").address
+         << "\", forever.com -> \"" << cache.find_entry("forever.com").address << "\"" << endl;
+}
+
+// Бенчмарк на долгую работу: поток всё новых доменов с TTL, размер держится у потолка
+void bench_dns_cache_churn()
+{
+    sharded_dns_cache cache(100000, chrono::milliseconds(200));
+    cache.start_sweeper(chrono::milliseconds(50));
+    unsigned long next_domain = 0;
+    for (unsigned round = 0; round < 10; ++round)
+    {
+        double const seconds = measure_seconds([&]
+            {
+                for (unsigned i = 0; i < 200000; ++i, ++next_domain)
+                {
+                    string domain = "host" + to_string(next_domain) + ".example.com";
+                    cache.update_or_add_entry(domain, dns_entry("10.0.0.1"));
+                    cache.find_entry(domain);
+                }
+            });
+        cout << "round " << round << ": " << (unsigned long)(400000 / seconds) << " ops/s, size "
+             << cache.size() << endl;
+    }
+}
+
+// Прогон смеси чтений и записей, возвращает операций в секунду
+template<typename Cache>
+double dns_cache_throughput(Cache& cache, vector<string> const& domains,
+                            unsigned threads_count, unsigned ops_per_thread, unsigned writes_per_100)
+{
+    double const seconds = measure_seconds([&]
+        {
+            vector<thread> threads;
+            for (unsigned t = 0; t < threads_count; ++t)
+                threads.emplace_back([&, t]
+                    {
+                        unsigned state = t * 2654435761u + 1;
+                        for (unsigned i = 0; i < ops_per_thread; ++i)
+                        {
+                            state = state * 1664525u + 1013904223u;
+                            string const& domain = domains[(state >> 8) % domains.size()];
+                            if ((state >> 4) % 100 < writes_per_100)
+                                cache.update_or_add_entry(domain, dns_entry("10.0.0.1"));
+                            else
+                                cache.find_entry(domain);
+                        }
+                    });
+            for (auto& t : threads) t.join();
+        });
+    return double(threads_count) * ops_per_thread / seconds;
+}
+
+// Бенчмарк: dns_cache из 3.13 против sharded_dns_cache на смесях 99/1 и 90/10.
+// Старый кэш печатает в cout на каждый вызов - на время замера глушим поток,
+// форматирование он всё равно делает, это тоже его честная цена
+void bench_dns_cache()
+{
+    unsigned const domains_count = 10000;
+    unsigned const ops_per_thread = 200000;
+    vector<string> domains;
+    for (unsigned i = 0; i < domains_count; ++i)
+        domains.push_back("host" + to_string(i) + ".example.com");
+    cout << "threads  mix  dns_cache ops/s  sharded_dns_cache ops/s" << endl;
+    for (unsigned writes : {1u, 10u})
+    {
+        for (unsigned n = 1; n <= 16; n *= 2)
+        {
+            dns_cache old_cache;
+            sharded_dns_cache new_cache;
+            cout.setstate(ios::failbit);
+            for (auto const& domain : domains)
+            {
+                old_cache.update_or_add_entry(domain, dns_entry());
+                new_cache.update_or_add_entry(domain, dns_entry());
+            }
+            double const old_ops = dns_cache_throughput(old_cache, domains, n, ops_per_thread, writes);
+            double const new_ops = dns_cache_throughput(new_cache, domains, n, ops_per_thread, writes);
+            cout.clear();
+            cout << n << "  " << (100 - writes) << "/" << writes << "  "
+                 << (unsigned long)old_ops << "  " << (unsigned long)new_ops << endl;
+        }
+    }
+}
+/* Конец доработки: шардированный кэш */
+
+
+
+/* Доработка: режим RCU для кэша, где почти одни чтения
+ * Даже shared_lock пишет в счётчик читателей внутри shared_mutex, и эта
+ * кэш-линия скачет между ядрами. Здесь читатель берёт атомарный указатель
+ * на неизменяемый снимок таблицы и ничего общего не пишет - только свой
+ * указатель опасности из доработки к 3.5 (своя кэш-линия у каждого потока).
+ * Писатели копят изменения пачкой, потом строят новый снимок и публикуют его,
+ * а старый удаляется, когда ни один читатель на него не указывает.
+ * Указатель опасности у потока один, поэтому чтения не должны вкладываться
+ * в pop() lock_free_stack - у нас так и есть.
+ */
+class rcu_dns_cache
+{
+    typedef unordered_map<dns_key, dns_entry, dns_key_hash, dns_key_equal> snapshot;
+    struct pending_update
+    {
+        dns_key key;
+        dns_entry value;
+        bool remove;
+    };
+    alignas(cache_line_size) atomic<snapshot const*> current;
+    alignas(cache_line_size) mutex writer_mutex;
+    vector<pending_update> pending;
+    vector<snapshot const*> retired;
+    size_t const batch_size;
+
+    // Под writer_mutex
+    void publish_locked()
+    {
+        if (pending.empty()) return;
+        unique_ptr<snapshot> next(new snapshot(*current.load()));
+        for (auto& update : pending)
+        {
+            if (update.remove)
+                next->erase(update.key);
+            else
+                (*next)[move(update.key)] = move(update.value);
+        }
+        pending.clear();
+        retired.push_back(current.exchange(next.release()));
+        reclaim_retired_locked();
+    }
+    void reclaim_retired_locked()
+    {
+        auto const still_read = partition(retired.begin(), retired.end(), [](snapshot const* old)
+            {
+                for (unsigned i = 0; i < max_hazard_pointers; ++i)
+                    if (hazard_pointers[i].pointer.load() == old) return true;
+                return false;
+            });
+        for (auto it = still_read; it != retired.end(); ++it)
+            delete *it;
+        retired.erase(still_read, retired.end());
+    }
+    void add_update(pending_update update)
+    {
+        lock_guard<mutex> lk(writer_mutex);
+        pending.push_back(move(update));
+        if (pending.size() >= batch_size)
+            publish_locked();
+    }
+public:
+    // batch_size - сколько изменений копить до публикации нового снимка
+    explicit rcu_dns_cache(size_t batch_size_ = 64):
+        current(new snapshot), batch_size(max(size_t(1), batch_size_))
+    {}
+    rcu_dns_cache(const rcu_dns_cache&) = delete;
+    rcu_dns_cache& operator=(const rcu_dns_cache&) = delete;
+    ~rcu_dns_cache()
+    {
+        delete current.load();
+        for (auto old : retired)
+            delete old;
+    }
+    dns_entry find_entry(dns_key_ref key) const
+    {
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread();
+        snapshot const* snap = current.load();
+        snapshot const* temp;
+        do
+        {
+            temp = snap;
+            hp.store(const_cast<snapshot*>(snap));
+            snap = current.load();
+        } while (snap != temp);
+        auto const it = snap->find(key);
+        dns_entry result = (it == snap->end()) ? dns_entry() : it->second;
+        hp.store(nullptr);
+        return result;
+    }
+    dns_entry find_entry(string const& domain) const
+    {
+        return find_entry(dns_key_ref(domain));
+    }
+    // Изменения видны читателям после flush() или когда наберётся пачка
+    void update_or_add_entry(string const& domain, dns_entry const& dns_details)
+    {
+        add_update(pending_update{dns_key(domain), dns_details, false});
+    }
+    void remove_entry(string const& domain)
+    {
+        add_update(pending_update{dns_key(domain), dns_entry(), true});
+    }
+    void flush()
+    {
+        lock_guard<mutex> lk(writer_mutex);
+        publish_locked();
+        reclaim_retired_locked();
+    }
+    size_t size() const
+    {
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread();
+        snapshot const* snap = current.load();
+        snapshot const* temp;
+        do
+        {
+            temp = snap;
+            hp.store(const_cast<snapshot*>(snap));
+            snap = current.load();
+        } while (snap != temp);
+        size_t const result = snap->size();
+        hp.store(nullptr);
+        return result;
+    }
+};
+
+// Запуск
+void run_rcu_dns_cache()
+{
+    rcu_dns_cache cache;
+    cache.update_or_add_entry("google.com", dns_entry("142.250.74.46"));
+    cout << "before flush: google.com -> \"" << cache.find_entry("google.com").address << "\"" << endl;
+    cache.flush();
+    cout << "after flush: google.com -> \"" << cache.find_entry("google.com").address << "\"" << endl;
+}
+
+// Бенчмарк: 99.9% чтений, как растёт пропускная способность с числом потоков
+void bench_rcu_dns_cache()
+{
+    unsigned const domains_count = 10000;
+    unsigned const ops_per_thread = 500000;
+    vector<string> domains;
+    for (unsigned i = 0; i < domains_count; ++i)
+        domains.push_back("host" + to_string(i) + ".example.com");
+    cout << "threads  dns_cache ops/s  sharded_dns_cache ops/s  rcu_dns_cache ops/s" << endl;
+    for (unsigned n = 1; n <= 16; n *= 2)
+    {
+        dns_cache old_cache;
+        sharded_dns_cache sharded;
+        rcu_dns_cache rcu;
+        cout.setstate(ios::failbit);
+        for (auto const& domain : domains)
+        {
+            old_cache.update_or_add_entry(domain, dns_entry());
+            sharded.update_or_add_entry(domain, dns_entry());
+            rcu.update_or_add_entry(domain, dns_entry());
+        }
+        rcu.flush();
+        // Одна запись на тысячу операций - из смеси 99.9/0.1 получается 0 на сотню,
+        // поэтому записи идут отдельным потоком
+        atomic<bool> stop(false);
+        auto run_with_writer = [&](auto& cache)
+            {
+                thread writer([&]
+                    {
+                        unsigned i = 0;
+                        while (!stop)
+                        {
+                            cache.update_or_add_entry(domains[i++ % domains.size()], dns_entry("10.0.0.1"));
+                            this_thread::sleep_for(chrono::microseconds(50));
+                        }
+                    });
+                double const ops = dns_cache_throughput(cache, domains, n, ops_per_thread, 0);
+                stop = true;
+                writer.join();
+                stop = false;
+                return ops;
+            };
+        double const old_ops = run_with_writer(old_cache);
+        double const sharded_ops = run_with_writer(sharded);
+        double const rcu_ops = run_with_writer(rcu);
+        cout.clear();
+        cout << n << "  " << (unsigned long)old_ops << "  " << (unsigned long)sharded_ops
+             << "  " << (unsigned long)rcu_ops << endl;
+    }
+}
+/* Конец доработки: режим RCU */
+
+
+
+/* Листинг 4.1 (стр 108)
+ * Реализацию класса data_chunk нам не предложили, а там довольно много методов используется
+ * К тому же есть ещё какие-то методы без реализации
+ */
+
+// Заглушки
+class data_chunk {};
+bool more_data_to_prepare() {return false; }
+data_chunk prepare_data() { data_chunk d; return d; }
+void process(data_chunk dc) {}
+bool is_last_chunk(data_chunk) {return true; }
+
+// Потокобезопасная обработка данных с локами
+mutex mut;
+queue<data_chunk> data_queue;
+default_wait_condition data_cond;
+void data_preparation_thread()
+{
+    while (more_data_to_prepare())
+    {
+        data_chunk const data = prepare_data();
+        {
+            lock_guard<mutex> lk(mut);
+            data_queue.push(data);
+        }
+        data_cond.notify_one();
+    }
+}
+void data_processing_thread()
+{
+    while (true)
+    {
+        unique_lock<mutex> lk(mut);
+        data_cond.wait(lk, []{return !data_queue.empty();});
+        data_chunk data = data_queue.front();
+        data_queue.pop();
+        lk.unlock();
+        process(data);
+        if (is_last_chunk(data)) break;
+    }
+}
+/* Конец листинга 4.1 */
+
+
+
+/* Листинг 4.2 (стр 110)
+ * Интерфейс опять...
+ * Метода запуска, естественно, не будет
+ */
+template<class T, class Container = deque<T>>
+class queue
+{
+public:
+    explicit queue(const Container&);
+    explicit queue(Container&& = Container());
+    template<class Alloc> explicit queue(const Alloc&);
+    template<class Alloc> queue(const Container&, const Alloc&);
+    template<class Alloc> queue(Container&&, const Alloc&);
+    template<class Alloc> queue(queue&&, const Alloc&);
+    void swap(queue& q);
+    bool empty() const;
+    size_t size() const;
+    T& front();
+    const T& front() const;
+    T& back();
+    const T& back() const;
+    void push(const T& x);
+    void push(T&& x);
+    void pop();
+    template<class... Args> void emplace(Args&&... args);
+};
+/* Конец листинга 4.2 */
+
+
+
+/* Листинг 4.3 (стр 111)
+ * И снова интерфейс
+ */
+template<typename T>
+class threadsafe_queue43
+{
+public:
+    threadsafe_queue43();
+    threadsafe_queue43(const threadsafe_queue43&);
+    threadsafe_queue43& operator=(const threadsafe_queue43&) = delete;
+    void push(T new_value);
+    bool try_pop(T& value);
+    shared_ptr<T> try_pop();
+    void wait_and_pop(T& value);
+    shared_ptr<T> wait_and_pop();
+    bool empty() const;
+};
+/* Конец листинга 4.3 */
+
+
+
+/* Листинг 4.4 (стр 112) */
+// Доработка: чем ждать, задаётся параметром Condition (см. adaptive_condition)
+template<typename T, typename Condition = default_wait_condition>
+class threadsafe_queue44
+{
+private:
+    mutex mut;
+    std::queue<T> data_queue;
+    Condition data_cond;
+public:
+    void push(T new_value)
+    {
+        lock_guard<mutex> lk(mut);
+        data_queue.push(new_value);
+        data_cond.notify_one();
+    }
+    void wait_and_pop(T& value)
+    {
+        unique_lock<mutex> lk(mut);
+        data_cond.wait(lk, [this]{return !data_queue.empty();});
+        value = data_queue.front();
+        data_queue.pop();
+    }
+};
+
+// Опять загадочный data_chunk без реализации
+threadsafe_queue44<data_chunk> data_queue44;
+void data_preparation_thread44()
+{
+    while (more_data_to_prepare())
+    {
+        data_chunk const data = prepare_data();
+        data_queue44.push(data);
+    }
+}
+void data_processing_thread44()
+{
+    while (true)
+    {
+        data_chunk data;
+        data_queue44.wait_and_pop(data);
+        process(data);
+        if (is_last_chunk(data)) break;
+    }
+}
+/* Конец листинга 4.4 */
+
+
+
+/* Листинг 4.5 (стр 113) */
+// Потокобезопасная очередь, похожа на стэк
+// Доработка: значения перемещаются (годится unique_ptr и т.п.), плюс пакетные
+// push_range/push_bulk/try_pop_bulk/wait_and_drain - один захват мутекса на пачку.
+// Чем ждать, задаётся параметром Condition (см. adaptive_condition)
+template<typename T, typename Condition = default_wait_condition>
+class threadsafe_queue45
+{
+private:
+    mutable mutex mut;
+    std::queue<T> data_queue;
+    Condition data_cond;
+    // Сколько потоков спит в wait_and_pop/wait_and_drain - будим не больше, чем нужно
+    unsigned waiting_consumers = 0;
+    class pop_awaiter;
+    // Сопрограммы, ждущие значения, в порядке прихода
+    std::deque<pop_awaiter*> pop_waiters;
+
+    class pop_awaiter
+    {
+        friend class threadsafe_queue45;
+        threadsafe_queue45& queue;
+        optional<T> value;
+        coroutine_handle<> handle;
+    public:
+        explicit pop_awaiter(threadsafe_queue45& queue_): queue(queue_) {}
+        bool await_ready() { return false; }
+        bool await_suspend(coroutine_handle<> h)
+        {
+            lock_guard<mutex> lk(queue.mut);
+            if (!queue.data_queue.empty())
+            {
+                value.emplace(move(queue.data_queue.front()));
+                queue.data_queue.pop();
+                return false;
+            }
+            handle = h;
+            queue.pop_waiters.push_back(this);
+            return true;
+        }
+        T await_resume() { return move(*value); }
+    };
+    void wait_for_data(unique_lock<mutex>& lk)
+    {
+        ++waiting_consumers;
+        data_cond.wait(lk, [this]{return !data_queue.empty();});
+        --waiting_consumers;
+    }
+    // Разбудить столько спящих, сколько появилось элементов
+    void wake_consumers(size_t added)
+    {
+        if (added >= waiting_consumers)
+        {
+            if (waiting_consumers) data_cond.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < added; ++i)
+            data_cond.notify_one();
+    }
+public:
+    threadsafe_queue45(){}
+    threadsafe_queue45(threadsafe_queue45 const& other)
+    {
+        lock_guard<mutex> lk(other.mut);
+        data_queue = other.data_queue;
+    }
+    // Ждущей сопрограмме значение отдаётся сразу, мимо очереди
+    void push(T new_value)
+    {
+        unique_lock<mutex> lk(mut);
+        if (!pop_waiters.empty())
+        {
+            pop_awaiter* const waiter = pop_waiters.front();
+            pop_waiters.pop_front();
+            waiter->value.emplace(move(new_value));
+            lk.unlock();
+            default_thread_pool().post([h = waiter->handle]{ h.resume(); });
+            return;
+        }
+        data_queue.push(move(new_value));
+        wake_consumers(1);
+    }
+    // Пачка за один захват мутекса. Элементы копируются; чтобы переместить,
+    // передать make_move_iterator или звать push_bulk
+    template<typename InputIt>
+    void push_range(InputIt first, InputIt last)
+    {
+        vector<coroutine_handle<>> resumed;
+        {
+            lock_guard<mutex> lk(mut);
+            for (; first != last && !pop_waiters.empty(); ++first)
+            {
+                pop_awaiter* const waiter = pop_waiters.front();
+                pop_waiters.pop_front();
+                waiter->value.emplace(*first);
+                resumed.push_back(waiter->handle);
+            }
+            size_t added = 0;
+            for (; first != last; ++first, ++added)
+                data_queue.push(*first);
+            wake_consumers(added);
+        }
+        for (auto h : resumed)
+            default_thread_pool().post([h]{ h.resume(); });
+    }
+    void push_bulk(vector<T> items)
+    {
+        push_range(make_move_iterator(items.begin()), make_move_iterator(items.end()));
+    }
+    // Для сопрограмм: T value = co_await q.async_wait_and_pop(); поток при этом
+    // не блокируется, продолжение выполнится в пуле
+    pop_awaiter async_wait_and_pop()
+    {
+        return pop_awaiter(*this);
+    }
+    void wait_and_pop(T& value)
+    {
+        unique_lock<mutex> lk(mut);
+        wait_for_data(lk);
+        value = move(data_queue.front());
+        data_queue.pop();
+    }
+    shared_ptr<T> wait_and_pop()
+    {
+        unique_lock<mutex> lk(mut);
+        wait_for_data(lk);
+        shared_ptr<T> res(make_shared<T>(move(data_queue.front())));
+        data_queue.pop();
+        return res;
+    }
+    bool try_pop(T& value)
+    {
+        lock_guard<mutex> lk(mut);
+        if (data_queue.empty()) return false;
+        value = move(data_queue.front());
+        data_queue.pop();
+        return true;
+    }
+    shared_ptr<T> try_pop()
+    {
+        lock_guard<mutex> lk(mut);
+        if (data_queue.empty()) return shared_ptr<T>();
+        shared_ptr<T> res(make_shared<T>(move(data_queue.front())));
+        data_queue.pop();
+        return res;
+    }
+    // Забрать до max элементов за один захват, не дожидаясь. Возвращает, сколько взято
+    template<typename OutputIt>
+    size_t try_pop_bulk(OutputIt out, size_t max)
+    {
+        lock_guard<mutex> lk(mut);
+        return take_locked(out, max);
+    }
+    // Дождаться хотя бы одного элемента и забрать до max сразу
+    template<typename OutputIt>
+    size_t wait_and_drain(OutputIt out, size_t max = SIZE_MAX)
+    {
+        unique_lock<mutex> lk(mut);
+        wait_for_data(lk);
+        return take_locked(out, max);
+    }
+    bool empty() const
+    {
+        lock_guard<mutex> lk(mut);
+        return data_queue.empty();
+    }
+private:
+    template<typename OutputIt>
+    size_t take_locked(OutputIt& out, size_t max)
+    {
+        size_t taken = 0;
+        for (; taken < max && !data_queue.empty(); ++taken)
+        {
+            *out++ = move(data_queue.front());
+            data_queue.pop();
+        }
+        return taken;
+    }
+};
+
+// Запуск листинга
+void run45()
+{
+    threadsafe_queue45<int> tq;
+    tq.push(5);
+    tq.push(10);
+    tq.push(15);
+
+    cout << "Is empty? " << (tq.empty()) << endl;
+    cout << "push 5, 10, 15" << endl;
+    cout << "Is empty? " << (tq.empty()) << endl;
+    int pvar;
+    tq.try_pop(pvar);
+    cout << "try_pop(int): " << pvar << endl; // pvar == 5
+
+    threadsafe_queue45<unique_ptr<int>> owned;
+    owned.push_bulk({});
+    vector<unique_ptr<int>> batch;
+    for (int i = 1; i <= 5; ++i)
+        batch.push_back(make_unique<int>(i * 10));
+    owned.push_bulk(move(batch));
+    vector<unique_ptr<int>> drained;
+    owned.try_pop_bulk(back_inserter(drained), 2);
+    owned.wait_and_drain(back_inserter(drained));
+    for (auto const& p : drained)
+        cout << *p << " ";
+    cout << endl; // 10 20 30 40 50
+}
+
+// Бенчмарк: элементов в секунду при разных размерах пачки, producers писателей
+// и столько же читателей. Пачка 1 - обычные push/wait_and_pop
+void bench_queue_batches(unsigned producers = 2, unsigned long items = 4000000)
+{
+    cout << "batch  items/s" << endl;
+    for (size_t batch : {1, 4, 16, 64, 256, 1024})
+    {
+        threadsafe_queue45<unsigned long> q;
+        unsigned long const per_producer = items / producers;
+        atomic<unsigned long> received(0);
+        unsigned long const total = per_producer * producers;
+        double const seconds = measure_seconds([&]
+            {
+                vector<thread> threads;
+                for (unsigned p = 0; p < producers; ++p)
+                {
+                    threads.emplace_back([&q, batch, per_producer]
+                        {
+                            vector<unsigned long> chunk;
+                            for (unsigned long i = 0; i < per_producer; ++i)
+                            {
+                                if (batch == 1)
+                                {
+                                    q.push(i);
+                                    continue;
+                                }
+                                chunk.push_back(i);
+                                if (chunk.size() == batch || i + 1 == per_producer)
+                                {
+                                    q.push_bulk(move(chunk));
+                                    chunk.clear();
+                                }
+                            }
+                        });
+                }
+                // Конец - маркер ULONG_MAX на каждого читателя. Лишние маркеры,
+                // прихваченные одной пачкой, возвращаются в очередь
+                vector<thread> consumers;
+                for (unsigned c = 0; c < producers; ++c)
+                {
+                    consumers.emplace_back([&q, &received, batch]
+                        {
+                            vector<unsigned long> out;
+                            out.reserve(batch);
+                            for (;;)
+                            {
+                                out.clear();
+                                if (batch == 1)
+                                    out.push_back(*q.wait_and_pop());
+                                else
+                                    q.wait_and_drain(back_inserter(out), batch);
+                                size_t const markers = count(out.begin(), out.end(), ULONG_MAX);
+                                received.fetch_add(out.size() - markers, memory_order_relaxed);
+                                if (markers)
+                                {
+                                    for (size_t i = 1; i < markers; ++i)
+                                        q.push(ULONG_MAX);
+                                    return;
+                                }
+                            }
+                        });
+                }
+                for (auto& t : threads)
+                    t.join();
+                for (unsigned c = 0; c < producers; ++c)
+                    q.push(ULONG_MAX);
+                for (auto& t : consumers)
+                    t.join();
+            });
+        if (received != total) cout << "MISMATCH ";
+        cout << batch << "  " << (unsigned long)(total / seconds) << endl;
+    }
+}
+
+// Бенчмарк: задержка передачи одного элемента от писателя к ждущему читателю,
+// condition_variable против adaptive_condition. Пинг-понг на двух очередях:
+// читатель всегда уже ждёт, писатель между передачами "работает" gap мкс
+template<typename Condition>
+vector<double> handoff_latencies(unsigned handoffs, chrono::microseconds gap)
+{
+    threadsafe_queue45<chrono::steady_clock::time_point, Condition> ping;
+    threadsafe_queue45<unsigned, Condition> pong;
+    vector<double> latencies(handoffs);
+    thread consumer([&]
+        {
+            for (unsigned i = 0; i < handoffs; ++i)
+            {
+                chrono::steady_clock::time_point sent;
+                ping.wait_and_pop(sent);
+                latencies[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count();
+                pong.push(i);
+            }
+        });
+    for (unsigned i = 0; i < handoffs; ++i)
+    {
+        auto const work_until = chrono::steady_clock::now() + gap;
+        while (chrono::steady_clock::now() < work_until) {}
+        ping.push(chrono::steady_clock::now());
+        unsigned ack;
+        pong.wait_and_pop(ack);
+    }
+    consumer.join();
+    sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+void bench_handoff_latency(unsigned handoffs = 100000)
+{
+    cout << "wait  gap us  p50 us  p99 us  p99.9 us" << endl;
+    auto report = [](char const* name, chrono::microseconds gap, vector<double> const& l)
+    {
+        // Индекс зажат в размер, на пустом замере - нули
+        auto percentile = [&l](double q)
+        {
+            return l.empty() ? 0.0 : l[min(l.size() - 1, size_t(l.size() * q))];
+        };
+        cout << name << "  " << gap.count() << "  " << percentile(0.5) << "  "
+             << percentile(0.99) << "  " << percentile(0.999) << endl;
+    };
+    for (chrono::microseconds gap : {chrono::microseconds(0), chrono::microseconds(20), chrono::microseconds(200)})
+    {
+        report("condition_variable", gap, handoff_latencies<condition_variable>(handoffs, gap));
+        report("adaptive_condition", gap, handoff_latencies<adaptive_condition>(handoffs, gap));
+    }
+}
+/* Конец листинга 4.5 */
+
+/* Доработка: ограниченная lock-free очередь для многих писателей и читателей
+ * Кольцевой буфер по схеме Дмитрия Вьюкова: у каждой ячейки свой счётчик
+ * sequence, по которому писатель и читатель понимают, чья сейчас очередь.
+ * Интерфейс как у threadsafe_queue45, только push() ждёт, если буфер полон.
+ * Значения перемещаются, а не копируются.
+ */
+template<typename T>
+class mpmc_bounded_queue
+{
+private:
+    struct cell
+    {
+        atomic<size_t> sequence;
+        typename aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+    // Позиции записи и чтения на разных кэш-линиях, иначе писатели и читатели
+    // дёргают одну линию друг у друга
+    alignas(cache_line_size) atomic<size_t> enqueue_pos;
+    alignas(cache_line_size) atomic<size_t> dequeue_pos;
+    alignas(cache_line_size) size_t const buffer_mask;
+    unique_ptr<cell[]> const buffer;
+    // Счётчики уснувших и их будильники. Трогаем мутекс, только если кто-то спит
+    alignas(cache_line_size) atomic<unsigned> waiting_consumers;
+    atomic<unsigned> waiting_producers;
+    mutex park_mutex;
+    condition_variable not_empty_cond;
+    condition_variable not_full_cond;
+    // Сколько раз покрутиться перед тем, как уснуть
+    static unsigned const spin_count = 64;
+
+    static size_t round_up_to_power_of_two(size_t n)
+    {
+        size_t result = 2;
+        while (result < n) result <<= 1;
+        return result;
+    }
+    void wake(atomic<unsigned>& waiting, condition_variable& cond)
+    {
+        // Пара к fence в park(): либо мы видим спящего, либо он видит наши данные
+        atomic_thread_fence(memory_order_seq_cst);
+        if (waiting.load(memory_order_relaxed))
+        {
+            { lock_guard<mutex> lk(park_mutex); }
+            cond.notify_one();
+        }
+    }
+    template<typename Predicate>
+    void park(atomic<unsigned>& waiting, condition_variable& cond, Predicate try_once)
+    {
+        for (unsigned i = 0; i < spin_count; ++i)
+        {
+            if (try_once()) return;
+            this_thread::yield();
+        }
+        unique_lock<mutex> lk(park_mutex);
+        waiting.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        cond.wait(lk, try_once);
+        waiting.fetch_sub(1);
+    }
+    // Сами операции без будильников - их зовут и из-под park_mutex
+    bool enqueue(T& new_value)
+    {
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        cell* c;
+        for (;;)
+        {
+            c = &buffer[pos & buffer_mask];
+            size_t const seq = c->sequence.load(memory_order_acquire);
+            intptr_t const diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // Буфер полон
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+        new (&c->storage) T(move(new_value));
+        c->sequence.store(pos + 1, memory_order_release);
+        return true;
+    }
+    bool dequeue(T& value)
+    {
+        size_t pos = dequeue_pos.load(memory_order_relaxed);
+        cell* c;
+        for (;;)
+        {
+            c = &buffer[pos & buffer_mask];
+            size_t const seq = c->sequence.load(memory_order_acquire);
+            intptr_t const diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // Очередь пуста
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(memory_order_relaxed);
+            }
+        }
+        T* const stored = reinterpret_cast<T*>(&c->storage);
+        value = move(*stored);
+        stored->~T();
+        c->sequence.store(pos + buffer_mask + 1, memory_order_release);
+        return true;
+    }
+public:
+    explicit mpmc_bounded_queue(size_t capacity = 1024):
+        enqueue_pos(0),
+        dequeue_pos(0),
+        buffer_mask(round_up_to_power_of_two(capacity) - 1),
+        buffer(new cell[buffer_mask + 1]),
+        waiting_consumers(0),
+        waiting_producers(0)
+    {
+        for (size_t i = 0; i <= buffer_mask; ++i)
+            buffer[i].sequence.store(i, memory_order_relaxed);
+    }
+    mpmc_bounded_queue(const mpmc_bounded_queue&) = delete;
+    mpmc_bounded_queue& operator=(const mpmc_bounded_queue&) = delete;
+    ~mpmc_bounded_queue()
+    {
+        T value;
+        while (try_pop(value)) {}
+    }
+    size_t capacity() const
+    {
+        return buffer_mask + 1;
+    }
+    bool try_push(T& new_value)
+    {
+        if (!enqueue(new_value)) return false;
+        wake(waiting_consumers, not_empty_cond);
+        return true;
+    }
+    bool try_pop(T& value)
+    {
+        if (!dequeue(value)) return false;
+        wake(waiting_producers, not_full_cond);
+        return true;
+    }
+    shared_ptr<T> try_pop()
+    {
+        T value;
+        if (!try_pop(value)) return shared_ptr<T>();
+        return make_shared<T>(move(value));
+    }
+    void push(T new_value)
+    {
+        if (!enqueue(new_value))
+            park(waiting_producers, not_full_cond, [&]{ return enqueue(new_value); });
+        wake(waiting_consumers, not_empty_cond);
+    }
+    void wait_and_pop(T& value)
+    {
+        if (!dequeue(value))
+            park(waiting_consumers, not_empty_cond, [&]{ return dequeue(value); });
+        wake(waiting_producers, not_full_cond);
+    }
+    shared_ptr<T> wait_and_pop()
+    {
+        T value;
+        wait_and_pop(value);
+        return make_shared<T>(move(value));
+    }
+    // Примерно: пока ответ доберётся до вызывающего, всё могло поменяться
+    bool empty() const
+    {
+        size_t const pos = dequeue_pos.load(memory_order_relaxed);
+        size_t const seq = buffer[pos & buffer_mask].sequence.load(memory_order_acquire);
+        return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+    }
+};
+
+// Запуск
+void run_mpmc_queue()
+{
+    mpmc_bounded_queue<int> q(4);
+    q.push(5);
+    q.push(10);
+    q.push(15);
+    int pvar;
+    q.try_pop(pvar);
+    cout << "try_pop(int): " << pvar << endl; // 5
+    cout << "wait_and_pop(): " << *q.wait_and_pop() << endl; // 10
+    cout << "Is empty? " << q.empty() << endl;
+}
+
+// Прогон производителей и потребителей через очередь, возвращает операций в секунду
+template<typename Queue>
+double queue_throughput(Queue& q, unsigned producers, unsigned consumers, unsigned items)
+{
+    unsigned const per_producer = items / producers;
+    unsigned const per_consumer = items / consumers;
+    double const seconds = measure_seconds([&]
+        {
+            vector<thread> threads;
+            for (unsigned p = 0; p < producers; ++p)
+                threads.emplace_back([&q, per_producer]
+                    {
+                        for (unsigned i = 0; i < per_producer; ++i)
+                            q.push(int(i));
+                    });
+            for (unsigned c = 0; c < consumers; ++c)
+                threads.emplace_back([&q, per_consumer]
+                    {
+                        int value;
+                        for (unsigned i = 0; i < per_consumer; ++i)
+                            q.wait_and_pop(value);
+                    });
+            for (auto& t : threads) t.join();
+        });
+    return items / seconds;
+}
+
+// Бенчмарк: threadsafe_queue45 против mpmc_bounded_queue, 1-64 производителей и потребителей
+void bench_mpmc_queue()
+{
+    // Делится на любое число потоков из списка
+    unsigned const items = 64 * 8192;
+    cout << "threads(p=c)  threadsafe_queue45 ops/s  mpmc_bounded_queue ops/s" << endl;
+    for (unsigned n = 1; n <= 64; n *= 2)
+    {
+        threadsafe_queue45<int> locked;
+        mpmc_bounded_queue<int> lock_free(1024);
+        double const locked_ops = queue_throughput(locked, n, n, items);
+        double const lock_free_ops = queue_throughput(lock_free, n, n, items);
+        cout << n << "  " << (unsigned long)locked_ops << "  " << (unsigned long)lock_free_ops << endl;
+    }
+}
+/* Конец доработки: lock-free очередь */
+
+
+
+/* Доработка: очередь с раздельными блокировками головы и хвоста
+ * По мотивам главы 6 книжки. В threadsafe_queue44/45 один мутекс на всё,
+ * поэтому писатель и читатель всегда мешают друг другу. Здесь список с
+ * фиктивным узлом в хвосте: push() трогает только tail_mutex, pop - только
+ * head_mutex (и tail_mutex на короткую проверку "не пусто ли"), так что
+ * пересекаются они, только когда очередь почти пустая.
+ */
+template<typename T>
+class fine_grained_queue
+{
+private:
+    struct node
+    {
+        shared_ptr<T> data;
+        unique_ptr<node> next;
+    };
+    mutex head_mutex;
+    unique_ptr<node> head;
+    mutex tail_mutex;
+    node* tail;
+    condition_variable data_cond;
+    // Сколько читателей спит на data_cond. Пишется под head_mutex
+    atomic<unsigned> waiting;
+
+    node* get_tail()
+    {
+        lock_guard<mutex> tail_lock(tail_mutex);
+        return tail;
+    }
+    unique_ptr<node> pop_head()
+    {
+        unique_ptr<node> old_head = move(head);
+        head = move(old_head->next);
+        return old_head;
+    }
+    unique_lock<mutex> wait_for_data()
+    {
+        unique_lock<mutex> head_lock(head_mutex);
+        if (head.get() == get_tail())
+        {
+            waiting.fetch_add(1);
+            data_cond.wait(head_lock, [&]{ return head.get() != get_tail(); });
+            waiting.fetch_sub(1);
+        }
+        return head_lock;
+    }
+    unique_ptr<node> wait_pop_head()
+    {
+        unique_lock<mutex> head_lock(wait_for_data());
+        return pop_head();
+    }
+    unique_ptr<node> wait_pop_head(T& value)
+    {
+        unique_lock<mutex> head_lock(wait_for_data());
+        value = move(*head->data);
+        return pop_head();
+    }
+    unique_ptr<node> try_pop_head()
+    {
+        lock_guard<mutex> head_lock(head_mutex);
+        if (head.get() == get_tail()) return unique_ptr<node>();
+        return pop_head();
+    }
+    unique_ptr<node> try_pop_head(T& value)
+    {
+        lock_guard<mutex> head_lock(head_mutex);
+        if (head.get() == get_tail()) return unique_ptr<node>();
+        value = move(*head->data);
+        return pop_head();
+    }
+public:
+    fine_grained_queue():
+        head(new node), tail(head.get()), waiting(0)
+    {}
+    fine_grained_queue(const fine_grained_queue&) = delete;
+    fine_grained_queue& operator=(const fine_grained_queue&) = delete;
+    // Длинную цепочку unique_ptr рушим циклом, а не рекурсией
+    ~fine_grained_queue()
+    {
+        while (head) head = move(head->next);
+    }
+    void push(T new_value)
+    {
+        // Выделяем память до захвата мутекса
+        shared_ptr<T> new_data(make_shared<T>(move(new_value)));
+        unique_ptr<node> p(new node);
+        {
+            lock_guard<mutex> tail_lock(tail_mutex);
+            tail->data = new_data;
+            node* const new_tail = p.get();
+            tail->next = move(p);
+            tail = new_tail;
+        }
+        // Читатель увеличивает waiting до того, как смотрит на tail под tail_mutex,
+        // поэтому спящего мы тут точно увидим. Голову трогаем только ради него
+        if (waiting.load())
+        {
+            { lock_guard<mutex> head_lock(head_mutex); }
+            data_cond.notify_one();
+        }
+    }
+    shared_ptr<T> try_pop()
+    {
+        unique_ptr<node> old_head = try_pop_head();
+        return old_head ? old_head->data : shared_ptr<T>();
+    }
+    bool try_pop(T& value)
+    {
+        unique_ptr<node> const old_head = try_pop_head(value);
+        return bool(old_head);
+    }
+    shared_ptr<T> wait_and_pop()
+    {
+        unique_ptr<node> const old_head = wait_pop_head();
+        return old_head->data;
+    }
+    void wait_and_pop(T& value)
+    {
+        unique_ptr<node> const old_head = wait_pop_head(value);
+    }
+    bool empty()
+    {
+        lock_guard<mutex> head_lock(head_mutex);
+        return head.get() == get_tail();
+    }
+};
+
+// Тот же 4.1/4.4, но на новой очереди - заменяется один к одному
+fine_grained_queue<data_chunk> data_queue_fg;
+void data_preparation_thread_fg()
+{
+    while (more_data_to_prepare())
+    {
+        data_chunk const data = prepare_data();
+        data_queue_fg.push(data);
+    }
+}
+void data_processing_thread_fg()
+{
+    while (true)
+    {
+        data_chunk data;
+        data_queue_fg.wait_and_pop(data);
+        process(data);
+        if (is_last_chunk(data)) break;
+    }
+}
+
+// Запуск
+void run_fine_grained_queue()
+{
+    fine_grained_queue<int> q;
+    q.push(5);
+    q.push(10);
+    q.push(15);
+    int pvar;
+    q.try_pop(pvar);
+    cout << "try_pop(int): " << pvar << endl; // 5
+    cout << "wait_and_pop(): " << *q.wait_and_pop() << endl; // 10
+    cout << "Is empty? " << q.empty() << endl;
+}
+
+// Бенчмарк: threadsafe_queue45 против fine_grained_queue
+void bench_fine_grained_queue()
+{
+    unsigned const items = 64 * 8192;
+    cout << "threads(p=c)  threadsafe_queue45 ops/s  fine_grained_queue ops/s" << endl;
+    for (unsigned n = 1; n <= 64; n *= 2)
+    {
+        threadsafe_queue45<int> locked;
+        fine_grained_queue<int> two_locks;
+        double const locked_ops = queue_throughput(locked, n, n, items);
+        double const two_locks_ops = queue_throughput(two_locks, n, n, items);
+        cout << n << "  " << (unsigned long)locked_ops << "  " << (unsigned long)two_locks_ops << endl;
+    }
+}
+/* Конец доработки: очередь с раздельными блокировками */
+
+/* Доработка: конвейер из стадий с ограниченными каналами
+ * В 4.1 очередь между потоками не ограничена: если подготовка быстрее
+ * обработки, память растёт без предела, а остановка - только is_last_chunk.
+ * Тут стадии соединены каналами фиксированной ёмкости (mpmc_bounded_queue):
+ *  - у каждой стадии своё число потоков;
+ *  - порядок выхода - как пришло (ordered) или как получилось (unordered);
+ *  - переполнение канала - ждать (block) или выбросить (drop);
+ *  - конец потока - маркер nullopt по одному на каждый поток следующей
+ *    стадии, отмена и ошибка стадии доводят конвейер до конца без обработки.
+ * Памяти берётся не больше суммы ёмкостей каналов и окон переупорядочивания.
+ */
+enum class pipeline_order { unordered, ordered };
+enum class pipeline_overflow { block, drop };
+
+struct stage_options
+{
+    unsigned parallelism = 1;
+    // Ёмкость входного канала стадии (округляется вверх до степени двойки)
+    size_t capacity = 64;
+    pipeline_order order = pipeline_order::unordered;
+    pipeline_overflow overflow = pipeline_overflow::block;
+};
+
+// Общее для конвейера: функции потоков, отмена, первая ошибка
+struct pipeline_control
+{
+    vector<function<void()>> workers;
+    atomic<bool> cancelled{false};
+    mutex error_mutex;
+    exception_ptr error;
+    void fail(exception_ptr e)
+    {
+        {
+            lock_guard<mutex> lk(error_mutex);
+            if (!error) error = e;
+        }
+        cancelled = true;
+    }
+};
+
+template<typename T>
+class pipeline_channel
+{
+    mpmc_bounded_queue<optional<T>> queue;
+    pipeline_overflow const overflow;
+    atomic<unsigned> producers_left{0};
+    unsigned consumers = 1;
+    atomic<unsigned long> dropped{0};
+public:
+    pipeline_channel(size_t capacity, pipeline_overflow overflow_):
+        queue(capacity), overflow(overflow_)
+    {}
+    void set_producers(unsigned count)
+    {
+        producers_left = count;
+    }
+    void set_consumers(unsigned count)
+    {
+        consumers = count;
+    }
+    void push(T&& value)
+    {
+        optional<T> item(move(value));
+        if (overflow == pipeline_overflow::block)
+            queue.push(move(item));
+        else if (!queue.try_push(item))
+            dropped.fetch_add(1, memory_order_relaxed);
+    }
+    // nullopt - конец потока
+    optional<T> pop()
+    {
+        optional<T> item;
+        queue.wait_and_pop(item);
+        return item;
+    }
+    // Последний писатель закрывает канал. Маркеры не выбрасываются даже в режиме drop
+    void producer_done()
+    {
+        if (producers_left.fetch_sub(1) == 1)
+        {
+            for (unsigned i = 0; i < consumers; ++i)
+                queue.push(optional<T>());
+        }
+    }
+    unsigned long dropped_count() const
+    {
+        return dropped.load(memory_order_relaxed);
+    }
+};
+
+// Переупорядочивание для ordered: номер прихода выдаётся вместе с pop,
+// результат уходит дальше, когда все пришедшие раньше уже ушли
+template<typename R>
+struct reorder_window
+{
+    mutex pop_mutex;
+    mutex m;
+    condition_variable cond;
+    size_t next_arrival = 0;
+    size_t window;
+    set<size_t> in_flight;
+    map<size_t, optional<R>> done;
+    explicit reorder_window(size_t window_): window(window_) {}
+};
+
+class pipeline
+{
+    shared_ptr<pipeline_control> control;
+    vector<joining_thread> threads;
+public:
+    explicit pipeline(shared_ptr<pipeline_control> control_):
+        control(move(control_))
+    {
+        for (auto& worker : control->workers)
+            threads.emplace_back(move(worker));
+        control->workers.clear();
+    }
+    pipeline(pipeline&&) = default;
+    // Источник перестаёт читать, стадии пропускают всё, что уже в каналах
+    void cancel()
+    {
+        control->cancelled = true;
+    }
+    // Дождаться конца; ошибка стадии пробрасывается сюда
+    void wait()
+    {
+        for (auto& t : threads)
+        {
+            if (t.joinable()) t.join();
+        }
+        if (control->error) rethrow_exception(control->error);
+    }
+};
+
+template<typename T>
+class pipeline_builder
+{
+    template<typename U> friend class pipeline_builder;
+    template<typename Source> friend auto make_pipeline(Source source);
+    shared_ptr<pipeline_control> control;
+    // Подключает выход последней стадии к входному каналу следующей
+    function<void(shared_ptr<pipeline_channel<T>>)> attach;
+
+    pipeline_builder(shared_ptr<pipeline_control> control_, function<void(shared_ptr<pipeline_channel<T>>)> attach_):
+        control(move(control_)), attach(move(attach_))
+    {}
+    shared_ptr<pipeline_channel<T>> make_input(stage_options const& options)
+    {
+        auto input = make_shared<pipeline_channel<T>>(options.capacity, options.overflow);
+        input->set_consumers(options.parallelism);
+        attach(input);
+        return input;
+    }
+public:
+    template<typename Func>
+    pipeline_builder<invoke_result_t<Func&, T>> then(Func func, stage_options options = stage_options())
+    {
+        typedef invoke_result_t<Func&, T> result_type;
+        options.parallelism = max(options.parallelism, 1u);
+        auto input = make_input(options);
+        auto control_ = control;
+        unsigned const parallelism = options.parallelism;
+        bool const ordered = options.order == pipeline_order::ordered;
+        auto shared_func = make_shared<Func>(move(func));
+        auto window = make_shared<reorder_window<result_type>>(2 * size_t(parallelism));
+        return pipeline_builder<result_type>(control, [=](shared_ptr<pipeline_channel<result_type>> output)
+            {
+                output->set_producers(parallelism);
+                for (unsigned i = 0; i < parallelism; ++i)
+                {
+                    if (!ordered)
+                    {
+                        control_->workers.push_back([=]
+                            {
+                                while (optional<T> item = input->pop())
+                                {
+                                    if (control_->cancelled) continue;
+                                    try
+                                    {
+                                        output->push((*shared_func)(move(*item)));
+                                    }
+                                    catch(...)
+                                    {
+                                        control_->fail(current_exception());
+                                    }
+                                }
+                                output->producer_done();
+                            });
+                        continue;
+                    }
+                    control_->workers.push_back([=]
+                        {
+                            reorder_window<result_type>& w = *window;
+                            for (;;)
+                            {
+                                optional<T> item;
+                                size_t seq;
+                                {
+                                    lock_guard<mutex> pop_lk(w.pop_mutex);
+                                    {
+                                        unique_lock<mutex> lk(w.m);
+                                        w.cond.wait(lk, [&w]{ return w.in_flight.size() < w.window; });
+                                    }
+                                    item = input->pop();
+                                    if (!item) break;
+                                    seq = w.next_arrival++;
+                                    lock_guard<mutex> lk(w.m);
+                                    w.in_flight.insert(seq);
+                                }
+                                optional<result_type> result;
+                                if (!control_->cancelled)
+                                {
+                                    try
+                                    {
+                                        result.emplace((*shared_func)(move(*item)));
+                                    }
+                                    catch(...)
+                                    {
+                                        control_->fail(current_exception());
+                                    }
+                                }
+                                lock_guard<mutex> lk(w.m);
+                                w.done.emplace(seq, move(result));
+                                while (!w.done.empty() && w.done.begin()->first == *w.in_flight.begin())
+                                {
+                                    auto const first = w.done.begin();
+                                    if (first->second) output->push(move(*first->second));
+                                    w.in_flight.erase(first->first);
+                                    w.done.erase(first);
+                                }
+                                w.cond.notify_all();
+                            }
+                            output->producer_done();
+                        });
+                }
+            });
+    }
+    // Последняя стадия. ordered - один поток в порядке прихода, parallelism не учитывается
+    template<typename Func>
+    pipeline sink(Func func, stage_options options = stage_options())
+    {
+        if (options.order == pipeline_order::ordered || options.parallelism == 0)
+            options.parallelism = 1;
+        auto input = make_input(options);
+        auto shared_func = make_shared<Func>(move(func));
+        for (unsigned i = 0; i < options.parallelism; ++i)
+        {
+            control->workers.push_back([input, shared_func, control_ = control]
+                {
+                    while (optional<T> item = input->pop())
+                    {
+                        if (control_->cancelled) continue;
+                        try
+                        {
+                            (*shared_func)(move(*item));
+                        }
+                        catch(...)
+                        {
+                            control_->fail(current_exception());
+                        }
+                    }
+                });
+        }
+        return pipeline(control);
+    }
+};
+
+// Источник - функция без аргументов, возвращает optional<T>; nullopt - данных больше нет
+template<typename Source>
+auto make_pipeline(Source source)
+{
+    typedef typename invoke_result_t<Source&>::value_type value_type;
+    auto control = make_shared<pipeline_control>();
+    auto shared_source = make_shared<Source>(move(source));
+    return pipeline_builder<value_type>(control, [control_ = control, shared_source](shared_ptr<pipeline_channel<value_type>> output)
+        {
+            output->set_producers(1);
+            control_->workers.push_back([control_, shared_source, output]
+                {
+                    try
+                    {
+                        while (!control_->cancelled)
+                        {
+                            optional<value_type> item = (*shared_source)();
+                            if (!item) break;
+                            output->push(move(*item));
+                        }
+                    }
+                    catch(...)
+                    {
+                        control_->fail(current_exception());
+                    }
+                    output->producer_done();
+                });
+        });
+}
+
+// 4.1 на конвейере: очередь ограничена, конец - когда данные кончились, а не is_last_chunk
+void process_data41_pipeline(size_t capacity = 64)
+{
+    stage_options options;
+    options.capacity = capacity;
+    make_pipeline([]() -> optional<data_chunk>
+        {
+            if (!more_data_to_prepare()) return nullopt;
+            return prepare_data();
+        })
+        .sink([](data_chunk data){ process(data); }, options)
+        .wait();
+}
+
+// Элемент, который считает, сколько его копий живо - для замера памяти
+struct counted_item
+{
+    static atomic<long> live;
+    static atomic<long> peak;
+    unsigned long value = 0;
+    counted_item() { note(); }
+    explicit counted_item(unsigned long value_): value(value_) { note(); }
+    counted_item(counted_item const& other): value(other.value) { note(); }
+    counted_item& operator=(counted_item const&) = default;
+    ~counted_item() { live.fetch_sub(1, memory_order_relaxed); }
+    static void note()
+    {
+        long const now = live.fetch_add(1, memory_order_relaxed) + 1;
+        long seen = peak.load(memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, memory_order_relaxed)) {}
+    }
+    static void reset()
+    {
+        peak = live.load();
+    }
+};
+atomic<long> counted_item::live(0);
+atomic<long> counted_item::peak(0);
+
+// Запуск: порядок сохраняется при 4 потоках в стадии, ошибка стадии доходит до wait()
+void run_pipeline()
+{
+    unsigned long next = 0;
+    stage_options parallel;
+    parallel.parallelism = 4;
+    parallel.capacity = 8;
+    parallel.order = pipeline_order::ordered;
+    vector<unsigned long> output;
+    make_pipeline([&next]() -> optional<unsigned long>
+        {
+            if (next == 20) return nullopt;
+            return next++;
+        })
+        .then([](unsigned long i)
+            {
+                this_thread::sleep_for(chrono::microseconds((i * 7919) % 500));
+                return i * i;
+            }, parallel)
+        .sink([&output](unsigned long square){ output.push_back(square); }, parallel)
+        .wait();
+    for (auto square : output)
+        cout << square << " ";
+    cout << endl;
+    try
+    {
+        next = 0;
+        make_pipeline([&next]() -> optional<unsigned long>
+            {
+                if (next == 1000) return nullopt;
+                return next++;
+            })
+            .then([](unsigned long i)
+                {
+                    if (i == 500) throw runtime_error("stage failed on 500");
+                    return i;
+                })
+            .sink([](unsigned long){})
+            .wait();
+    }
+    catch (exception& e)
+    {
+        cout << e.what() << endl;
+    }
+    process_data41_pipeline();
+}
+
+// Бенчмарк: быстрый источник, медленный потребитель. Очередь из 4.1 против конвейера
+// с block и drop: сколько элементов одновременно живёт в памяти и сколько выброшено
+void bench_pipeline(unsigned long items = 200000)
+{
+    auto slow_consume = [](counted_item const& item)
+    {
+        // Пара микросекунд работы на элемент
+        volatile unsigned long x = item.value;
+        for (int i = 0; i < 2000; ++i) x = x * 2654435761u + 1;
+    };
+    cout << "variant  items  seconds  peak items in memory  dropped" << endl;
+    {
+        counted_item::reset();
+        threadsafe_queue45<counted_item> unbounded;
+        double const seconds = measure_seconds([&]
+            {
+                thread producer([&]
+                    {
+                        for (unsigned long i = 1; i <= items; ++i)
+                            unbounded.push(counted_item(i));
+                    });
+                for (unsigned long i = 0; i < items; ++i)
+                {
+                    counted_item item;
+                    unbounded.wait_and_pop(item);
+                    slow_consume(item);
+                }
+                producer.join();
+            });
+        cout << "unbounded queue (4.1)  " << items << "  " << seconds << "  " << counted_item::peak << "  0" << endl;
+    }
+    for (pipeline_overflow overflow : {pipeline_overflow::block, pipeline_overflow::drop})
+    {
+        counted_item::reset();
+        unsigned long next = 0;
+        unsigned long consumed = 0;
+        stage_options options;
+        options.capacity = 256;
+        options.overflow = overflow;
+        double const seconds = measure_seconds([&]
+            {
+                make_pipeline([&]() -> optional<counted_item>
+                    {
+                        if (next == items) return nullopt;
+                        return counted_item(++next);
+                    })
+                    .sink([&](counted_item item){ slow_consume(item); ++consumed; }, options)
+                    .wait();
+            });
+        cout << (overflow == pipeline_overflow::block ? "pipeline block" : "pipeline drop") << "  " << items << "  "
+             << seconds << "  " << counted_item::peak << "  " << items - consumed << endl;
+    }
+}
+/* Конец доработки: конвейер */
+
+/* Листинг 4.6 (стр 117) */
+// Пример работы с future task (как я понял, это типа запланированные операции, ленивое выполнение и всё такое)
+int find_the_answer_to_ltuae()
+{
+    return 123;
+}
+
+// Запуск листинга
+void run46()
+{
+    future<int> the_answer = async(find_the_answer_to_ltuae);
+    do_other_stuff();
+    cout << "The answer is " << the_answer.get() << endl;
+}
+/* Конец листинга 4.6 */
+
+/* Листинг 4.7 (стр 117) */
+// Опять интерфейсы и какие-то поля, всё в куче, ничего не понятно
+struct X47
+{
+    void foo(int, string const&) {}
+    string bar(string const&) { return ""; }
+};
+X47 x47;
+auto f1 = async(&X47::foo, &x47, 42, "hello");
+auto f2 = async(&X47::bar, x47, "goodbye");
+struct Y47
+{
+    double operator()(double) {return 0.0;}
+};
+Y47 y47;
+auto f3 = async(Y47(), 3.141);
+auto f4 = async(ref(y47), 2.718);
+X47 baz(X&);
+// async(baz, ref(x47));
+class move_only
+{
+public:
+    move_only();
+    move_only(move_only&&);
+    move_only(move_only const&) = delete;
+    move_only& operator=(move_only&&);
+    move_only& operator=(move_only const&) = delete;
+    void operator()();
+};
+// Требует реализации move_only...
+// auto f5 = async(move_only());
+/* Конец листинга 4.7 */
+
+/* Листинг 4.8 (стр 119) */
+// Интерфейс...
+class packaged_task48
+{
+public:
+    template<typename Callable>
+    explicit packaged_task48(Callable&& f);
+    future<string> get_future();
+    void operator()(vector<char>*, int);
+};
+/* Конец листинга 4.8 */
+
+/* Листинг 4.9 (стр 120) */
+// Собирается, но реализаций для функций не предоставили
+// Поэтому запускать не будем
+mutex m49;
+deque<packaged_task<void()>> tasks;
+bool gui_shutdown_message_received()
+{
+    return true;
+}
+void get_and_process_gui_message(){}
+void gui_thread()
+{
+    while (!gui_shutdown_message_received())
+    {
+        get_and_process_gui_message();
+        packaged_task<void()> task;
+        {
+            lock_guard<mutex> lk(m49);
+            if (tasks.empty()) continue;
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+// Вот эта строчка гадость делает - этот поток висит в воздухе
+// Лучше закомментировать, всё равно не используется нигде
+// thread gui_bg_thread(gui_thread);
+template<typename Func>
+future<void> post_task_for_gui_thread(Func f)
+{
+    packaged_task<void()> task(f);
+    future<void> res = task.get_future();
+    lock_guard<mutex> lk(m49);
+    tasks.push_back(move(task));
+    return res;
+}
+
+/* Доработка: цикл событий для потока GUI
+ * gui_thread выше крутится вхолостую (захват m49 на каждом круге, пока задач
+ * нет), а каждая post_task_for_gui_thread выделяет packaged_task. Здесь
+ * цикл с одним потребителем: без задач он спит на условной переменной
+ * (default_wait_condition, с -DWAIT_POLICY_ADAPTIVE - на futex), будят его
+ * только если он действительно спит. Задачи раскладываются по полосам
+ * приоритета (ввод, отрисовка, фон), таймеры срабатывают по дедлайну и
+ * попадают в свою полосу. Фон не голодает: после starvation_limit задач
+ * из верхних полос одна берётся из фоновой. Задачи хранятся в inline_task -
+ * маленькие лямбды лежат прямо в нём, без выделения памяти.
+ */
+// Перемещаемая задача с буфером на inline_size байт; что не влезает - в кучу
+class inline_task
+{
+    static constexpr size_t inline_size = 48;
+    struct ops_type
+    {
+        void (*call)(void*);
+        // Переместить из from в to и разрушить from
+        void (*move_to)(void* from, void* to);
+        void (*destroy)(void*);
+        bool on_heap;
+    };
+    template<typename F>
+    struct inline_ops
+    {
+        static void call(void* p) { (*static_cast<F*>(p))(); }
+        static void move_to(void* from, void* to)
+        {
+            new (to) F(move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        }
+        static void destroy(void* p) { static_cast<F*>(p)->~F(); }
+        static constexpr ops_type table{&call, &move_to, &destroy, false};
+    };
+    template<typename F>
+    struct heap_ops
+    {
+        static F* get(void* p) { return *static_cast<F**>(p); }
+        static void call(void* p) { (*get(p))(); }
+        static void move_to(void* from, void* to) { new (to) F*(get(from)); }
+        static void destroy(void* p) { delete get(p); }
+        static constexpr ops_type table{&call, &move_to, &destroy, true};
+    };
+    alignas(max_align_t) unsigned char storage[inline_size];
+    ops_type const* ops = nullptr;
+public:
+    inline_task() = default;
+    template<typename F,
+             typename = enable_if_t<!is_same<decay_t<F>, inline_task>::value>>
+    inline_task(F&& f)
+    {
+        typedef decay_t<F> func_type;
+        if constexpr (sizeof(func_type) <= inline_size && alignof(func_type) <= alignof(max_align_t) &&
+                      is_nothrow_move_constructible<func_type>::value)
+        {
+            new (storage) func_type(forward<F>(f));
+            ops = &inline_ops<func_type>::table;
+        }
+        else
+        {
+            new (storage) func_type*(new func_type(forward<F>(f)));
+            ops = &heap_ops<func_type>::table;
+        }
+    }
+    inline_task(inline_task&& other) noexcept
+    {
+        if (other.ops) other.ops->move_to(other.storage, storage);
+        ops = other.ops;
+        other.ops = nullptr;
+    }
+    inline_task& operator=(inline_task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            if (other.ops) other.ops->move_to(other.storage, storage);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+        return *this;
+    }
+    inline_task(inline_task const&) = delete;
+    inline_task& operator=(inline_task const&) = delete;
+    ~inline_task()
+    {
+        reset();
+    }
+    void reset()
+    {
+        if (ops) ops->destroy(storage);
+        ops = nullptr;
+    }
+    explicit operator bool() const
+    {
+        return ops != nullptr;
+    }
+    bool is_inline() const
+    {
+        return ops && !ops->on_heap;
+    }
+    void operator()()
+    {
+        ops->call(storage);
+    }
+};
+
+enum class gui_lane
+{
+    input,
+    render,
+    background
+};
+
+class gui_event_loop
+{
+    static constexpr size_t lane_count = 3;
+    static constexpr unsigned starvation_limit = 32;
+    struct timer
+    {
+        chrono::steady_clock::time_point deadline;
+        // При равных дедлайнах - в порядке постановки
+        unsigned long sequence;
+        gui_lane lane;
+        inline_task task;
+    };
+    struct timer_later
+    {
+        bool operator()(timer const& a, timer const& b) const
+        {
+            return a.deadline != b.deadline ? a.deadline > b.deadline : a.sequence > b.sequence;
+        }
+    };
+    mutex m;
+    default_wait_condition wake_cond;
+    std::deque<inline_task> lanes[lane_count];
+    // Куча по дедлайну (push_heap/pop_heap - из priority_queue задачу не вынуть)
+    vector<timer> timers;
+    unsigned long next_sequence = 0;
+    unsigned since_background = 0;
+    bool sleeping = false;
+    bool stopped = false;
+
+    bool take_from(gui_lane lane, inline_task& task)
+    {
+        auto& queue = lanes[size_t(lane)];
+        if (queue.empty()) return false;
+        task = move(queue.front());
+        queue.pop_front();
+        since_background = (lane == gui_lane::background) ? 0 : since_background + 1;
+        return true;
+    }
+    bool take_next(inline_task& task)
+    {
+        if (since_background >= starvation_limit && take_from(gui_lane::background, task))
+            return true;
+        return take_from(gui_lane::input, task) ||
+               take_from(gui_lane::render, task) ||
+               take_from(gui_lane::background, task);
+    }
+    void move_due_timers()
+    {
+        if (timers.empty()) return;
+        auto const now = chrono::steady_clock::now();
+        while (!timers.empty() && timers.front().deadline <= now)
+        {
+            pop_heap(timers.begin(), timers.end(), timer_later());
+            lanes[size_t(timers.back().lane)].push_back(move(timers.back().task));
+            timers.pop_back();
+        }
+    }
+public:
+    gui_event_loop() = default;
+    gui_event_loop(gui_event_loop const&) = delete;
+    gui_event_loop& operator=(gui_event_loop const&) = delete;
+
+    template<typename Func>
+    void post(gui_lane lane, Func&& f)
+    {
+        inline_task task(forward<Func>(f));
+        bool wake;
+        {
+            lock_guard<mutex> lk(m);
+            lanes[size_t(lane)].push_back(move(task));
+            wake = sleeping;
+        }
+        if (wake) wake_cond.notify_one();
+    }
+    template<typename Func>
+    void post_at(chrono::steady_clock::time_point deadline, gui_lane lane, Func&& f)
+    {
+        inline_task task(forward<Func>(f));
+        bool wake;
+        {
+            lock_guard<mutex> lk(m);
+            timers.push_back(timer{deadline, next_sequence++, lane, move(task)});
+            push_heap(timers.begin(), timers.end(), timer_later());
+            // Будить, только если новый таймер раньше того, до которого спим
+            wake = sleeping && timers.front().sequence == next_sequence - 1;
+        }
+        if (wake) wake_cond.notify_one();
+    }
+    template<typename Rep, typename Period, typename Func>
+    void post_after(chrono::duration<Rep, Period> delay, gui_lane lane, Func&& f)
+    {
+        post_at(chrono::steady_clock::now() + delay, lane, forward<Func>(f));
+    }
+    // Выйти из run() после текущей задачи; оставшиеся задачи и таймеры не выполняются
+    void stop()
+    {
+        {
+            lock_guard<mutex> lk(m);
+            stopped = true;
+        }
+        wake_cond.notify_one();
+    }
+    // Крутит цикл в вызывающем потоке до stop(). Исключение из задачи
+    // выходит наружу, цикл можно запустить снова
+    void run()
+    {
+        unique_lock<mutex> lk(m);
+        while (!stopped)
+        {
+            move_due_timers();
+            inline_task task;
+            if (take_next(task))
+            {
+                lk.unlock();
+                task();
+                lk.lock();
+                continue;
+            }
+            sleeping = true;
+            if (timers.empty())
+                wake_cond.wait(lk);
+            else
+                wake_cond.wait_until(lk, timers.front().deadline);
+            sleeping = false;
+        }
+        stopped = false;
+    }
+};
+
+// Запуск: задачи в полосах выполняются по приоритету, таймер - по дедлайну
+void run49()
+{
+    gui_event_loop loop;
+    string captured = "render";
+    loop.post(gui_lane::background, []{ cout << "background" << endl; });
+    loop.post(gui_lane::render, [captured]{ cout << captured << endl; });
+    loop.post(gui_lane::input, []{ cout << "input" << endl; });
+    loop.post_after(chrono::milliseconds(20), gui_lane::background, [&loop]{ cout << "timer" << endl; loop.stop(); });
+    loop.post_after(chrono::milliseconds(10), gui_lane::input, []{ cout << "earlier timer" << endl; });
+    loop.run(); // input render background earlier timer timer
+    inline_task small([captured]{});
+    array<char, 256> big{};
+    inline_task large([big]{ (void)big; });
+    cout << "small lambda inline: " << small.is_inline() << ", 256-byte lambda inline: " << large.is_inline() << endl;
+}
+
+// Бенчмарк: задержка от post до выполнения, опоздание таймеров и сколько
+// процессора ест простаивающий цикл - листинг 4.9 (холостой цикл и
+// packaged_task) против gui_event_loop
+void bench_gui_event_loop(unsigned posts = 20000, unsigned timer_count = 2000)
+{
+    // p50 и p99; на пустом замере - нули
+    auto percentiles = [](vector<double>& v)
+    {
+        if (v.empty()) return string("0  0");
+        sort(v.begin(), v.end());
+        return to_string(v[v.size() / 2]) + "  " + to_string(v[min(v.size() - 1, v.size() * 99 / 100)]);
+    };
+    // Доля одного ядра, которую процесс съел за время простоя цикла
+    auto idle_cpu = []
+    {
+        clock_t const before = clock();
+        this_thread::sleep_for(chrono::milliseconds(300));
+        return double(clock() - before) / CLOCKS_PER_SEC / 0.3 * 100;
+    };
+    cout << "loop  idle CPU %  post-to-run p50 us  p99 us" << endl;
+    {
+        // Листинг 4.9 как есть, только с флагом выхода
+        mutex busy_mutex;
+        std::deque<packaged_task<void()>> busy_tasks;
+        atomic<bool> busy_done(false);
+        thread busy_thread([&]
+            {
+                while (!busy_done)
+                {
+                    packaged_task<void()> task;
+                    {
+                        lock_guard<mutex> lk(busy_mutex);
+                        if (busy_tasks.empty()) continue;
+                        task = move(busy_tasks.front());
+                        busy_tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+        double const cpu = idle_cpu();
+        vector<double> latencies(posts);
+        for (unsigned i = 0; i < posts; ++i)
+        {
+            auto const posted = chrono::steady_clock::now();
+            double& slot = latencies[i];
+            packaged_task<void()> task([posted, &slot]
+                {
+                    slot = chrono::duration<double, micro>(chrono::steady_clock::now() - posted).count();
+                });
+            future<void> done = task.get_future();
+            {
+                lock_guard<mutex> lk(busy_mutex);
+                busy_tasks.push_back(move(task));
+            }
+            done.wait();
+        }
+        busy_done = true;
+        busy_thread.join();
+        cout << "listing 4.9  " << cpu << "  " << percentiles(latencies) << endl;
+    }
+    {
+        gui_event_loop loop;
+        thread loop_thread([&loop]{ loop.run(); });
+        double const cpu = idle_cpu();
+        vector<double> latencies(posts);
+        for (unsigned i = 0; i < posts; ++i)
+        {
+            promise<void> done;
+            auto const posted = chrono::steady_clock::now();
+            loop.post(gui_lane::input, [posted, &slot = latencies[i], &done]
+                {
+                    slot = chrono::duration<double, micro>(chrono::steady_clock::now() - posted).count();
+                    done.set_value();
+                });
+            done.get_future().wait();
+        }
+        cout << "gui_event_loop  " << cpu << "  " << percentiles(latencies) << endl;
+
+        // Таймеры через 200 мкс друг от друга, опоздание относительно дедлайна
+        vector<double> lateness(timer_count);
+        unsigned remaining = timer_count;
+        promise<void> all_fired;
+        auto const start = chrono::steady_clock::now() + chrono::milliseconds(20);
+        for (unsigned i = 0; i < timer_count; ++i)
+        {
+            auto const deadline = start + chrono::microseconds(200) * i;
+            // Все таймеры выполняет один поток цикла, так что remaining без атомиков
+            loop.post_at(deadline, gui_lane::render, [deadline, &slot = lateness[i], &remaining, &all_fired]
+                {
+                    slot = chrono::duration<double, micro>(chrono::steady_clock::now() - deadline).count();
+                    if (!--remaining) all_fired.set_value();
+                });
+        }
+        if (timer_count) all_fired.get_future().wait();
+        cout << "timer lateness p50 us  p99 us: " << percentiles(lateness) << endl;
+        // Для сравнения - сколько опаздывает простой sleep_until на этой машине
+        vector<double> sleep_lateness(timer_count / 4);
+        for (auto& slot : sleep_lateness)
+        {
+            auto const deadline = chrono::steady_clock::now() + chrono::microseconds(200);
+            this_thread::sleep_until(deadline);
+            slot = chrono::duration<double, micro>(chrono::steady_clock::now() - deadline).count();
+        }
+        cout << "sleep_until lateness p50 us  p99 us: " << percentiles(sleep_lateness) << endl;
+        loop.stop();
+        loop_thread.join();
+    }
+}
+/* Конец листинга 4.9 */
+
+/* Листинг 4.10 (стр 122) */
+// Откуда connection_set?
+// Обработка соединений с promise
+template<typename connection_set,
+         typename connection_iterator,
+         typename data_packet,
+         typename payload_type,
+         typename outgoing_packet>
+void process_connections(connection_set& connections)
+{
+    while (!done(connections))
+    {
+        for(connection_iterator
+                connection = connections.begin(), end = connections.end();
+            connection != end;
+            ++connection)
+        {
+            if (connection->has_incoming_data())
+            {
+                data_packet data = connection->incoming();
+                promise<payload_type>& p = connection->get_promise(data.id);
+                p.set_value(data.payload);
+            }
+            if (connection->has_outgoing_data())
+            {
+                outgoing_packet data = connection->top_of_outgoing_queue();
+                connection->send(data.payload);
+                data.promise.set_value(true);
+            }
+        }
+    }
+}
+/* Конец листинга 4.10 */
+
+/* Листинг 4.11 (стр 133) */
+// Без функции запуска
+default_wait_condition cv411;
+bool done411;
+mutex m411;
+bool wait_loop()
+{
+    auto const timeout = chrono::steady_clock::now() + chrono::milliseconds(500);
+    unique_lock<mutex> lk(m411);
+    while (!done411)
+    {
+        if (cv411.wait_until(lk, timeout) == cv_status::timeout) break;
+    }
+    return done411;
+}
+
+// То же для сопрограммы: ждём события или таймаута, поток не занят
+async_event done_event411;
+task<bool> async_wait_loop()
+{
+    auto const timeout = chrono::steady_clock::now() + chrono::milliseconds(500);
+    co_return co_await done_event411.wait_until(timeout);
+}
+/* Конец листинга 4.11 */
+
+/* Листинг 4.12 (стр ) */
+// Быстрая сортировка в один поток
+template<typename T>
+list<T> sequential_quick_sort(list<T> input)
+{
+    if (input.empty()) return input;
+    list<T> result;
+    result.splice(result.begin(), input, input.begin());
+    T const& pivot = *result.begin();
+    auto divide_point = partition(input.begin(), input.end(),
+                                  [&](T const& t){return t < pivot;});
+    list<T> lower_part;
     lower_part.splice(lower_part.end(), input, input.begin(), divide_point);
     auto new_lower(sequential_quick_sort(move(lower_part)));
     auto new_higher(sequential_quick_sort(move(input)));
@@ -1334,412 +5544,3151 @@ list<T> sequential_quick_sort(list<T> input)
     return result;
 }
 
-// Запуск
-void run412()
+// Запуск
+void run412()
+{
+    cout << "run412() invoked" << endl;
+    list<int> l;
+    l.push_back(3);
+    l.push_back(8);
+    l.push_back(1);
+    cout << "before sort: ";
+    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
+        cout << *i << " ";
+    cout << endl;
+
+    l = sequential_quick_sort(l);
+    cout << "after sort: ";
+    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
+        cout << *i << " ";
+    cout << endl;
+}
+/* Конец листинга 4.12 */
+
+/* Листинг 4.13 (стр 138) */
+// Многопоточная быстрая сортировка с future
+template<typename T>
+list<T> parallel_quick_sort(list<T> input)
+{
+    if (input.empty()) return input;
+    list<T> result;
+    result.splice(result.begin(), input, input.begin());
+    T const& pivot = *result.begin();
+    auto divide_point = partition(input.begin(), input.end(), [&](T const& t){return t < pivot;});
+    list<T> lower_part;
+    lower_part.splice(lower_part.end(), input, input.begin(), divide_point);
+    // Нижнюю часть отдаём в пул, а не в async - иначе на каждый уровень рекурсии новый поток
+    work_stealing_pool& pool = default_thread_pool();
+    future<list<T>> new_lower(pool.submit([lower = move(lower_part)]() mutable
+        {
+            return parallel_quick_sort(move(lower));
+        }));
+    auto new_higher(parallel_quick_sort(move(input)));
+    result.splice(result.end(), new_higher);
+    // Пока нижняя часть не готова - помогаем пулу, а не спим
+    pool.run_pending_until_ready(new_lower);
+    result.splice(result.begin(), new_lower.get());
+    return result;
+}
+
+// Запуск
+void run413()
+{
+    cout << "run413() invoked" << endl;
+    list<int> l;
+    l.push_back(6);
+    l.push_back(453);
+    l.push_back(0);
+    cout << "before sort: ";
+    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
+        cout << *i << " ";
+    cout << endl;
+
+    l = parallel_quick_sort(l);
+    cout << "after sort: ";
+    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
+        cout << *i << " ";
+    cout << endl;
+}
+/* Конец листинга 4.13 */
+
+
+
+/* Доработка: параллельная интроспективная сортировка массива
+ * Сортировки 4.12/4.13 работают со списком: каждый шаг - прыжки по указателям
+ * и splice узлов, опорный элемент всегда первый (на отсортированном входе
+ * O(n^2) и рекурсия глубиной n), а async на каждом уровне. Здесь сортировка
+ * на месте для итераторов произвольного доступа:
+ * - опорный элемент - медиана трёх, на больших кусках - медиана медиан (ninther);
+ * - разбиение на три части (<, ==, >), так что много одинаковых ключей не страшно;
+ * - кусок меньше grain сортируется std::sort в текущем потоке;
+ * - глубже 2*log2(n) уровней - пирамидальная сортировка, O(n log n) в любом случае;
+ * - левая часть уходит задачей в пул, правая - в текущем потоке.
+ */
+template<typename RandomIt, typename Compare>
+RandomIt median_of_three(RandomIt a, RandomIt b, RandomIt c, Compare& comp)
+{
+    if (comp(*a, *b))
+    {
+        if (comp(*b, *c)) return b;
+        return comp(*a, *c) ? c : a;
+    }
+    if (comp(*a, *c)) return a;
+    return comp(*b, *c) ? c : b;
+}
+
+template<typename RandomIt, typename Compare>
+RandomIt choose_pivot(RandomIt first, RandomIt last, Compare& comp)
+{
+    auto const length = last - first;
+    RandomIt const middle = first + length / 2;
+    if (length < 1024)
+        return median_of_three(first, middle, last - 1, comp);
+    auto const step = length / 8;
+    return median_of_three(median_of_three(first, first + step, first + 2 * step, comp),
+                           median_of_three(middle - step, middle, middle + step, comp),
+                           median_of_three(last - 1 - 2 * step, last - 1 - step, last - 1, comp),
+                           comp);
+}
+
+template<typename RandomIt, typename Compare>
+void parallel_introsort(RandomIt first, RandomIt last, Compare comp, unsigned depth_limit,
+                        size_t grain, work_stealing_pool& pool)
+{
+    typedef typename iterator_traits<RandomIt>::value_type value_type;
+    vector<future<void>> lower_parts;
+    exception_ptr error;
+    try
+    {
+        // Левые части уходят задачами, правую досортировываем этим же циклом
+        while (size_t(last - first) > grain && depth_limit)
+        {
+            --depth_limit;
+            value_type const pivot = *choose_pivot(first, last, comp);
+            RandomIt const lower_end = partition(first, last, [&](value_type const& x){ return comp(x, pivot); });
+            RandomIt const upper_begin = partition(lower_end, last, [&](value_type const& x){ return !comp(pivot, x); });
+            if (lower_end - first > 1)
+            {
+                lower_parts.push_back(pool.submit([=, &pool]
+                    {
+                        parallel_introsort(first, lower_end, comp, depth_limit, grain, pool);
+                    }));
+            }
+            first = upper_begin;
+        }
+        if (size_t(last - first) > grain)
+            partial_sort(first, last, last, comp);
+        else
+            sort(first, last, comp);
+    }
+    catch(...)
+    {
+        error = current_exception();
+    }
+    for (auto& part : lower_parts)
+    {
+        pool.run_pending_until_ready(part);
+        try
+        {
+            part.get();
+        }
+        catch(...)
+        {
+            if (!error) error = current_exception();
+        }
+    }
+    if (error)
+        rethrow_exception(error);
+}
+
+template<typename RandomIt, typename Compare>
+void parallel_sort(RandomIt first, RandomIt last, Compare comp, size_t grain = 16384)
+{
+    size_t const length = last - first;
+    if (length < 2) return;
+    unsigned depth_limit = 0;
+    for (size_t n = length; n > 1; n >>= 1)
+        depth_limit += 2;
+    parallel_introsort(first, last, comp, depth_limit, max(grain, size_t(16)), default_thread_pool());
+}
+
+template<typename RandomIt>
+void parallel_sort(RandomIt first, RandomIt last)
+{
+    parallel_sort(first, last, less<typename iterator_traits<RandomIt>::value_type>());
+}
+
+// Запуск
+void run_parallel_sort()
+{
+    vector<int> v{6, 453, 0, 17, 17, -3, 8};
+    parallel_sort(v.begin(), v.end());
+    cout << "after sort: ";
+    for (int i : v)
+        cout << i << " ";
+    cout << endl;
+}
+
+// Входные данные для бенчмарков сортировки
+enum class sort_input
+{
+    random,
+    sorted,
+    many_duplicates
+};
+
+vector<int> make_sort_input(sort_input kind, size_t n)
+{
+    vector<int> data(n);
+    unsigned state = 12345;
+    for (size_t i = 0; i < n; ++i)
+    {
+        state = state * 1664525u + 1013904223u;
+        switch (kind)
+        {
+        case sort_input::random: data[i] = int(state >> 1); break;
+        case sort_input::sorted: data[i] = int(i); break;
+        case sort_input::many_duplicates: data[i] = int((state >> 8) % 16); break;
+        }
+    }
+    return data;
+}
+
+char const* sort_input_name(sort_input kind)
+{
+    switch (kind)
+    {
+    case sort_input::random: return "random";
+    case sort_input::sorted: return "sorted";
+    default: return "many_duplicates";
+    }
+}
+
+// Бенчмарк: std::sort, parallel_sort и списочные сортировки из 4.12/4.13.
+// Списочные на отсортированном входе и дубликатах уходят в O(n^2) и рекурсию
+// глубиной n, поэтому им даём не больше list_limit элементов
+void bench_parallel_sort(size_t n = 10000000, size_t list_limit = 5000)
+{
+    cout << "input  n  std::sort s  parallel_sort s  |  list n  sequential_quick_sort s  parallel_quick_sort s" << endl;
+    for (sort_input kind : {sort_input::random, sort_input::sorted, sort_input::many_duplicates})
+    {
+        vector<int> const input = make_sort_input(kind, n);
+        vector<int> a = input, b = input;
+        double const std_time = measure_seconds([&]{ sort(a.begin(), a.end()); });
+        double const parallel_time = measure_seconds([&]{ parallel_sort(b.begin(), b.end()); });
+        size_t const list_n = kind == sort_input::random ? min(n, size_t(100000)) : min(n, list_limit);
+        list<int> l(input.begin(), input.begin() + list_n);
+        list<int> sorted_sequential, sorted_parallel;
+        double const list_time = measure_seconds([&]{ sorted_sequential = sequential_quick_sort(l); });
+        double const list_parallel_time = measure_seconds([&]{ sorted_parallel = parallel_quick_sort(l); });
+        cout << sort_input_name(kind) << "  " << n << "  " << std_time << "  " << parallel_time
+             << (a == b ? "" : "  MISMATCH") << "  |  " << list_n << "  " << list_time << "  " << list_parallel_time << endl;
+    }
+}
+/* Конец доработки: параллельная сортировка массива */
+
+
+
+/* Доработка: параллельная устойчивая сортировка слиянием и слияние k прогонов
+ * Быстрая сортировка не сохраняет порядок равных ключей, а записи иногда
+ * так и надо сортировать. Тут снизу вверх: короткие прогоны сортируются
+ * вставками, потом раунды попарных слияний. Каждый раунд делится на куски
+ * по выходу, а не по парам: граница куска внутри пары находится двоичным
+ * поиском (co-rank), поэтому даже последнее слияние двух половин идёт на
+ * всех ядрах. Память - один буфер на n элементов на всю сортировку,
+ * раунды перекладывают данные туда-обратно.
+ */
+// Сколько элементов взять из a, чтобы первые k элементов слияния a и b
+// совпали с первыми i из a и k-i из b. При равенстве раньше идёт a - это и
+// даёт устойчивость
+template<typename RandomIt, typename Compare>
+size_t merge_co_rank(size_t k, RandomIt a, size_t a_size, RandomIt b, size_t b_size, Compare& comp)
+{
+    size_t lo = k > b_size ? k - b_size : 0;
+    size_t hi = min(k, a_size);
+    while (lo < hi)
+    {
+        size_t const i = lo + (hi - lo) / 2;
+        size_t const j = k - i;
+        // Взяли из a достаточно, если следующий элемент a строго больше последнего взятого из b
+        if (i == a_size || j == 0 || comp(b[j - 1], a[i]))
+            hi = i;
+        else
+            lo = i + 1;
+    }
+    return lo;
+}
+
+// Слить в dst кусок выхода [lo, hi) текущего раунда. bounds - начала прогонов
+// и n в конце, прогоны сливаются парами (0,1), (2,3)...; непарный просто переносится
+template<typename SrcIt, typename DstIt, typename Compare>
+void merge_output_slice(SrcIt src, DstIt dst, vector<size_t> const& bounds, size_t lo, size_t hi, Compare& comp)
+{
+    size_t const runs = bounds.size() - 1;
+    size_t run = upper_bound(bounds.begin(), bounds.end(), lo) - bounds.begin() - 1;
+    run -= run % 2;
+    while (lo < hi)
+    {
+        size_t const a_begin = bounds[run];
+        size_t const a_end = bounds[run + 1];
+        size_t const b_end = run + 2 <= runs ? bounds[run + 2] : a_end;
+        size_t const slice_end = min(hi, b_end);
+        size_t const k_begin = lo - a_begin;
+        size_t const k_end = slice_end - a_begin;
+        size_t const i_begin = merge_co_rank(k_begin, src + a_begin, a_end - a_begin, src + a_end, b_end - a_end, comp);
+        size_t const i_end = merge_co_rank(k_end, src + a_begin, a_end - a_begin, src + a_end, b_end - a_end, comp);
+        merge(make_move_iterator(src + a_begin + i_begin), make_move_iterator(src + a_begin + i_end),
+              make_move_iterator(src + a_end + (k_begin - i_begin)), make_move_iterator(src + a_end + (k_end - i_end)),
+              dst + lo, comp);
+        lo = slice_end;
+        run += 2;
+    }
+}
+
+// Выполнить f(0..count-1) в пуле и дождаться всех. Исключение отдаём после
+// того, как закончат остальные - они работают с нашими данными.
+// Задачи, не начавшиеся до отмены token, пропускаются без ошибки
+template<typename Func>
+void run_indexed_tasks(work_stealing_pool& pool, size_t count, Func f,
+                       cancellation_token token = cancellation_token())
+{
+    vector<future<void>> tasks;
+    exception_ptr error;
+    try
+    {
+        for (size_t i = 1; i < count; ++i)
+            tasks.push_back(pool.submit([&f, i]{ f(i); }, token));
+        if (count) f(0);
+    }
+    catch(...)
+    {
+        error = current_exception();
+    }
+    for (auto& task : tasks)
+    {
+        pool.run_pending_until_ready(task);
+        try
+        {
+            task.get();
+        }
+        catch (operation_cancelled&)
+        {
+            // Своё operation_cancelled из f без отмены token - обычная ошибка
+            if (!token.is_cancelled() && !error) error = current_exception();
+        }
+        catch(...)
+        {
+            if (!error) error = current_exception();
+        }
+    }
+    if (error)
+        rethrow_exception(error);
+}
+
+// Раунды слияния отсортированных прогонов [first + run_starts[i], first + run_starts[i+1]).
+// buffer - не меньше n элементов, результат оказывается на месте
+template<typename RandomIt, typename BufferIt, typename Compare>
+void merge_runs_with_buffer(RandomIt first, RandomIt last, vector<size_t> bounds, BufferIt buffer,
+                            Compare comp, size_t grain, work_stealing_pool& pool)
+{
+    size_t const n = last - first;
+    bounds.push_back(n);
+    size_t const slices = max(size_t(1), min(n / max(grain, size_t(1)), size_t(pool.size()) * 4));
+    bool in_buffer = false;
+    while (bounds.size() > 2)
+    {
+        run_indexed_tasks(pool, slices, [&](size_t slice)
+            {
+                size_t const lo = n * slice / slices;
+                size_t const hi = n * (slice + 1) / slices;
+                if (in_buffer)
+                    merge_output_slice(buffer, first, bounds, lo, hi, comp);
+                else
+                    merge_output_slice(first, buffer, bounds, lo, hi, comp);
+            });
+        in_buffer = !in_buffer;
+        vector<size_t> merged;
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2)
+            merged.push_back(bounds[i]);
+        merged.push_back(n);
+        bounds.swap(merged);
+    }
+    if (in_buffer)
+    {
+        run_indexed_tasks(pool, slices, [&](size_t slice)
+            {
+                size_t const lo = n * slice / slices;
+                size_t const hi = n * (slice + 1) / slices;
+                move(buffer + lo, buffer + hi, first + lo);
+            });
+    }
+}
+
+// Слияние k отсортированных прогонов. run_starts - начала прогонов по возрастанию,
+// первый 0. Буфер на n элементов выделяется один раз
+template<typename RandomIt, typename Compare>
+void parallel_merge_runs(RandomIt first, RandomIt last, vector<size_t> run_starts, Compare comp, size_t grain = 16384)
+{
+    if (run_starts.size() < 2) return;
+    vector<typename iterator_traits<RandomIt>::value_type> buffer(last - first);
+    merge_runs_with_buffer(first, last, move(run_starts), buffer.begin(), comp, grain, default_thread_pool());
+}
+
+template<typename RandomIt, typename Compare>
+void parallel_stable_sort(RandomIt first, RandomIt last, Compare comp, size_t grain = 16384)
+{
+    size_t const n = last - first;
+    if (n < 2) return;
+    size_t const run_length = 32;
+    work_stealing_pool& pool = default_thread_pool();
+    // Короткие прогоны - вставками, они устойчивы и памяти не просят
+    size_t const runs = (n + run_length - 1) / run_length;
+    size_t const runs_per_task = max(size_t(1), grain / run_length);
+    size_t const tasks = (runs + runs_per_task - 1) / runs_per_task;
+    run_indexed_tasks(pool, tasks, [&](size_t task)
+        {
+            size_t const run_end = min(runs, (task + 1) * runs_per_task);
+            for (size_t run = task * runs_per_task; run < run_end; ++run)
+            {
+                RandomIt const run_first = first + run * run_length;
+                RandomIt const run_last = first + min(n, (run + 1) * run_length);
+                for (RandomIt i = run_first + 1; i < run_last; ++i)
+                {
+                    auto value = move(*i);
+                    RandomIt j = i;
+                    for (; j != run_first && comp(value, *(j - 1)); --j)
+                        *j = move(*(j - 1));
+                    *j = move(value);
+                }
+            }
+        });
+    vector<size_t> bounds;
+    for (size_t run = 0; run < runs; ++run)
+        bounds.push_back(run * run_length);
+    vector<typename iterator_traits<RandomIt>::value_type> buffer(n);
+    merge_runs_with_buffer(first, last, move(bounds), buffer.begin(), comp, grain, pool);
+}
+
+template<typename RandomIt>
+void parallel_stable_sort(RandomIt first, RandomIt last)
+{
+    parallel_stable_sort(first, last, less<typename iterator_traits<RandomIt>::value_type>());
+}
+
+// Запуск: записи с одинаковыми ключами сохраняют исходный порядок
+void run_parallel_stable_sort()
+{
+    vector<pair<int, char>> records{{2, 'a'}, {1, 'b'}, {2, 'c'}, {1, 'd'}, {0, 'e'}, {2, 'f'}};
+    parallel_stable_sort(records.begin(), records.end(),
+        [](pair<int, char> const& lhs, pair<int, char> const& rhs){ return lhs.first < rhs.first; });
+    for (auto const& r : records)
+        cout << r.first << r.second << " ";
+    cout << endl; // 0e 1b 1d 2a 2c 2f
+    vector<int> runs{1, 4, 9, 2, 3, 10, 0, 5};
+    parallel_merge_runs(runs.begin(), runs.end(), {0, 3, 6}, less<int>());
+    for (int i : runs)
+        cout << i << " ";
+    cout << endl;
+}
+
+// Бенчмарк: std::stable_sort против parallel_stable_sort
+void bench_parallel_stable_sort(size_t n = 10000000)
+{
+    cout << "input  n  std::stable_sort s  parallel_stable_sort s" << endl;
+    for (sort_input kind : {sort_input::random, sort_input::sorted, sort_input::many_duplicates})
+    {
+        vector<int> a = make_sort_input(kind, n);
+        vector<int> b = a;
+        double const std_time = measure_seconds([&]{ stable_sort(a.begin(), a.end()); });
+        double const parallel_time = measure_seconds([&]{ parallel_stable_sort(b.begin(), b.end()); });
+        cout << sort_input_name(kind) << "  " << n << "  " << std_time << "  " << parallel_time
+             << (a == b ? "" : "  MISMATCH") << endl;
+    }
+}
+/* Конец доработки: сортировка слиянием */
+
+
+
+/* Доработка: параллельная поразрядная сортировка
+ * Для int/uint64_t/float сравнения не нужны: LSD по байтам, за проход -
+ * гистограммы по блокам, префиксные суммы и раскладка. Каждый блок сначала
+ * копит элементы в небольших буферах на каждый разряд и сбрасывает их
+ * целиком - запись идёт полосами, а не в 256 разных мест вперемешку.
+ * Проход, где у всех элементов один и тот же байт, пропускается.
+ */
+// Перевод ключа в беззнаковое число с тем же порядком
+template<typename Key, typename = void>
+struct radix_key_traits;
+
+template<typename Key>
+struct radix_key_traits<Key, enable_if_t<is_integral<Key>::value>>
+{
+    typedef make_unsigned_t<Key> bits_type;
+    static bits_type to_bits(Key key)
+    {
+        bits_type bits = bits_type(key);
+        if (is_signed<Key>::value)
+            bits ^= bits_type(1) << (sizeof(Key) * CHAR_BIT - 1);
+        return bits;
+    }
+};
+
+// Отрицательные числа с плавающей точкой идут в обратном порядке, поэтому у них
+// инвертируются все биты, у положительных - только знаковый. -0.0 встаёт перед 0.0
+template<typename Key>
+struct radix_key_traits<Key, enable_if_t<is_floating_point<Key>::value>>
+{
+    typedef conditional_t<sizeof(Key) == 4, uint32_t, uint64_t> bits_type;
+    static_assert(sizeof(Key) == sizeof(bits_type), "unsupported floating point width");
+    static bits_type to_bits(Key key)
+    {
+        bits_type bits;
+        memcpy(&bits, &key, sizeof(bits));
+        bits_type const sign = bits_type(1) << (sizeof(Key) * CHAR_BIT - 1);
+        return (bits & sign) ? ~bits : (bits | sign);
+    }
+};
+
+// Один проход LSD по байту shift/8 из src в dst
+template<typename SrcIt, typename DstIt, typename KeyOf>
+void radix_pass(SrcIt src, DstIt dst, size_t n, unsigned shift, KeyOf& key_of,
+                vector<array<size_t, 256>>& counts, work_stealing_pool& pool)
+{
+    typedef typename iterator_traits<SrcIt>::value_type value_type;
+    size_t const blocks = counts.size();
+    run_indexed_tasks(pool, blocks, [&](size_t block)
+        {
+            size_t const begin = n * block / blocks;
+            size_t const end = n * (block + 1) / blocks;
+            array<size_t, 256>& offsets = counts[block];
+            // Буфер на разряд: примерно строка кэша, но не меньше 4 элементов
+            size_t const buffered = max(size_t(4), cache_line_size / sizeof(value_type));
+            vector<value_type> staging(256 * buffered);
+            array<unsigned, 256> filled{};
+            for (size_t i = begin; i < end; ++i)
+            {
+                unsigned const digit = unsigned(key_of(src[i]) >> shift) & 0xff;
+                staging[digit * buffered + filled[digit]] = move(src[i]);
+                if (++filled[digit] == buffered)
+                {
+                    move(staging.begin() + digit * buffered, staging.begin() + (digit + 1) * buffered, dst + offsets[digit]);
+                    offsets[digit] += buffered;
+                    filled[digit] = 0;
+                }
+            }
+            for (unsigned digit = 0; digit < 256; ++digit)
+                move(staging.begin() + digit * buffered, staging.begin() + digit * buffered + filled[digit],
+                     dst + offsets[digit]);
+        });
+}
+
+// Сортировка по ключу key_of(элемент); ключ - целое или с плавающей точкой.
+// Устойчивая, буфер на n элементов выделяется один раз
+template<typename RandomIt, typename KeyOf>
+void parallel_radix_sort(RandomIt first, RandomIt last, KeyOf key_of, size_t grain = 65536)
+{
+    typedef typename iterator_traits<RandomIt>::value_type value_type;
+    typedef decay_t<decltype(key_of(*first))> key_type;
+    typedef radix_key_traits<key_type> traits;
+    size_t const n = last - first;
+    if (n < 2) return;
+    work_stealing_pool& pool = default_thread_pool();
+    size_t const blocks = max(size_t(1), min(n / max(grain, size_t(1)), size_t(pool.size()) * 4));
+    auto bits_of = [&key_of](value_type const& value){ return traits::to_bits(key_of(value)); };
+
+    vector<value_type> buffer(n);
+    vector<array<size_t, 256>> counts(blocks);
+    bool in_buffer = false;
+    for (unsigned shift = 0; shift < sizeof(typename traits::bits_type) * CHAR_BIT; shift += 8)
+    {
+        // Гистограммы по блокам
+        run_indexed_tasks(pool, blocks, [&](size_t block)
+            {
+                array<size_t, 256>& count = counts[block];
+                count.fill(0);
+                size_t const end = n * (block + 1) / blocks;
+                for (size_t i = n * block / blocks; i < end; ++i)
+                    ++count[unsigned((in_buffer ? bits_of(buffer[i]) : bits_of(first[i])) >> shift) & 0xff];
+            });
+        // Все в одном разряде - проход ничего не меняет
+        bool trivial = false;
+        for (unsigned digit = 0; digit < 256 && !trivial; ++digit)
+        {
+            size_t total = 0;
+            for (auto const& count : counts)
+                total += count[digit];
+            trivial = total == n;
+        }
+        if (trivial) continue;
+        // Префиксные суммы: разряд за разрядом, внутри разряда - блок за блоком
+        size_t offset = 0;
+        for (unsigned digit = 0; digit < 256; ++digit)
+        {
+            for (auto& count : counts)
+            {
+                size_t const c = count[digit];
+                count[digit] = offset;
+                offset += c;
+            }
+        }
+        if (in_buffer)
+            radix_pass(buffer.begin(), first, n, shift, bits_of, counts, pool);
+        else
+            radix_pass(first, buffer.begin(), n, shift, bits_of, counts, pool);
+        in_buffer = !in_buffer;
+    }
+    if (in_buffer)
+    {
+        run_indexed_tasks(pool, blocks, [&](size_t block)
+            {
+                move(buffer.begin() + n * block / blocks, buffer.begin() + n * (block + 1) / blocks,
+                     first + n * block / blocks);
+            });
+    }
+}
+
+template<typename RandomIt>
+void parallel_radix_sort(RandomIt first, RandomIt last)
+{
+    typedef typename iterator_traits<RandomIt>::value_type value_type;
+    parallel_radix_sort(first, last, [](value_type const& value){ return value; });
+}
+
+// Пары ключ-значение сортируются по first, значения с равными ключами не переставляются
+template<typename Key, typename Value>
+void parallel_radix_sort_pairs(vector<pair<Key, Value>>& items)
+{
+    parallel_radix_sort(items.begin(), items.end(), [](pair<Key, Value> const& item){ return item.first; });
+}
+
+// Запуск: знаковые, с плавающей точкой и пары
+void run_parallel_radix_sort()
+{
+    vector<int> ints{5, -3, 0, 42, -100, 7, 7, 1};
+    parallel_radix_sort(ints.begin(), ints.end());
+    for (int i : ints)
+        cout << i << " ";
+    cout << endl;
+    vector<double> doubles{2.5, -0.5, 0.0, -7.25, 1e10, -1e-3};
+    parallel_radix_sort(doubles.begin(), doubles.end());
+    for (double d : doubles)
+        cout << d << " ";
+    cout << endl;
+    vector<pair<uint64_t, char>> items{{3, 'a'}, {1, 'b'}, {3, 'c'}, {0, 'd'}};
+    parallel_radix_sort_pairs(items);
+    for (auto const& item : items)
+        cout << item.first << item.second << " ";
+    cout << endl; // 0d 1b 3a 3c
+}
+
+// Бенчмарк: std::sort, parallel_sort, parallel_stable_sort и поразрядная на int и uint64_t
+void bench_parallel_radix_sort(size_t n = 10000000)
+{
+    cout << "keys  input  n  std::sort s  parallel_sort s  parallel_stable_sort s  parallel_radix_sort s" << endl;
+    auto bench = [n](char const* keys, sort_input kind, auto const& input)
+    {
+        auto a = input, b = input, c = input, d = input;
+        double const std_time = measure_seconds([&]{ sort(a.begin(), a.end()); });
+        double const sort_time = measure_seconds([&]{ parallel_sort(b.begin(), b.end()); });
+        double const stable_time = measure_seconds([&]{ parallel_stable_sort(c.begin(), c.end()); });
+        double const radix_time = measure_seconds([&]{ parallel_radix_sort(d.begin(), d.end()); });
+        cout << keys << "  " << sort_input_name(kind) << "  " << n << "  " << std_time << "  " << sort_time
+             << "  " << stable_time << "  " << radix_time << (a == d ? "" : "  MISMATCH") << endl;
+    };
+    for (sort_input kind : {sort_input::random, sort_input::sorted, sort_input::many_duplicates})
+    {
+        vector<int> const ints = make_sort_input(kind, n);
+        bench("int", kind, ints);
+        vector<uint64_t> wide(n);
+        for (size_t i = 0; i < n; ++i)
+            wide[i] = (uint64_t(unsigned(ints[i])) << 32) * 2654435761u ^ uint64_t(ints[i]);
+        bench("uint64_t", kind, wide);
+    }
+}
+/* Конец доработки: поразрядная сортировка */
+
+/* Листинг 4.14 (стр 140) */
+// Чёт не собирается, ругается на type/value mismatch at arg 1 in template parameter list ...
+/*
+template<typename F, typename A>
+future<result_of<F(A&&)>::type> spawn_task(F&& f, A&& a)
+{
+    typedef result_of<F(A&&)>::type result_type;
+    packaged_task<result_type(A&&)> task(move(f));
+    future<result_type> res(task.get_future());
+    thread t(move(task), move(a));
+    t.detach();
+    return res;
+}*/
+/* Конец листинга 4.14 */
+
+/* Доработка: библиотека сообщений для банкомата (4.15, 4.16)
+ * По мотивам приложения C книжки: sender/receiver, цепочка handle<Msg>()
+ * и close_queue. Отличия:
+ *  - почтовый ящик - lock-free очередь много писателей/один читатель (Vyukov),
+ *    счётчик pending решает, кто будит читателя;
+ *  - receiver работает в двух режимах. Обычный - как в книжке: деструктор
+ *    цепочки из wait() ждёт сообщение в своём потоке. Режим актора
+ *    (run_as_actor) - цепочка запоминается, а разбор почты идёт задачей в
+ *    пуле, когда что-то пришло. Так тысячи банкоматов живут на нескольких потоках.
+ */
+namespace messaging
+{
+struct message_base
+{
+    atomic<message_base*> next{nullptr};
+    virtual ~message_base() {}
+};
+
+template<typename Msg>
+struct wrapped_message: message_base
+{
+    Msg contents;
+    explicit wrapped_message(Msg const& contents_): contents(contents_) {}
+};
+
+// Сообщение о закрытии очереди; в обычном режиме wait() бросает его исключением
+class close_queue {};
+
+struct handler_base
+{
+    virtual ~handler_base() {}
+    virtual bool try_handle(message_base* msg) = 0;
+};
+
+template<typename Msg, typename Func>
+struct message_handler: handler_base
+{
+    Func f;
+    explicit message_handler(Func&& f_): f(move(f_)) {}
+    bool try_handle(message_base* msg) override
+    {
+        if (wrapped_message<Msg>* const wrapper = dynamic_cast<wrapped_message<Msg>*>(msg))
+        {
+            f(wrapper->contents);
+            return true;
+        }
+        return false;
+    }
+};
+
+// Тип сообщения из параметра лямбды - для handle(lambda) без явного типа, как в 4.15
+template<typename Func>
+struct handler_argument: handler_argument<decltype(&Func::operator())> {};
+template<typename C, typename R, typename A>
+struct handler_argument<R (C::*)(A) const> { typedef decay_t<A> type; };
+template<typename C, typename R, typename A>
+struct handler_argument<R (C::*)(A)> { typedef decay_t<A> type; };
+
+typedef vector<unique_ptr<handler_base>> handler_chain;
+
+inline bool dispatch(handler_chain& handlers, message_base* msg)
+{
+    for (auto& handler : handlers)
+    {
+        if (handler->try_handle(msg)) return true;
+    }
+    return false;
+}
+
+class mailbox
+{
+    // Очередь Vyukov: писатели меняют head одним exchange, читатель идёт от tail
+    message_base stub;
+    atomic<message_base*> head;
+    message_base* tail;
+    // Сообщения, которые положены, но ещё не разобраны. Переход 0 -> 1 будит читателя
+    atomic<size_t> pending{0};
+    mutex wait_mutex;
+    condition_variable wait_cond;
+    // Режим актора
+    work_stealing_pool* pool = nullptr;
+    function<void()> next_state;
+    handler_chain handlers;
+    bool installed = false;
+    atomic<bool> closed{false};
+    static constexpr size_t batch_size = 64;
+
+    void push(message_base* msg)
+    {
+        msg->next.store(nullptr, memory_order_relaxed);
+        message_base* const prev = head.exchange(msg, memory_order_acq_rel);
+        prev->next.store(msg, memory_order_release);
+    }
+    message_base* try_pop()
+    {
+        message_base* first = tail;
+        message_base* next = first->next.load(memory_order_acquire);
+        if (first == &stub)
+        {
+            if (!next) return nullptr;
+            tail = next;
+            first = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next)
+        {
+            tail = next;
+            return first;
+        }
+        // Кто-то уже поменял head, но ещё не дописал next
+        if (first != head.load(memory_order_acquire)) return nullptr;
+        push(&stub);
+        next = first->next.load(memory_order_acquire);
+        if (next)
+        {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+    // Сообщение точно есть (pending учтён), но писатель мог не дописать ссылку
+    message_base* pop()
+    {
+        message_base* msg;
+        while (!(msg = try_pop())) this_thread::yield();
+        return msg;
+    }
+    void advance()
+    {
+        do
+        {
+            installed = false;
+            next_state();
+        } while (!installed && !closed);
+    }
+    void stop()
+    {
+        handlers.clear();
+        closed = true;
+    }
+    // Разбор почты в пуле. Одновременно работает не больше одного drain:
+    // следующий ставит тот, кто перевёл pending из 0 в 1, или сам drain, если почта осталась
+    void drain()
+    {
+        size_t const available = min(pending.load(memory_order_acquire), batch_size);
+        for (size_t i = 0; i < available; ++i)
+        {
+            unique_ptr<message_base> msg(pop());
+            if (closed) continue;
+            if (dynamic_cast<wrapped_message<close_queue>*>(msg.get()))
+            {
+                stop();
+                continue;
+            }
+            try
+            {
+                if (dispatch(handlers, msg.get())) advance();
+            }
+            catch(...)
+            {
+                // В обычном режиме исключение вышло бы из run() и поток закончился бы
+                stop();
+            }
+        }
+        if (pending.fetch_sub(available, memory_order_acq_rel) != available)
+            pool->post([this]{ drain(); });
+    }
+public:
+    mailbox():
+        head(&stub), tail(&stub)
+    {}
+    mailbox(const mailbox&) = delete;
+    mailbox& operator=(const mailbox&) = delete;
+    // Актор удалять после того, как к нему перестали писать; дожидаемся последнего drain
+    ~mailbox()
+    {
+        while (pool && pending.load(memory_order_acquire) != 0)
+        {
+            if (!pool->run_pending_task()) this_thread::yield();
+        }
+        while (message_base* msg = try_pop())
+        {
+            if (msg != &stub) delete msg;
+        }
+    }
+    void deliver(message_base* msg)
+    {
+        push(msg);
+        if (pending.fetch_add(1, memory_order_acq_rel) != 0) return;
+        if (pool)
+        {
+            pool->post([this]{ drain(); });
+        }
+        else
+        {
+            { lock_guard<mutex> lk(wait_mutex); }
+            wait_cond.notify_one();
+        }
+    }
+    message_base* wait_and_pop()
+    {
+        {
+            unique_lock<mutex> lk(wait_mutex);
+            wait_cond.wait(lk, [this]{ return pending.load(memory_order_acquire) != 0; });
+        }
+        message_base* const msg = pop();
+        pending.fetch_sub(1, memory_order_acq_rel);
+        return msg;
+    }
+    bool is_actor() const
+    {
+        return pool != nullptr;
+    }
+    void install(handler_chain&& chain)
+    {
+        handlers = move(chain);
+        installed = true;
+    }
+    void run_as_actor(work_stealing_pool& pool_, function<void()> next_state_)
+    {
+        pool = &pool_;
+        next_state = move(next_state_);
+        advance();
+    }
+    bool is_closed() const
+    {
+        return closed;
+    }
+};
+
+class sender
+{
+    mailbox* q;
+public:
+    sender(): q(nullptr) {}
+    explicit sender(mailbox* q_): q(q_) {}
+    template<typename Message>
+    void send(Message const& msg) const
+    {
+        if (q) q->deliver(new wrapped_message<Message>(msg));
+    }
+};
+
+// Цепочка обработчиков из receiver::wait(). Вся работа - в деструкторе,
+// в конце выражения с цепочкой handle(): ждать сообщения или отдать цепочку актору
+class dispatcher
+{
+    mailbox* q;
+    handler_chain handlers;
+public:
+    explicit dispatcher(mailbox* q_): q(q_) {}
+    dispatcher(dispatcher&& other) noexcept:
+        q(exchange(other.q, nullptr)), handlers(move(other.handlers))
+    {}
+    dispatcher(const dispatcher&) = delete;
+    dispatcher& operator=(const dispatcher&) = delete;
+    template<typename Msg, typename Func>
+    dispatcher&& handle(Func&& f) &&
+    {
+        handlers.push_back(make_unique<message_handler<Msg, decay_t<Func>>>(decay_t<Func>(forward<Func>(f))));
+        return move(*this);
+    }
+    template<typename Func>
+    dispatcher&& handle(Func&& f) &&
+    {
+        return move(*this).template handle<typename handler_argument<decay_t<Func>>::type>(forward<Func>(f));
+    }
+    // Сообщения, которых нет в цепочке, выбрасываются, как в книжке
+    ~dispatcher() noexcept(false)
+    {
+        if (!q) return;
+        if (q->is_actor())
+        {
+            q->install(move(handlers));
+            return;
+        }
+        for (;;)
+        {
+            unique_ptr<message_base> msg(q->wait_and_pop());
+            if (dynamic_cast<wrapped_message<close_queue>*>(msg.get()))
+                throw close_queue();
+            if (dispatch(handlers, msg.get())) return;
+        }
+    }
+};
+
+class receiver
+{
+    mailbox q;
+public:
+    operator sender()
+    {
+        return sender(&q);
+    }
+    dispatcher wait()
+    {
+        return dispatcher(&q);
+    }
+    // next_state вызывается сразу и после каждого обработанного сообщения и должен
+    // поставить новую цепочку через wait(). Включать до первой отправки
+    void run_as_actor(work_stealing_pool& pool, function<void()> next_state)
+    {
+        q.run_as_actor(pool, move(next_state));
+    }
+    bool is_closed() const
+    {
+        return q.is_closed();
+    }
+};
+}
+/* Конец доработки: библиотека сообщений */
+
+
+/* Листинг 4.15 (стр 143) */
+// Интерфейс банкомата, а-ля listener-ы. messaging - доработка выше, остальные
+// сообщения и состояния взяты из приложения C книжки (без меню снятия денег:
+// после верного PIN карта возвращается)
+struct card_inserted
+{
+    string account;
+};
+struct digit_pressed
+{
+    char digit;
+};
+struct clear_last_pressed {};
+struct cancel_pressed {};
+struct verify_pin
+{
+    string account;
+    string pin;
+    mutable messaging::sender atm_queue;
+    verify_pin(string const& account_, string const& pin_, messaging::sender atm_queue_):
+        account(account_), pin(pin_), atm_queue(atm_queue_)
+    {}
+};
+struct pin_verified {};
+struct pin_incorrect {};
+struct eject_card {};
+struct display_enter_card {};
+struct display_enter_pin {};
+struct display_pin_incorrect_message {};
+struct display_withdrawal_options {};
+
+class atm
+{
+    messaging::receiver incoming;
+    messaging::sender bank;
+    messaging::sender interface_hardware;
+    void (atm::*state)();
+    string account;
+    string pin;
+    void waiting_for_card()
+    {
+        interface_hardware.send(display_enter_card());
+        incoming.wait().handle(
+            [&](card_inserted const& msg)
+                {
+                    account = msg.account;
+                    pin = "";
+                    interface_hardware.send(display_enter_pin());
+                    state = &atm::getting_pin;
+                });
+    }
+    void getting_pin();
+    void verifying_pin()
+    {
+        incoming.wait()
+            .handle<pin_verified>(
+                [&](pin_verified const&)
+                    {
+                        interface_hardware.send(display_withdrawal_options());
+                        state = &atm::done_processing;
+                    })
+            .handle<pin_incorrect>(
+                [&](pin_incorrect const&)
+                    {
+                        interface_hardware.send(display_pin_incorrect_message());
+                        state = &atm::done_processing;
+                    })
+            .handle<cancel_pressed>(
+                [&](cancel_pressed const&)
+                    {
+                        state = &atm::done_processing;
+                    });
+    }
+    void done_processing()
+    {
+        interface_hardware.send(eject_card());
+        state = &atm::waiting_for_card;
+    }
+public:
+    atm(messaging::sender bank_, messaging::sender interface_hardware_):
+        bank(bank_), interface_hardware(interface_hardware_)
+    {}
+    void done()
+    {
+        get_sender().send(messaging::close_queue());
+    }
+    // Как в книжке: свой поток на банкомат
+    void run()
+    {
+        state = &atm::waiting_for_card;
+        try
+        {
+            for(;;) (this->*state)();
+        }
+        catch(messaging::close_queue const&){}
+    }
+    // Актор в пуле: состояние только ставит обработчики
+    void start(work_stealing_pool& pool = default_thread_pool())
+    {
+        state = &atm::waiting_for_card;
+        incoming.run_as_actor(pool, [this]{ (this->*state)(); });
+    }
+    bool is_closed() const
+    {
+        return incoming.is_closed();
+    }
+    messaging::sender get_sender()
+    {
+        return incoming;
+    }
+};
+/* Конец листинга 4.15 */
+
+/* Листинг 4.16 (стр 144) */
+void atm::getting_pin()
+{
+    incoming.wait()
+        .handle<digit_pressed>(
+            [&](digit_pressed const& msg)
+                {
+                    unsigned const pin_length = 4;
+                    pin += msg.digit;
+                    if (pin.length() == pin_length)
+                    {
+                        bank.send(verify_pin(account, pin, incoming));
+                        state = &atm::verifying_pin;
+                    }
+                })
+        .handle<clear_last_pressed>(
+            [&](clear_last_pressed const&)
+                {
+                    if (!pin.empty()) pin.resize(pin.length()-1);
+                })
+        .handle<cancel_pressed>(
+            [&](cancel_pressed const&)
+            {
+                state = &atm::done_processing;
+            });
+}
+
+// Банк и "железо" банкомата из приложения C, тоже в двух режимах
+class bank_machine
+{
+    messaging::receiver incoming;
+    void wait_for_request()
+    {
+        incoming.wait()
+            .handle<verify_pin>(
+                [&](verify_pin const& msg)
+                    {
+                        if (msg.pin == "1937") msg.atm_queue.send(pin_verified());
+                        else msg.atm_queue.send(pin_incorrect());
+                    });
+    }
+public:
+    void done()
+    {
+        get_sender().send(messaging::close_queue());
+    }
+    void run()
+    {
+        try
+        {
+            for(;;) wait_for_request();
+        }
+        catch(messaging::close_queue const&){}
+    }
+    void start(work_stealing_pool& pool = default_thread_pool())
+    {
+        incoming.run_as_actor(pool, [this]{ wait_for_request(); });
+    }
+    bool is_closed() const
+    {
+        return incoming.is_closed();
+    }
+    messaging::sender get_sender()
+    {
+        return incoming;
+    }
+};
+
+class interface_machine
+{
+    messaging::receiver incoming;
+    bool verbose;
+    atomic<unsigned long> cards_ejected{0};
+    void show(char const* text)
+    {
+        if (verbose) cout << text << endl;
+    }
+    void wait_for_display()
+    {
+        incoming.wait()
+            .handle<display_enter_card>([&](display_enter_card const&){ show("Please enter your card (I)"); })
+            .handle<display_enter_pin>([&](display_enter_pin const&){ show("Please enter your PIN (0-9)"); })
+            .handle<display_pin_incorrect_message>([&](display_pin_incorrect_message const&){ show("PIN incorrect"); })
+            .handle<display_withdrawal_options>([&](display_withdrawal_options const&){ show("PIN ok, withdrawal is not implemented"); })
+            .handle<eject_card>([&](eject_card const&)
+                {
+                    show("Ejecting card");
+                    cards_ejected.fetch_add(1, memory_order_release);
+                });
+    }
+public:
+    explicit interface_machine(bool verbose_ = true): verbose(verbose_) {}
+    void done()
+    {
+        get_sender().send(messaging::close_queue());
+    }
+    void run()
+    {
+        try
+        {
+            for(;;) wait_for_display();
+        }
+        catch(messaging::close_queue const&){}
+    }
+    void start(work_stealing_pool& pool = default_thread_pool())
+    {
+        incoming.run_as_actor(pool, [this]{ wait_for_display(); });
+    }
+    bool is_closed() const
+    {
+        return incoming.is_closed();
+    }
+    unsigned long ejected() const
+    {
+        return cards_ejected.load(memory_order_acquire);
+    }
+    messaging::sender get_sender()
+    {
+        return incoming;
+    }
+};
+
+// Одна карта с PIN, как будто нажимали кнопки
+void insert_card_and_type(messaging::sender machine, string const& account, string const& pin)
+{
+    machine.send(card_inserted{account});
+    for (char digit : pin)
+        machine.send(digit_pressed{digit});
+}
+
+void wait_for_ejected(interface_machine& hardware, unsigned long count)
+{
+    while (hardware.ejected() < count)
+        this_thread::sleep_for(chrono::milliseconds(1));
+}
+
+// Запуск: верный и неверный PIN - сначала по потоку на машину, как в книжке, потом в пуле
+void run416()
+{
+    {
+        bank_machine bank;
+        interface_machine hardware;
+        atm machine(bank.get_sender(), hardware.get_sender());
+        thread bank_thread(&bank_machine::run, &bank);
+        thread hardware_thread(&interface_machine::run, &hardware);
+        thread atm_thread(&atm::run, &machine);
+        insert_card_and_type(machine.get_sender(), "acc1234", "1937");
+        wait_for_ejected(hardware, 1);
+        insert_card_and_type(machine.get_sender(), "acc1234", "0000");
+        wait_for_ejected(hardware, 2);
+        machine.done();
+        bank.done();
+        hardware.done();
+        atm_thread.join();
+        bank_thread.join();
+        hardware_thread.join();
+    }
+    cout << "--- on pool ---" << endl;
+    {
+        bank_machine bank;
+        interface_machine hardware;
+        atm machine(bank.get_sender(), hardware.get_sender());
+        bank.start();
+        hardware.start();
+        machine.start();
+        insert_card_and_type(machine.get_sender(), "acc1234", "1937");
+        wait_for_ejected(hardware, 1);
+        insert_card_and_type(machine.get_sender(), "acc1234", "0000");
+        wait_for_ejected(hardware, 2);
+        machine.done();
+        bank.done();
+        hardware.done();
+    }
+}
+
+// Эхо для замера задержки: пересылает hop соседу, пока не кончится счётчик
+struct hop
+{
+    unsigned remaining;
+};
+class echo_actor
+{
+    messaging::receiver incoming;
+    messaging::sender peer;
+    promise<void> finished;
+    void wait_for_hop()
+    {
+        incoming.wait()
+            .handle<hop>(
+                [&](hop const& msg)
+                    {
+                        if (msg.remaining == 0) finished.set_value();
+                        else peer.send(hop{msg.remaining - 1});
+                    });
+    }
+public:
+    future<void> connect(messaging::sender peer_)
+    {
+        peer = peer_;
+        return finished.get_future();
+    }
+    void run()
+    {
+        try
+        {
+            for(;;) wait_for_hop();
+        }
+        catch(messaging::close_queue const&){}
+    }
+    void start(work_stealing_pool& pool = default_thread_pool())
+    {
+        incoming.run_as_actor(pool, [this]{ wait_for_hop(); });
+    }
+    messaging::sender get_sender()
+    {
+        return incoming;
+    }
+};
+
+// Бенчмарк: atms банкоматов-акторов на пуле, rounds раз каждому вставляют карту
+// с верным PIN. Одна сессия - 11 сообщений (карта, 4 цифры, verify_pin, ответ банка
+// и 4 сообщения "железу"). Плюс задержка одного перехода сообщения: эхо между
+// двумя акторами в пуле и между двумя потоками с блокирующим wait()
+void bench_atm_actors(unsigned atms = 10000, unsigned rounds = 5, unsigned hops = 200000)
+{
+    {
+        bank_machine bank;
+        interface_machine hardware(false);
+        bank.start();
+        hardware.start();
+        vector<unique_ptr<atm>> machines;
+        for (unsigned i = 0; i < atms; ++i)
+        {
+            machines.push_back(make_unique<atm>(bank.get_sender(), hardware.get_sender()));
+            machines.back()->start();
+        }
+        unsigned long const messages_per_session = 11;
+        double const seconds = measure_seconds([&]
+            {
+                for (unsigned round = 0; round < rounds; ++round)
+                {
+                    for (auto& machine : machines)
+                        insert_card_and_type(machine->get_sender(), "acc", "1937");
+                    wait_for_ejected(hardware, (unsigned long)atms * (round + 1));
+                }
+            });
+        for (auto& machine : machines)
+            machine->done();
+        bank.done();
+        hardware.done();
+        unsigned long const sessions = (unsigned long)atms * rounds;
+        cout << "atms  sessions  seconds  sessions/s  messages/s" << endl;
+        cout << atms << "  " << sessions << "  " << seconds << "  " << sessions / seconds << "  "
+             << sessions * messages_per_session / seconds << endl;
+    }
+    cout << "hop latency, ns: ";
+    {
+        echo_actor a, b;
+        future<void> done_a = a.connect(b.get_sender());
+        future<void> done_b = b.connect(a.get_sender());
+        a.start();
+        b.start();
+        double const seconds = measure_seconds([&]
+            {
+                a.get_sender().send(hop{hops});
+                (hops % 2 ? done_b : done_a).wait();
+            });
+        cout << "actors on pool " << seconds * 1e9 / (hops + 1);
+    }
+    {
+        echo_actor a, b;
+        future<void> done_a = a.connect(b.get_sender());
+        future<void> done_b = b.connect(a.get_sender());
+        thread thread_a(&echo_actor::run, &a);
+        thread thread_b(&echo_actor::run, &b);
+        double const seconds = measure_seconds([&]
+            {
+                a.get_sender().send(hop{hops});
+                (hops % 2 ? done_b : done_a).wait();
+            });
+        cout << ", thread per actor " << seconds * 1e9 / (hops + 1) << endl;
+        a.get_sender().send(messaging::close_queue());
+        b.get_sender().send(messaging::close_queue());
+        thread_a.join();
+        thread_b.join();
+    }
+}
+/* Конец листинга 4.16 */
+
+/* Доработка: future с продолжениями (then, when_all, when_any)
+ * std::future умеет только get(), поэтому листинги 4.20-4.24 не собирались.
+ * Здесь своя пара continuable_promise/continuable_future по мотивам
+ * Concurrency TS. Продолжение вешается на общее состояние и вызывается тем
+ * потоком, который выставил результат (или сразу, если результат уже есть),
+ * либо уходит задачей в пул. when_all/when_any тоже просто подписываются на
+ * готовность - ни один поток при этом не спит в get().
+ */
+template<typename T> class continuable_future;
+template<typename T> class continuable_promise;
+template<typename T, typename Func>
+void fulfil_promise(continuable_promise<T>& p, Func&& func);
+
+template<typename T>
+struct is_continuable_future: false_type {};
+template<typename T>
+struct is_continuable_future<continuable_future<T>>: true_type {};
+
+// Продолжение, вернувшее continuable_future<U>, даёт continuable_future<U>, а не future от future
+template<typename T>
+struct unwrap_continuable { typedef T type; };
+template<typename T>
+struct unwrap_continuable<continuable_future<T>> { typedef T type; };
+
+// Общее состояние. Колбэки готовности выполняются вне мьютекса
+template<typename T>
+class continuable_state
+{
+public:
+    typedef conditional_t<is_void<T>::value, bool, T> stored_type;
+private:
+    mutable mutex m;
+    condition_variable ready_cond;
+    bool ready = false;
+    optional<stored_type> value;
+    exception_ptr error;
+    vector<function_wrapper> callbacks;
+
+    void make_ready(unique_lock<mutex>& lk)
+    {
+        ready = true;
+        vector<function_wrapper> to_run;
+        to_run.swap(callbacks);
+        lk.unlock();
+        ready_cond.notify_all();
+        for (auto& callback : to_run)
+            callback();
+    }
+public:
+    template<typename... Args>
+    void set_value(Args&&... args)
+    {
+        unique_lock<mutex> lk(m);
+        if (ready) throw future_error(future_errc::promise_already_satisfied);
+        value.emplace(forward<Args>(args)...);
+        make_ready(lk);
+    }
+    void set_exception(exception_ptr e)
+    {
+        unique_lock<mutex> lk(m);
+        if (ready) throw future_error(future_errc::promise_already_satisfied);
+        error = e;
+        make_ready(lk);
+    }
+    bool is_ready() const
+    {
+        lock_guard<mutex> lk(m);
+        return ready;
+    }
+    void wait()
+    {
+        unique_lock<mutex> lk(m);
+        ready_cond.wait(lk, [this]{ return ready; });
+    }
+    stored_type take()
+    {
+        wait();
+        if (error) rethrow_exception(error);
+        return move(*value);
+    }
+    void on_ready(function_wrapper callback)
+    {
+        unique_lock<mutex> lk(m);
+        if (!ready)
+        {
+            callbacks.push_back(move(callback));
+            return;
+        }
+        lk.unlock();
+        callback();
+    }
+};
+
+template<typename T>
+class continuable_future
+{
+    template<typename U> friend class continuable_promise;
+    shared_ptr<continuable_state<T>> state;
+
+    shared_ptr<continuable_state<T>> release_state()
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        return move(state);
+    }
+    template<typename Func>
+    auto then_on(work_stealing_pool* pool, Func&& func)
+    {
+        typedef decay_t<Func> function_type;
+        typedef invoke_result_t<function_type, continuable_future<T>> raw_result;
+        typedef typename unwrap_continuable<raw_result>::type result_type;
+        continuable_promise<result_type> p;
+        continuable_future<result_type> result = p.get_future();
+        shared_ptr<continuable_state<T>> s = release_state();
+        continuable_state<T>* const raw = s.get();
+        raw->on_ready([s = move(s), p = move(p), f = function_type(forward<Func>(func)), pool]() mutable
+            {
+                auto body = [s = move(s), p = move(p), f = move(f)]() mutable
+                {
+                    continuable_future<T> ready(move(s));
+                    if constexpr (is_continuable_future<raw_result>::value)
+                    {
+                        try
+                        {
+                            f(move(ready)).then([p = move(p)](raw_result inner) mutable
+                                {
+                                    fulfil_promise(p, [&inner]{ return inner.get(); });
+                                });
+                        }
+                        catch(...)
+                        {
+                            p.set_exception(current_exception());
+                        }
+                    }
+                    else
+                    {
+                        fulfil_promise(p, [&f, &ready]{ return f(move(ready)); });
+                    }
+                };
+                if (pool) pool->post(move(body));
+                else body();
+            });
+        return result;
+    }
+public:
+    continuable_future() = default;
+    explicit continuable_future(shared_ptr<continuable_state<T>> state_):
+        state(move(state_))
+    {}
+    bool valid() const
+    {
+        return state != nullptr;
+    }
+    bool is_ready() const
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        return state->is_ready();
+    }
+    void wait() const
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        state->wait();
+    }
+    T get()
+    {
+        shared_ptr<continuable_state<T>> s = release_state();
+        if constexpr (is_void<T>::value)
+            s->take();
+        else
+            return s->take();
+    }
+    // Продолжение получает этот future уже готовым, сам future после then() пустой
+    template<typename Func>
+    auto then(Func&& func)
+    {
+        return then_on(nullptr, forward<Func>(func));
+    }
+    // То же, но продолжение выполняется задачей в пуле
+    template<typename Func>
+    auto then(work_stealing_pool& pool, Func&& func)
+    {
+        return then_on(&pool, forward<Func>(func));
+    }
+    // Подписка на готовность без потребления future - для when_all/when_any
+    template<typename Func>
+    void on_ready(Func&& func)
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        state->on_ready(function_wrapper(forward<Func>(func)));
+    }
+};
+
+template<typename T>
+class continuable_promise
+{
+    shared_ptr<continuable_state<T>> state;
+    bool future_retrieved = false;
+public:
+    continuable_promise():
+        state(make_shared<continuable_state<T>>())
+    {}
+    continuable_promise(continuable_promise&& other) noexcept:
+        state(move(other.state)), future_retrieved(other.future_retrieved)
+    {}
+    continuable_promise& operator=(continuable_promise&& other) noexcept
+    {
+        abandon();
+        state = move(other.state);
+        future_retrieved = other.future_retrieved;
+        return *this;
+    }
+    continuable_promise(const continuable_promise&) = delete;
+    continuable_promise& operator=(const continuable_promise&) = delete;
+    // Брошенный promise будит всех, кто ждёт, исключением broken_promise
+    ~continuable_promise()
+    {
+        abandon();
+    }
+    continuable_future<T> get_future()
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        if (future_retrieved) throw future_error(future_errc::future_already_retrieved);
+        future_retrieved = true;
+        return continuable_future<T>(state);
+    }
+    template<typename... Args>
+    void set_value(Args&&... args)
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        state->set_value(forward<Args>(args)...);
+    }
+    void set_exception(exception_ptr e)
+    {
+        if (!state) throw future_error(future_errc::no_state);
+        state->set_exception(e);
+    }
+private:
+    void abandon()
+    {
+        if (state && !state->is_ready())
+            state->set_exception(make_exception_ptr(future_error(future_errc::broken_promise)));
+    }
+};
+
+// Выполнить func() и положить в promise результат или исключение
+template<typename T, typename Func>
+void fulfil_promise(continuable_promise<T>& p, Func&& func)
+{
+    try
+    {
+        if constexpr (is_void<T>::value)
+        {
+            func();
+            p.set_value();
+        }
+        else
+        {
+            p.set_value(func());
+        }
+    }
+    catch(...)
+    {
+        p.set_exception(current_exception());
+    }
+}
+
+// Готов, когда готовы все. Результат - те же future, уже готовые
+template<typename InputIt>
+continuable_future<vector<typename iterator_traits<InputIt>::value_type>> when_all(InputIt first, InputIt last)
+{
+    typedef typename iterator_traits<InputIt>::value_type future_type;
+    struct all_state
+    {
+        vector<future_type> futures;
+        atomic<size_t> remaining;
+        continuable_promise<vector<future_type>> promise;
+    };
+    auto all = make_shared<all_state>();
+    all->futures.assign(make_move_iterator(first), make_move_iterator(last));
+    continuable_future<vector<future_type>> result = all->promise.get_future();
+    // Лишняя единица - за саму подписку, чтобы не сработать на середине цикла
+    all->remaining = all->futures.size() + 1;
+    auto arrive = [all]
+    {
+        if (all->remaining.fetch_sub(1) == 1)
+            all->promise.set_value(move(all->futures));
+    };
+    for (auto& f : all->futures)
+        f.on_ready(arrive);
+    arrive();
+    return result;
+}
+
+template<typename Sequence>
+struct when_any_result
+{
+    size_t index;
+    Sequence futures;
+};
+
+// Готов, когда готов хоть один. index - какой именно; для пустого диапазона size_t(-1)
+template<typename InputIt>
+continuable_future<when_any_result<vector<typename iterator_traits<InputIt>::value_type>>>
+when_any(InputIt first, InputIt last)
+{
+    typedef typename iterator_traits<InputIt>::value_type future_type;
+    typedef when_any_result<vector<future_type>> result_type;
+    struct any_state
+    {
+        vector<future_type> futures;
+        atomic<size_t> winner{size_t(-1)};
+        // Результат отдаёт второй из двух: первый готовый future и конец подписки
+        atomic<unsigned> parties{2};
+        continuable_promise<result_type> promise;
+        void arrive()
+        {
+            if (parties.fetch_sub(1) == 1)
+                promise.set_value(result_type{winner.load(), move(futures)});
+        }
+    };
+    auto any = make_shared<any_state>();
+    any->futures.assign(make_move_iterator(first), make_move_iterator(last));
+    continuable_future<result_type> result = any->promise.get_future();
+    if (any->futures.empty())
+    {
+        any->promise.set_value(result_type{size_t(-1), {}});
+        return result;
+    }
+    for (size_t i = 0; i < any->futures.size(); ++i)
+    {
+        any->futures[i].on_ready([any, i]
+            {
+                size_t expected = size_t(-1);
+                if (any->winner.compare_exchange_strong(expected, i))
+                    any->arrive();
+            });
+    }
+    any->arrive();
+    return result;
+}
+
+// Запуск: цепочка then, продолжение в пуле, when_all и when_any
+void run_continuable_future()
+{
+    continuable_promise<int> p;
+    continuable_future<string> chained = p.get_future()
+        .then([](continuable_future<int> f){ return f.get() * 2; })
+        .then(default_thread_pool(), [](continuable_future<int> f){ return to_string(f.get()); });
+    p.set_value(21);
+    cout << "then: " << chained.get() << endl;
+
+    vector<continuable_promise<int>> promises(4);
+    vector<continuable_future<int>> futures;
+    for (auto& promise : promises)
+        futures.push_back(promise.get_future());
+    auto any = when_any(futures.begin(), futures.end());
+    promises[2].set_value(2);
+    when_any_result<vector<continuable_future<int>>> first_ready = any.get();
+    cout << "when_any: index " << first_ready.index << endl;
+    auto all = when_all(first_ready.futures.begin(), first_ready.futures.end());
+    promises[0].set_value(0);
+    promises[1].set_value(1);
+    promises[3].set_exception(make_exception_ptr(runtime_error("fourth failed")));
+    for (auto& f : all.get())
+    {
+        try
+        {
+            int const value = f.get();
+            cout << "when_all: " << value << endl;
+        }
+        catch (exception& e)
+        {
+            cout << "when_all: " << e.what() << endl;
+        }
+    }
+}
+/* Конец доработки: future с продолжениями */
+
+/* Листинг 4.17 (стр 147) */
+// В книжке тут поток на каждый вызов с detach(), теперь задача уходит в общий пул,
+// а результат - continuable_future, чтобы на него можно было повесить then().
+// Аргументы копируются, как у async
+template<typename Func, typename... Args>
+continuable_future<invoke_result_t<decay_t<Func>, decay_t<Args>...>> spawn_async(Func&& func, Args&&... args)
+{
+    typedef invoke_result_t<decay_t<Func>, decay_t<Args>...> result_type;
+    continuable_promise<result_type> p;
+    continuable_future<result_type> result = p.get_future();
+    default_thread_pool().post(
+        [p = move(p), f = decay_t<Func>(forward<Func>(func)), arguments = make_tuple(decay_t<Args>(forward<Args>(args))...)]() mutable
+        {
+            fulfil_promise(p, [&f, &arguments]{ return apply(move(f), move(arguments)); });
+        });
+    return result;
+}
+/* Конец листинга 4.17 */
+
+/* Доработка: запуск сопрограмм и ожидание continuable_future
+ * start_task() - мост из обычного кода: задача стартует в пуле, результат
+ * приходит в continuable_future. В обратную сторону - co_await на
+ * continuable_future.
+ */
+// Сопрограмма без результата, которую никто не ждёт: стартует сразу и сама себя удаляет
+struct detached_coroutine
+{
+    struct promise_type
+    {
+        detached_coroutine get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+template<typename T>
+detached_coroutine run_task_detached(task<T> t, continuable_promise<T> p)
+{
+    try
+    {
+        if constexpr (is_void<T>::value)
+        {
+            co_await move(t);
+            p.set_value();
+        }
+        else
+        {
+            p.set_value(co_await move(t));
+        }
+    }
+    catch(...)
+    {
+        p.set_exception(current_exception());
+    }
+}
+
+template<typename T>
+continuable_future<T> start_task(task<T> t, work_stealing_pool& pool = default_thread_pool())
+{
+    continuable_promise<T> p;
+    continuable_future<T> result = p.get_future();
+    pool.post([t = move(t), p = move(p)]() mutable
+        {
+            run_task_detached(move(t), move(p));
+        });
+    return result;
+}
+
+// T value = co_await some_future; сопрограмма продолжится в пуле, когда future будет готов
+template<typename T>
+auto operator co_await(continuable_future<T>&& future)
+{
+    struct awaiter
+    {
+        continuable_future<T> future;
+        bool await_ready() const { return future.is_ready(); }
+        void await_suspend(coroutine_handle<> h)
+        {
+            future.on_ready([h]{ default_thread_pool().post([h]{ h.resume(); }); });
+        }
+        T await_resume() { return future.get(); }
+    };
+    return awaiter{move(future)};
+}
+
+// Запуск: задача, очередь с co_await, таймер и wait_loop на сопрограмме
+void run_coroutines()
+{
+    threadsafe_queue45<int> queue;
+    auto consumer = start_task([](threadsafe_queue45<int>& q) -> task<int>
+        {
+            int sum = 0;
+            for (int i = 0; i < 3; ++i)
+                sum += co_await q.async_wait_and_pop();
+            co_return sum;
+        }(queue));
+    queue.push(1);
+    queue.push(2);
+    queue.push(3);
+    cout << "queue sum: " << consumer.get() << endl; // 6
+
+    auto sleeper = start_task([]() -> task<double>
+        {
+            auto const start = chrono::steady_clock::now();
+            co_await sleep_for(chrono::milliseconds(50));
+            co_return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }());
+    cout << "slept ms: " << sleeper.get() << endl;
+
+    auto doubled = start_task([]() -> task<int>
+        {
+            co_return 2 * co_await spawn_async([]{ return 21; });
+        }());
+    cout << "awaited future: " << doubled.get() << endl; // 42
+
+    auto timed_out = start_task(async_wait_loop());
+    cout << "wait_loop without event: " << timed_out.get() << endl; // 0
+    auto woken = start_task(async_wait_loop());
+    done_event411.set();
+    cout << "wait_loop with event: " << woken.get() << endl; // 1
+    done_event411.reset();
+}
+/* Конец доработки: запуск сопрограмм */
+
+/* Листинг 4.18 (стр 148) */
+// Опять левые типы и неизвестные функции...
+void display_error418(exception& e)
+{
+    cout << "error: " << e.what() << endl;
+}
+template<typename user_id, typename user_data, typename backend_type>
+void process_login(string const& username, string const& password)
+{
+    try
+    {
+        backend_type backend;
+        user_id const id = backend.authenticate_user(username, password);
+        user_data const info_to_display = backend.request_current_info(id);
+        update_display(info_to_display);
+    }
+    catch(exception& e)
+    {
+        display_error418(e);
+    }
+}
+/* Конец листинга 4.18 */
+
+/* Листинг 4.19 (стр 148) */
+// То же самое, что и в 4.18, только в обёртке под async
+template<typename user_id, typename user_data, typename backend_type>
+future<void> process_login(string const& username, string const& password)
+{
+    return async(launch::async, [=]()
+        {
+            try
+            {
+                backend_type backend;
+                user_id const id = backend.authenticate_user(username, password);
+                user_data const info_to_display = backend.request_current_info(id);
+                update_display(info_to_display);
+            }
+            catch (exception& e)
+            {
+                display_error418(e);
+            }
+        });
+}
+/* Конец листинга 4.19 */
+
+/* Листинг 4.20 (стр 149) */
+// То же самое, что и в 4.18, только в другой обёртке (а-ля цепочка)
+// В книжке продолжения берут backend по ссылке, а функция к тому времени уже
+// вернулась - тут он живёт в shared_ptr, пока нужен продолжениям
+template<typename user_id, typename user_data, typename backend_type>
+continuable_future<void> process_login420(string const& username, string const& password)
+{
+    auto backend = make_shared<backend_type>();
+    return spawn_async([=]()
+        {
+            return backend->authenticate_user(username, password);
+        }).then([backend](continuable_future<user_id> id)
+        {
+            return backend->request_current_info(id.get());
+        }).then([](continuable_future<user_data> info_to_display)
+        {
+            try
+            {
+                update_display(info_to_display.get());
+            }
+            catch (exception& e)
+            {
+                display_error418(e);
+            }
+        });
+}
+/* Конец листинга 4.20 */
+
+/* Листинг 4.21 (стр 150) */
+// То же самое что и предыдущее, только backend сам асинхронный:
+// продолжение возвращает future, и then() его разворачивает
+template<typename user_id, typename user_data, typename backend_type>
+continuable_future<void> process_login421(string const& username, string const& password)
 {
-    cout << "run412() invoked" << endl;
-    list<int> l;
-    l.push_back(3);
-    l.push_back(8);
-    l.push_back(1);
-    cout << "before sort: ";
-    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
-        cout << *i << " ";
-    cout << endl;
+    auto backend = make_shared<backend_type>();
+    return backend->async_authenticate_user(username, password)
+                .then([backend](continuable_future<user_id> id)
+                      {
+                          return backend->async_request_current_info(id.get());
+                      })
+                .then([](continuable_future<user_data> info_to_display)
+                      {
+                          try
+                          {
+                              update_display(info_to_display.get());
+                          }
+                          catch (exception& e)
+                          {
+                              display_error418(e);
+                          }
+                      });
+}
 
-    l = sequential_quick_sort(l);
-    cout << "after sort: ";
-    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
-        cout << *i << " ";
-    cout << endl;
+// Типы для запуска 4.20-4.24. Свободные функции находятся через ADL
+namespace continuation_demo
+{
+struct user_id
+{
+    int value;
+};
+struct user_data
+{
+    string name;
+};
+class backend
+{
+public:
+    user_id authenticate_user(string const& username, string const& password) const
+    {
+        if (password != "secret") throw runtime_error("wrong password for " + username);
+        return user_id{int(username.size())};
+    }
+    user_data request_current_info(user_id id) const
+    {
+        return user_data{"user #" + to_string(id.value)};
+    }
+    continuable_future<user_id> async_authenticate_user(string const& username, string const& password) const
+    {
+        return spawn_async([this, username, password]{ return authenticate_user(username, password); });
+    }
+    continuable_future<user_data> async_request_current_info(user_id id) const
+    {
+        return spawn_async([this, id]{ return request_current_info(id); });
+    }
+};
+void update_display(user_data const& info)
+{
+    cout << "display: " << info.name << endl;
 }
-/* Конец листинга 4.12 */
 
-/* Листинг 4.13 (стр 138) */
-// Многопоточная быстрая сортировка с future
-template<typename T>
-list<T> parallel_quick_sort(list<T> input)
+struct data_item
 {
-    if (input.empty()) return input;
-    list<T> result;
-    result.splice(result.begin(), input, input.begin());
-    T const& pivot = *result.begin();
-    auto divide_point = partition(input.begin(), input.end(), [&](T const& t){return t < pivot;});
-    list<T> lower_part;
-    lower_part.splice(lower_part.end(), input, input.begin(), divide_point);
-    future<list<T>> new_lower(async(&parallel_quick_sort<T>, move(lower_part)));
-    auto new_higher(parallel_quick_sort(move(input)));
-    result.splice(result.end(), new_higher);
-    result.splice(result.begin(), new_lower.get());
-    return result;
+    int value;
+};
+struct chunk_sum
+{
+    long long total;
+};
+long long gather_results(vector<chunk_sum> const& sums)
+{
+    long long total = 0;
+    for (auto const& sum : sums)
+        total += sum.total;
+    return total;
+}
+bool matches_find_criteria(data_item const& s)
+{
+    return s.value == 777777;
+}
+int process_found_value(data_item const& s)
+{
+    return s.value / 7;
+}
+chunk_sum sum_chunk(vector<data_item>::iterator first, vector<data_item>::iterator last)
+{
+    long long total = 0;
+    for (; first != last; ++first)
+        total += first->value;
+    return chunk_sum{total};
+}
 }
 
-// Запуск
-void run413()
+// Запуск: удачный и неудачный вход обоими способами
+void run420()
 {
-    cout << "run413() invoked" << endl;
-    list<int> l;
-    l.push_back(6);
-    l.push_back(453);
-    l.push_back(0);
-    cout << "before sort: ";
-    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
-        cout << *i << " ";
-    cout << endl;
+    using namespace continuation_demo;
+    process_login420<user_id, user_data, backend>("alice", "secret").get();
+    process_login420<user_id, user_data, backend>("bob", "guess").get();
+    process_login421<user_id, user_data, backend>("carol", "secret").get();
+    process_login421<user_id, user_data, backend>("dave", "guess").get();
+}
 
-    l = sequential_quick_sort(l);
-    cout << "after sort: ";
-    for (list<int>::iterator i = l.begin(); i != l.end(); i++)
-        cout << *i << " ";
-    cout << endl;
+// Листинг 4.18 на сопрограммах: пока бэкенд отвечает, поток свободен.
+// Строки по значению - ссылки не пережили бы первую приостановку
+template<typename user_id, typename user_data, typename backend_type>
+task<void> process_login_coro(string username, string password)
+{
+    try
+    {
+        backend_type backend;
+        user_id const id = co_await backend.co_authenticate_user(username, password);
+        user_data const info_to_display = co_await backend.co_request_current_info(id);
+        update_display(info_to_display);
+    }
+    catch(exception& e)
+    {
+        display_error418(e);
+    }
+}
+
+// Заглушка бэкенда с "сетевой" задержкой: блокирующие вызовы спят, сопрограммы ждут таймер
+namespace login_demo
+{
+chrono::milliseconds backend_latency(50);
+atomic<unsigned long> displayed(0);
+struct account_id
+{
+    int value;
+};
+struct account_info
+{
+    int id;
+};
+class stub_backend
+{
+public:
+    account_id authenticate_user(string const& username, string const& password) const
+    {
+        this_thread::sleep_for(backend_latency);
+        return account_id{int(username.size() + password.size())};
+    }
+    account_info request_current_info(account_id id) const
+    {
+        this_thread::sleep_for(backend_latency);
+        return account_info{id.value};
+    }
+    task<account_id> co_authenticate_user(string username, string password) const
+    {
+        co_await sleep_for(backend_latency);
+        co_return account_id{int(username.size() + password.size())};
+    }
+    task<account_info> co_request_current_info(account_id id) const
+    {
+        co_await sleep_for(backend_latency);
+        co_return account_info{id.value};
+    }
+};
+void update_display(account_info const&)
+{
+    ++displayed;
+}
+
+task<void> timed_login(unsigned session, chrono::steady_clock::time_point launched, double& latency_ms)
+{
+    co_await process_login_coro<account_id, account_info, stub_backend>("user" + to_string(session), "secret");
+    latency_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - launched).count();
+}
+}
+
+// Бенчмарк: sessions одновременных входов на сопрограммах против потока на сессию.
+// Столько потоков система не даст, их запускается не больше thread_sessions.
+// Задержка от запуска сессии до конца; идеал - две задержки бэкенда
+void bench_logins(unsigned sessions = 100000, unsigned thread_sessions = 10000)
+{
+    using namespace login_demo;
+    cout << "backend latency ms: " << backend_latency.count() << endl;
+    cout << "model  sessions  total s  RSS growth KB  KB/session  mean latency ms  p99 latency ms" << endl;
+    auto report = [](char const* model, vector<double>& latencies, double total, size_t rss_before, size_t rss_loaded)
+    {
+        size_t const growth = rss_loaded > rss_before ? rss_loaded - rss_before : 0;
+        sort(latencies.begin(), latencies.end());
+        double const mean = accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        cout << model << "  " << latencies.size() << "  " << total << "  " << growth << "  "
+             << double(growth) / latencies.size() << "  " << mean << "  "
+             << latencies[latencies.size() * 99 / 100] << endl;
+    };
+    {
+        vector<double> latencies(sessions);
+        vector<continuable_future<void>> done;
+        done.reserve(sessions);
+        size_t const rss_before = resident_memory_kb();
+        size_t rss_loaded = 0;
+        double const total = measure_seconds([&]
+            {
+                for (unsigned i = 0; i < sessions; ++i)
+                    done.push_back(start_task(timed_login(i, chrono::steady_clock::now(), latencies[i])));
+                rss_loaded = resident_memory_kb();
+                for (auto& f : done)
+                    f.get();
+            });
+        report("coroutines", latencies, total, rss_before, rss_loaded);
+    }
+    {
+        // process_login из 4.18 и 4.19 различаются только типом результата, выбираем по указателю
+        void (*blocking_login)(string const&, string const&) = &process_login<account_id, account_info, stub_backend>;
+        vector<double> latencies(thread_sessions);
+        vector<thread> threads;
+        threads.reserve(thread_sessions);
+        size_t const rss_before = resident_memory_kb();
+        size_t rss_loaded = 0;
+        double const total = measure_seconds([&]
+            {
+                try
+                {
+                    for (unsigned i = 0; i < thread_sessions; ++i)
+                    {
+                        auto const launched = chrono::steady_clock::now();
+                        threads.emplace_back([i, launched, blocking_login, &latencies]
+                            {
+                                blocking_login("user" + to_string(i), "secret");
+                                latencies[i] = chrono::duration<double, milli>(chrono::steady_clock::now() - launched).count();
+                            });
+                    }
+                }
+                catch (system_error& e)
+                {
+                    cout << "threads: stopped at " << threads.size() << " (" << e.what() << ")" << endl;
+                }
+                rss_loaded = resident_memory_kb();
+                for (auto& t : threads)
+                    t.join();
+            });
+        latencies.resize(threads.size());
+        report("thread per session", latencies, total, rss_before, rss_loaded);
+    }
+}
+/* Конец листинга 4.21 */
+
+/* Доработка: самопланирование кусков
+ * В листингах 4.22-4.24 данные режутся заранее на куски одного размера. Если
+ * элементы стоят по-разному, в конце одни потоки ещё считают тяжёлый кусок, а
+ * остальные простаивают. Здесь рабочие сами берут следующий кусок с общего
+ * атомарного курсора: dynamic - кусками постоянного размера, guided - всё
+ * меньшими (остаток / (2 * рабочих), но не меньше min_chunk). Подсказка
+ * стоимости элемента (cost_hint) делает guided делящим остаток по стоимости,
+ * а не по числу элементов. static_chunks - поровну на рабочего, как в книжке,
+ * для сравнения.
+ */
+enum class chunk_schedule
+{
+    static_chunks,
+    dynamic,
+    guided
+};
+
+struct schedule_options
+{
+    chunk_schedule kind = chunk_schedule::guided;
+    // Размер куска для dynamic
+    size_t chunk_size = 1024;
+    // Меньше этого guided не режет, чтобы не тратить время на курсор
+    size_t min_chunk = 64;
+    // Примерная стоимость элемента по индексу, зовётся один раз на элемент
+    function<double(size_t)> cost_hint;
+};
+
+class chunk_scheduler
+{
+    alignas(cache_line_size) atomic<size_t> cursor{0};
+    size_t const count;
+    size_t const workers;
+    schedule_options const options;
+    // prefix_cost[i] - суммарная стоимость [0, i), только с cost_hint
+    vector<double> prefix_cost;
+
+    size_t guided_end(size_t from) const
+    {
+        size_t end;
+        if (prefix_cost.empty())
+            end = from + (count - from) / (2 * workers);
+        else
+        {
+            double const target = prefix_cost[from] + (prefix_cost[count] - prefix_cost[from]) / (2 * workers);
+            end = size_t(upper_bound(prefix_cost.begin() + from + 1, prefix_cost.end(), target) - prefix_cost.begin()) - 1;
+        }
+        return min(count, max(end, from + max<size_t>(options.min_chunk, 1)));
+    }
+public:
+    chunk_scheduler(size_t count_, size_t workers_, schedule_options options_ = schedule_options()):
+        count(count_), workers(max<size_t>(workers_, 1)), options(move(options_))
+    {
+        if (options.kind == chunk_schedule::guided && options.cost_hint)
+        {
+            prefix_cost.resize(count + 1);
+            for (size_t i = 0; i < count; ++i)
+                prefix_cost[i + 1] = prefix_cost[i] + max(options.cost_hint(i), 0.0);
+        }
+    }
+    chunk_scheduler(chunk_scheduler const&) = delete;
+    chunk_scheduler& operator=(chunk_scheduler const&) = delete;
+
+    // Следующий кусок [first, last); false - всё роздано
+    bool next(size_t& first, size_t& last)
+    {
+        if (options.kind == chunk_schedule::guided)
+        {
+            size_t current = cursor.load(memory_order_relaxed);
+            do
+            {
+                if (current >= count) return false;
+                last = guided_end(current);
+            }
+            while (!cursor.compare_exchange_weak(current, last, memory_order_relaxed));
+            first = current;
+            return true;
+        }
+        size_t const step = options.kind == chunk_schedule::static_chunks
+                                ? (count + workers - 1) / workers
+                                : max<size_t>(options.chunk_size, 1);
+        first = cursor.fetch_add(step, memory_order_relaxed);
+        if (first >= count) return false;
+        last = min(count, first + step);
+        return true;
+    }
+};
+
+// f(first, last) по кускам [0, count) на всех потоках пула, ждёт конца
+template<typename Func>
+void parallel_for_chunks(size_t count, Func f, schedule_options options = schedule_options(),
+                         work_stealing_pool& pool = default_thread_pool())
+{
+    size_t const workers = max<size_t>(pool.size(), 1);
+    chunk_scheduler scheduler(count, workers, move(options));
+    run_indexed_tasks(pool, workers, [&](size_t)
+        {
+            size_t first, last;
+            while (scheduler.next(first, last))
+                f(first, last);
+        });
+}
+/* Конец доработки: самопланирование кусков */
+
+/* Листинг 4.22 (стр 151) */
+// Насыпал шаблонов чтобы собиралось
+// Естественно, функции запуска не будет
+// Асинхронная обработка больших данных, поделенных на части (чанки)
+template<typename FinalResult,
+         typename MyData,
+         typename ChunkResult,
+         typename Chunk>
+future<FinalResult> process_data(vector<MyData>& vec,
+                                 Chunk process_chunk,
+                                 size_t const c_size)
+{
+    size_t const chunk_size = c_size;
+    work_stealing_pool& pool = default_thread_pool();
+    vector<future<ChunkResult>> results;
+    for (auto begin = vec.begin(), end = vec.end(); begin != end;)
+    {
+        size_t const remaining_size = end - begin;
+        size_t const this_chunk_size = min(remaining_size, chunk_size);
+        results.push_back(pool.submit([process_chunk, begin, this_chunk_size]
+            {
+                return process_chunk(begin, begin + this_chunk_size);
+            }));
+        begin += this_chunk_size;
+    }
+    // Сборка результатов тоже в пуле, ждём чанки, помогая пулу
+    return pool.submit([&pool, all_results = move(results)]() mutable
+                 {
+                     vector<ChunkResult> v;
+                     v.reserve(all_results.size());
+                     for (auto& f: all_results)
+                     {
+                         pool.run_pending_until_ready(f);
+                         v.push_back(f.get());
+                     }
+                     return gather_results(v);
+                 });
+}
+/* Конец листинга 4.22 */
+
+/* Листинг 4.23 (стр 152) */
+// Как 4.22, только сборка - продолжение when_all, а не задача, которая ждёт чанки
+template<typename FinalResult,
+         typename MyData,
+         typename Chunk,
+         typename ChunkResult>
+continuable_future<FinalResult> process_data423(vector<MyData>& vec,
+                                                size_t const c_size,
+                                                Chunk process_chunk)
+{
+    size_t const chunk_size = c_size;
+    vector<continuable_future<ChunkResult>> results;
+    for (auto begin = vec.begin(), end = vec.end(); begin != end;)
+    {
+        size_t const remaining_size = end - begin;
+        size_t const this_chunk_size = min(remaining_size, chunk_size);
+        results.push_back(
+            spawn_async(process_chunk, begin, begin + this_chunk_size));
+        begin += this_chunk_size;
+    }
+    return when_all(results.begin(), results.end())
+               .then([](continuable_future<vector<continuable_future<ChunkResult>>> ready_results)
+                     {
+                         vector<continuable_future<ChunkResult>> all_results = ready_results.get();
+                         vector<ChunkResult> v;
+                         v.reserve(all_results.size());
+                         for (auto& f : all_results)
+                             v.push_back(f.get());
+                         return gather_results(v);
+                     });
+}
+
+void run423()
+{
+    using namespace continuation_demo;
+    vector<data_item> data(100000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i].value = int(i % 1000);
+    cout << process_data423<long long, data_item, decltype(&sum_chunk), chunk_sum>(data, 4096, &sum_chunk).get()
+         << endl; // 49950000
+}
+
+// Бенчмарк: много одновременных process_data (4.22, сборка - задача, которая ждёт чанки)
+// против process_data423 (сборка - продолжение when_all)
+void bench_process_data(unsigned calls = 200, size_t data_size = 1 << 16, size_t chunk_size = 4096)
+{
+    using namespace continuation_demo;
+    vector<data_item> data(data_size);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i].value = int(i % 1000);
+    long long blocking_total = 0, continuation_total = 0;
+    double const blocking_time = measure_seconds([&]
+        {
+            vector<future<long long>> results;
+            for (unsigned i = 0; i < calls; ++i)
+                results.push_back(process_data<long long, data_item, chunk_sum>(data, &sum_chunk, chunk_size));
+            for (auto& f : results)
+                blocking_total += f.get();
+        });
+    double const continuation_time = measure_seconds([&]
+        {
+            vector<continuable_future<long long>> results;
+            for (unsigned i = 0; i < calls; ++i)
+                results.push_back(process_data423<long long, data_item, decltype(&sum_chunk), chunk_sum>(data, chunk_size, &sum_chunk));
+            for (auto& f : results)
+                continuation_total += f.get();
+        });
+    cout << "calls  process_data calls/s  process_data423 calls/s" << endl;
+    cout << calls << "  " << calls / blocking_time << "  " << calls / continuation_time
+         << (blocking_total == continuation_total ? "" : "  MISMATCH") << endl;
 }
-/* Конец листинга 4.13 */
 
-/* Листинг 4.14 (стр 140) */
-// Чёт не собирается, ругается на type/value mismatch at arg 1 in template parameter list ...
-/*
-template<typename F, typename A>
-future<result_of<F(A&&)>::type> spawn_task(F&& f, A&& a)
+// Доработка: process_data с самопланированием вместо кусков фиксированного
+// размера. Результаты кусков собираются в порядке данных
+template<typename FinalResult,
+         typename MyData,
+         typename ChunkResult,
+         typename Chunk>
+continuable_future<FinalResult> process_data_scheduled(vector<MyData>& vec,
+                                                       Chunk process_chunk,
+                                                       schedule_options options = schedule_options())
 {
-    typedef result_of<F(A&&)>::type result_type;
-    packaged_task<result_type(A&&)> task(move(f));
-    future<result_type> res(task.get_future());
-    thread t(move(task), move(a));
-    t.detach();
-    return res;
-}*/
-/* Конец листинга 4.14 */
+    return spawn_async([&vec, process_chunk, options = move(options)]
+        {
+            mutex parts_mutex;
+            vector<pair<size_t, ChunkResult>> parts;
+            parallel_for_chunks(vec.size(), [&](size_t first, size_t last)
+                {
+                    ChunkResult result = process_chunk(vec.begin() + first, vec.begin() + last);
+                    lock_guard<mutex> lk(parts_mutex);
+                    parts.emplace_back(first, move(result));
+                }, options);
+            sort(parts.begin(), parts.end(),
+                 [](auto const& a, auto const& b){ return a.first < b.first; });
+            vector<ChunkResult> v;
+            v.reserve(parts.size());
+            for (auto& part : parts)
+                v.push_back(move(part.second));
+            return gather_results(v);
+        });
+}
 
-/* Листинг 4.15 (стр 143) */
-// Никаких messaging не нашёл
-// Да и функций некоторых нет
-// Тут пример реализации интерфейса банкомата, а-ля listener-ы
-// В следующих листингах эта тема развивается, но там всё аналогично за исключением
-//  каких-либо дополнений, демонстраций синтаксиса и лямбда-функций
-struct card_inserted
+// Бенчмарк: данные с перекосом стоимости, время до конца (makespan)
+// при разных способах раздачи кусков. Два профиля: последняя восьмая часть
+// в 64 раза дороже остальных и линейный рост стоимости к концу (до 65 раз)
+namespace continuation_demo
 {
-    string account;
+unsigned skewed_rounds(size_t index, size_t count, bool hot_tail)
+{
+    if (hot_tail) return index >= count - count / 8 ? 1024 : 16;
+    return unsigned(16 + index * 1024 / count);
+}
+struct weighted_item
+{
+    unsigned value;
+    unsigned rounds;
 };
-template<typename close_queue, typename sender, typename receiver, typename card_inserted>
-class atm
+chunk_sum hash_chunk(vector<weighted_item>::iterator first, vector<weighted_item>::iterator last)
 {
-    receiver incoming;
-    sender bank;
-    sender interface_hardware;
-    void (atm::*state)();
-    string account;
-    string pin;
-    void waiting_for_card()
+    long long total = 0;
+    for (; first != last; ++first)
     {
-        // interface_hardware.send(display_enter_card());
-        incoming.wait().handle(
-            [&](card_inserted const& msg)
-                {
-                    account = msg.account;
-                    pin = "";
-                    // interface_hardware.send(display_enter_pin());
-                    state = &atm::getting_pin;
-                });
+        unsigned x = first->value;
+        for (unsigned r = 0; r < first->rounds; ++r)
+            x = x * 2654435761u + 0x9e3779b9u;
+        total += x & 0xff;
     }
-    void getting_pin();
-public:
-    void run()
+    return chunk_sum{total};
+}
+}
+
+// Модель: model_workers рабочих берут куски у chunk_scheduler по очереди
+// освобождения, кусок стоит сумму rounds своих элементов. Показывает качество
+// раздачи независимо от того, сколько ядер у машины, где идёт замер
+double modelled_makespan(vector<continuation_demo::weighted_item> const& data,
+                         schedule_options const& options, size_t model_workers)
+{
+    vector<double> prefix(data.size() + 1);
+    for (size_t i = 0; i < data.size(); ++i)
+        prefix[i + 1] = prefix[i] + data[i].rounds;
+    chunk_scheduler scheduler(data.size(), model_workers, options);
+    priority_queue<double, vector<double>, greater<double>> free_at;
+    for (size_t w = 0; w < model_workers; ++w)
+        free_at.push(0);
+    double makespan = 0;
+    size_t first, last;
+    while (scheduler.next(first, last))
     {
-        state = &atm::waiting_for_card;
-        try
+        double const finish = free_at.top() + prefix[last] - prefix[first];
+        free_at.pop();
+        free_at.push(finish);
+        makespan = max(makespan, finish);
+    }
+    return makespan / (prefix.back() / model_workers);
+}
+
+void bench_skewed_schedules(size_t items = 1 << 20, size_t model_workers = 8)
+{
+    using namespace continuation_demo;
+    cout << "pool threads: " << default_thread_pool().size() << endl;
+    cout << "profile  schedule  makespan s  vs static  model makespan / ideal on "
+         << model_workers << " workers" << endl;
+    for (bool hot_tail : {true, false})
+    {
+        vector<weighted_item> data(items);
+        for (size_t i = 0; i < items; ++i)
+            data[i] = weighted_item{unsigned(i), skewed_rounds(i, items, hot_tail)};
+        auto cost = [&data](size_t i){ return double(data[i].rounds); };
+        struct variant
         {
-            for(;;) (this->*state)();
+            char const* name;
+            schedule_options options;
+        };
+        vector<variant> variants(4);
+        variants[0].name = "static";
+        variants[0].options.kind = chunk_schedule::static_chunks;
+        variants[1].name = "dynamic";
+        variants[1].options.kind = chunk_schedule::dynamic;
+        variants[2].name = "guided";
+        variants[3].name = "guided+cost";
+        variants[3].options.cost_hint = cost;
+        double static_time = 0;
+        long long reference = 0;
+        for (auto& v : variants)
+        {
+            long long total = 0;
+            double const seconds = measure_seconds([&]
+                {
+                    total = process_data_scheduled<long long, weighted_item, chunk_sum>(data, &hash_chunk, v.options).get();
+                });
+            if (&v == &variants[0])
+            {
+                static_time = seconds;
+                reference = total;
+            }
+            cout << (hot_tail ? "hot tail" : "ramp") << "  " << v.name << "  " << seconds << "  "
+                 << static_time / seconds << "  " << modelled_makespan(data, v.options, model_workers)
+                 << (total == reference ? "" : "  MISMATCH") << endl;
         }
-        catch(close_queue const&){}
     }
-};
-/* Конец листинга 4.15 */
+}
+/* Конец листинга 4.23 */
 
-/* Листинг 4.16 (стр 144) */
-// Опять нет типов
-/*
-void atm::getting_pin()
+/* Листинг 4.24 (стр 153) */
+// Параллельный поиск: каждая задача ищет в своём куске, первая нашедшая
+// поднимает done_flag. when_any выдаёт первую закончившую задачу; если она
+// ничего не нашла, ждём остальные тем же when_any, пока не кончатся
+// Доработка: вместо одного куска на задачу задачи берут куски с общего
+// chunk_scheduler (guided), так что медленная задача не держит хвост.
+// Найденное отдаём только после выхода всех задач (when_all по остальным,
+// они видят done_flag и бросают поиск), так что data потом можно менять
+template<typename FinalResult, typename MyData>
+continuable_future<FinalResult> find_and_process_value(vector<MyData>& data)
 {
-    incoming.wait()
-        .handle<digit_pressed>(
-            [&](digit_pressed const& msg)
+    unsigned const concurrency = thread::hardware_concurrency();
+    unsigned const num_tasks = (concurrency > 0) ? concurrency : 2;
+    vector<continuable_future<MyData*>> results;
+    auto const data_begin = data.begin();
+    schedule_options options;
+    options.min_chunk = 1024;
+    shared_ptr<chunk_scheduler> scheduler = make_shared<chunk_scheduler>(data.size(), num_tasks, options);
+    shared_ptr<atomic<bool>> done_flag = make_shared<atomic<bool>>(false);
+    for (unsigned i = 0; i < num_tasks; ++i)
+    {
+        results.push_back(spawn_async([=]
                 {
-                    unsigned const pin_length = 4;
-                    pin += msg.digit;
-                    if (pin.length() == pin_length)
+                    size_t first, last;
+                    while (!*done_flag && scheduler->next(first, last))
                     {
-                        bank.send(verify_pin(account, pin, incoming));
-                        state = &atm::verifying_pin;
+                        for (auto entry = data_begin + first; !*done_flag && entry != data_begin + last; ++entry)
+                        {
+                            if (matches_find_criteria(*entry))
+                            {
+                                *done_flag = true;
+                                return &*entry;
+                            }
+                        }
                     }
-                })
-        .handle<clear_last_pressed>(
-            [&](clear_last_pressed const& msg)
-                {
-                    if (!pin.empty()) pin.resize(pin.length()-1);
-                })
-        .handle<cancel_pressed>(
-            [&](cancel_pressed const& msg)
-            {
-                state = &atm::done_processing;
-            });
-}*/
-/* Конец листинга 4.16 */
+                    return (MyData*) nullptr;
+                }));
+    }
+    shared_ptr<continuable_promise<FinalResult>> final_result = make_shared<continuable_promise<FinalResult>>();
+    struct DoneCheck {
+        shared_ptr<continuable_promise<FinalResult>> final_result;
 
-/* Листинг 4.17 (стр 147) */
-// Без функции запуска, собирается и ладно
-template<typename Func>
-future<decltype(declval<Func>()())> spawn_async(Func&& func)
-{
-    promise<decltype(declval<Func>()())> p;
-    auto res = p.get_future();
-    thread t([p = move(p), f = decay_t<Func>(func)]()
-             mutable
-             {
-                 try
-                 {
-                     p.set_value(f());
-                 }
-                 catch(...)
-                 {
-                     p.set_exception(current_exception());
-                 }
+        DoneCheck(shared_ptr<continuable_promise<FinalResult>> final_result_) :
+            final_result(move(final_result_)){}
 
-             });
-    t.detach();
-    return res;
+        void operator()(continuable_future<when_any_result<vector<continuable_future<MyData*>>>> results_param)
+        {
+            auto results = results_param.get();
+            MyData* const ready_result = results.futures[results.index].get();
+            results.futures.erase(results.futures.begin() + results.index);
+            if (ready_result)
+            {
+                FinalResult value = process_found_value(*ready_result);
+                when_all(results.futures.begin(), results.futures.end())
+                    .then([final_result = move(final_result), value = move(value)](auto) mutable
+                        {
+                            final_result->set_value(move(value));
+                        });
+            }
+            else
+            {
+                if (!results.futures.empty())
+                {
+                    when_any(results.futures.begin(), results.futures.end())
+                        .then(move(*this));
+                }
+                else
+                {
+                    final_result->set_exception(make_exception_ptr(runtime_error("Not found")));
+                }
+            }
+        }
+    };
+
+    when_any(results.begin(), results.end())
+        .then(DoneCheck(final_result));
+    return final_result->get_future();
 }
-/* Конец листинга 4.17 */
 
-/* Листинг 4.18 (стр 148) */
-// Опять левые типы и неизвестные функции...
-void display_error418(exception& e) {}
-template<typename user_id, typename user_data, typename backend_type>
-void process_login(string const& username, string const& password)
+void run424()
 {
+    using namespace continuation_demo;
+    vector<data_item> data(1000000);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i].value = int(i);
+    cout << find_and_process_value<int>(data).get() << endl; // 111111
+    data.resize(1000);
     try
     {
-        backend_type backend;
-        user_id const id = backend.authenticate_user(username, password);
-        user_data const info_to_display = backend.request_current_info(id);
-        update_display(info_to_display);
+        find_and_process_value<int>(data).get();
     }
-    catch(exception& e)
+    catch (exception& e)
     {
-        display_error418(e);
+        cout << e.what() << endl;
     }
 }
-/* Конец листинга 4.18 */
+/* Конец листинга 4.24 */
 
-/* Листинг 4.19 (стр 148) */
-// То же самое, что и в 4.18, только в обёртке под async
-template<typename user_id, typename user_data, typename backend_type>
-future<void> process_login(string const& username, string const& password)
+/* Доработка: параллельный поиск с отменой
+ * find_and_process_value на каждом элементе читает общий done_flag, а задачи,
+ * которые ещё не начались, всё равно запустятся и пройдут свой кусок. Здесь
+ * куски по batch элементов раздаёт chunk_scheduler, флаг (cancellation_token)
+ * проверяется раз на кусок, а задачи пула запускаются с жетоном, так что
+ * после находки те, что ещё не начались, сразу выходят.
+ * parallel_find_if возвращает первый по порядку подходящий элемент, как
+ * std::find_if: куски левее находки дорабатываются, правее - бросаются.
+ * parallel_any_of останавливает всех на любой находке.
+ * Отмена снаружи (token) - operation_cancelled.
+ * Возвращаются оба, только когда все задачи вышли, так что данные можно сразу
+ * менять. Исключение из pred отменяет ещё не начавшиеся задачи, а дождаться
+ * остальных и бросить первое - дело run_indexed_tasks.
+ */
+template<typename RandomIt, typename Predicate>
+RandomIt parallel_find_if(RandomIt first, RandomIt last, Predicate pred,
+                          cancellation_token token = cancellation_token(), size_t batch = 4096,
+                          work_stealing_pool& pool = default_thread_pool())
 {
-    return async(launch::async, [=]()
+    size_t const count = last - first;
+    schedule_options options;
+    options.kind = chunk_schedule::dynamic;
+    options.chunk_size = batch;
+    chunk_scheduler scheduler(count, pool.size(), options);
+    cancellation_source found;
+    // Индекс самой левой находки, count - пока нет
+    atomic<size_t> best(count);
+    auto worker = [&](size_t)
         {
+            size_t begin, end;
             try
             {
-                backend_type backend;
-                user_id const id = backend.authenticate_user(username, password);
-                user_data const info_to_display = backend.request_current_info(id);
-                update_display(info_to_display);
+                while (!token.is_cancelled() && scheduler.next(begin, end))
+                {
+                    // Куски раздаются по порядку: если этот правее находки, то и все следующие
+                    if (begin >= best.load(memory_order_relaxed)) break;
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        if (pred(first[i]))
+                        {
+                            size_t current = best.load(memory_order_relaxed);
+                            while (i < current && !best.compare_exchange_weak(current, i, memory_order_relaxed));
+                            found.cancel();
+                            break;
+                        }
+                    }
+                }
             }
-            catch (exception& e)
+            catch(...)
             {
-                display_error418(e);
+                found.cancel();
+                throw;
             }
-        });
+        };
+    run_indexed_tasks(pool, pool.size(), worker, found.token());
+    token.throw_if_cancelled();
+    return first + best.load();
 }
-/* Конец листинга 4.19 */
 
-/* Листинг 4.20 (стр 149) */
-// То же самое, что и в 4.18, только в другой обёртке (а-ля цепочка)
-template<typename user_id, typename user_data, typename backend_type>
-future<void> process_login420(string const& username, string const& password)
+template<typename RandomIt, typename Predicate>
+bool parallel_any_of(RandomIt first, RandomIt last, Predicate pred,
+                     cancellation_token token = cancellation_token(), size_t batch = 4096,
+                     work_stealing_pool& pool = default_thread_pool())
 {
-    backend_type backend;
-    return spawn_async([=]()
-        {
-            return backend.authenticate_user(username, password);
-        }).then([&backend](future<user_id> id)
-        {
-            return backend.request_current_info(id.get());
-        }).then([](future<user_data> info_to_display)
+    size_t const count = last - first;
+    schedule_options options;
+    options.kind = chunk_schedule::dynamic;
+    options.chunk_size = batch;
+    chunk_scheduler scheduler(count, pool.size(), options);
+    cancellation_source found;
+    cancellation_token const found_token = found.token();
+    auto worker = [&](size_t)
         {
+            size_t begin, end;
             try
             {
-                update_display(info_to_display.get());
+                while (!found_token.is_cancelled() && !token.is_cancelled() && scheduler.next(begin, end))
+                {
+                    if (any_of(first + begin, first + end, pred))
+                    {
+                        found.cancel();
+                        return;
+                    }
+                }
             }
-            catch (exception& e)
+            catch(...)
             {
-                display_error418(e);
+                found.cancel();
+                throw;
             }
-        });
+        };
+    run_indexed_tasks(pool, pool.size(), worker, found_token);
+    if (found.is_cancelled()) return true;
+    token.throw_if_cancelled();
+    return false;
 }
-/* Конец листинга 4.20 */
 
-/* Листинг 4.21 (стр 150) */
-// То же самое что и предыдущее...
-template<typename user_id, typename user_data, typename backend_type>
-future<void> process_login421(string const& username, string const& password)
+void run_parallel_find()
 {
-    backend_type backend;
-    return backend.async_authenticate_user(username, password)
-                .then([&backend](future<user_id> id)
-                      {
-                          return backend.async_request_current_info(id.get());
-                      })
-                .then([](future<user_data> info_to_display)
-                      {
-                          try
-                          {
-                              update_display(info_to_display.get());
-                          }
-                          catch (exception& e)
-                          {
-                              display_error418(e);
-                          }
-                      });
+    vector<int> data(1000000);
+    iota(data.begin(), data.end(), 0);
+    auto const it = parallel_find_if(data.begin(), data.end(), [](int v){ return v % 1000 == 777 && v > 5000; });
+    cout << *it << endl; // 5777
+    cout << parallel_any_of(data.begin(), data.end(), [](int v){ return v == 999999; }) << " "
+         << parallel_any_of(data.begin(), data.end(), [](int v){ return v < 0; }) << endl; // 1 0
+    cancellation_source stop;
+    stop.cancel();
+    try
+    {
+        parallel_find_if(data.begin(), data.end(), [](int v){ return v < 0; }, stop.token());
+    }
+    catch (operation_cancelled& e)
+    {
+        cout << e.what() << endl;
+    }
 }
-/* Конец листинга 4.21 */
 
-/* Листинг 4.22 (стр 151) */
-// Насыпал шаблонов чтобы собиралось
-// Естественно, функции запуска не будет
-// Асинхронная обработка больших данных, поделенных на части (чанки)
-template<typename FinalResult,
-         typename MyData,
-         typename ChunkResult,
-         typename Chunk>
-future<FinalResult> process_data(vector<MyData>& vec,
-                                 Chunk process_chunk,
-                                 size_t const c_size)
+// Бенчмарк: время до результата и работа - всего проверок и сколько сверх
+// последовательного прохода до найденного элемента включительно - у
+// find_and_process_value из 4.24 и parallel_find_if. Проверки считаются
+// в счётчиках по потокам
+namespace find_demo
 {
-    size_t const chunk_size = c_size;
-    vector<future<ChunkResult>> results;
-    for (auto begin = vec.begin(), end = vec.end(); begin != end;)
+struct probe_counter
+{
+    alignas(cache_line_size) atomic<unsigned long> count{0};
+};
+mutex counters_mutex;
+std::list<probe_counter> counters;
+atomic<unsigned long>& local_probes()
+{
+    thread_local atomic<unsigned long>* const mine = []
+        {
+            lock_guard<mutex> lk(counters_mutex);
+            counters.emplace_back();
+            return &counters.back().count;
+        }();
+    return *mine;
+}
+unsigned long take_probes()
+{
+    lock_guard<mutex> lk(counters_mutex);
+    unsigned long total = 0;
+    for (auto& c : counters)
+        total += c.count.exchange(0);
+    return total;
+}
+int target = -1;
+struct probe_item
+{
+    int value;
+};
+bool matches_find_criteria(probe_item const& item)
+{
+    atomic<unsigned long>& probes = local_probes();
+    probes.store(probes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    return item.value == target;
+}
+int process_found_value(probe_item const& item)
+{
+    return item.value;
+}
+}
+
+void bench_parallel_find(size_t items = 1 << 23, unsigned repeats = 5)
+{
+    using namespace find_demo;
+    vector<probe_item> data(items);
+    for (size_t i = 0; i < items; ++i)
+        data[i].value = int(i);
+    cout << "pool threads: " << default_thread_pool().size() << endl;
+    cout << "match at  method  time to result ms  probes  wasted probes" << endl;
+    for (double position : {0.01, 0.5, 0.99})
+    {
+        target = int(items * position);
+        unsigned long const needed = (unsigned long)target + 1;
+        double book_ms = 0, cancel_ms = 0;
+        unsigned long book_probes = 0, cancel_probes = 0, book_waste = 0, cancel_waste = 0;
+        for (unsigned r = 0; r < repeats; ++r)
+        {
+            take_probes();
+            book_ms += measure_seconds([&]{ find_and_process_value<int>(data).get(); }) * 1000;
+            unsigned long probes = take_probes();
+            book_probes += probes;
+            book_waste += probes > needed ? probes - needed : 0;
+            cancel_ms += measure_seconds([&]
+                {
+                    parallel_find_if(data.begin(), data.end(),
+                                     [](probe_item const& item){ return matches_find_criteria(item); });
+                }) * 1000;
+            probes = take_probes();
+            cancel_probes += probes;
+            cancel_waste += probes > needed ? probes - needed : 0;
+        }
+        cout << position << "  find_and_process_value  " << book_ms / repeats << "  "
+             << book_probes / repeats << "  " << book_waste / repeats << endl;
+        cout << position << "  parallel_find_if  " << cancel_ms / repeats << "  "
+             << cancel_probes / repeats << "  " << cancel_waste / repeats << endl;
+    }
+}
+/* Конец доработки: параллельный поиск с отменой */
+
+/* Доработка: защёлка и барьеры для листингов 4.25-4.27
+ * В стандартной библиотеке книжки их не было (std::latch/std::barrier появились
+ * в C++20, flex_barrier так и не появился), поэтому свои, с другими именами.
+ * Чтобы на 64+ потоках все не долбили один счётчик, приходы собираются деревом:
+ * у каждого листа свой бюджет (не больше fan_in приходов), поток начинает со
+ * "своего" листа и уходит на соседний, если там всё выбрано. Кто обнулил лист,
+ * несёт одну единицу родителю, и так до корня. Обнуливший корень завершает фазу:
+ * восстанавливает бюджеты и меняет номер фазы, на котором спят остальные
+ * (смена фазы - тот же sense reversal, только счётчиком, а не флагом).
+ */
+class combining_arrival_tree
+{
+    static constexpr size_t fan_in = 4;
+    static constexpr size_t no_parent = SIZE_MAX;
+    struct alignas(cache_line_size) node
+    {
+        atomic<ptrdiff_t> remaining{0};
+        ptrdiff_t budget = 0;
+        size_t parent = no_parent;
+    };
+    // Сначала листья, потом уровни выше, корень последний
+    unique_ptr<node[]> nodes;
+    size_t node_count = 0;
+    size_t leaves = 0;
+
+    // Номер потока для выбора листа - раздаётся при первом приходе
+    static size_t this_thread_slot()
+    {
+        static atomic<size_t> next_slot(0);
+        thread_local size_t const slot = next_slot.fetch_add(1, memory_order_relaxed);
+        return slot;
+    }
+    // true - обнулили корень
+    bool propagate(size_t index)
+    {
+        while (index != no_parent)
+        {
+            if (nodes[index].remaining.fetch_sub(1, memory_order_acq_rel) != 1) return false;
+            index = nodes[index].parent;
+        }
+        return true;
+    }
+public:
+    explicit combining_arrival_tree(ptrdiff_t expected)
+    {
+        build(expected);
+    }
+    // Перестроить под новое число участников. Только когда никто не приходит
+    void build(ptrdiff_t expected)
+    {
+        leaves = max<size_t>(1, (size_t(expected) + fan_in - 1) / fan_in);
+        node_count = 0;
+        for (size_t level = leaves; ; level = (level + fan_in - 1) / fan_in)
+        {
+            node_count += level;
+            if (level == 1) break;
+        }
+        nodes.reset(new node[node_count]);
+        for (size_t i = 0; i < leaves; ++i)
+            nodes[i].budget = min<ptrdiff_t>(fan_in, expected - ptrdiff_t(i * fan_in));
+        // Каждый уровень ждёт по единице от каждого ребёнка
+        size_t level_begin = 0;
+        size_t level_size = leaves;
+        while (level_size > 1)
+        {
+            size_t const parents_begin = level_begin + level_size;
+            for (size_t i = 0; i < level_size; ++i)
+            {
+                nodes[level_begin + i].parent = parents_begin + i / fan_in;
+                ++nodes[parents_begin + i / fan_in].budget;
+            }
+            level_begin = parents_begin;
+            level_size = (level_size + fan_in - 1) / fan_in;
+        }
+        reset();
+    }
+    // Вернуть бюджеты перед новой фазой. Только когда никто не приходит
+    void reset()
     {
-        size_t const remaining_size = end - begin;
-        size_t const this_chunk_size = min(remaining_size, chunk_size);
-        results.push_back(async(process_chunk, begin, begin + this_chunk_size));
-        begin += this_chunk_size;
+        for (size_t i = 0; i < node_count; ++i)
+            nodes[i].remaining.store(nodes[i].budget, memory_order_relaxed);
     }
-    return async([all_results = move(results)]()
-                 {
-                     vector<ChunkResult> v;
-                     v.reserve(all_results.size());
-                     for (auto& f: all_results)
-                         v.push_back(f.get());
-                     return gather_results(v);
-                 });
+    // Отдать n единиц; true - это были последние, фаза завершена
+    bool arrive(ptrdiff_t n)
+    {
+        // Отдав последнюю единицу, дерево больше не трогаем: фазу могут
+        // завершить и перестроить дерево сразу после этого
+        size_t const leaf_count = leaves;
+        size_t leaf = this_thread_slot() % leaf_count;
+        // Если прошли все листья и ничего не взяли, значит пришло больше
+        // участников, чем ждали - лишнее выкидываем, а не крутимся вечно
+        for (size_t idle = 0; idle < leaf_count; leaf = (leaf + 1) % leaf_count)
+        {
+            ptrdiff_t const before = nodes[leaf].remaining.fetch_sub(n, memory_order_acq_rel);
+            if (before <= 0)
+            {
+                ++idle;
+                continue;
+            }
+            idle = 0;
+            ptrdiff_t const taken = min(before, n);
+            n -= taken;
+            bool const finished = taken == before && propagate(nodes[leaf].parent);
+            if (finished || n == 0) return finished;
+        }
+        return false;
+    }
+};
+
+// Ждать, пока значение уйдёт от old: немного покрутиться, дальше спать (futex внутри atomic::wait)
+inline void wait_for_phase_change(atomic<uint32_t> const& value, uint32_t old)
+{
+    static bool const multicore = thread::hardware_concurrency() > 1;
+    for (unsigned i = 0; multicore && i < 256; ++i)
+        if (value.load(memory_order_acquire) != old) return;
+    while (value.load(memory_order_acquire) == old)
+        value.wait(old, memory_order_acquire);
 }
-/* Конец листинга 4.22 */
 
-/* Листинг 4.23 (стр 152) */
-// Комментарий тот же, что и в 4.22
-template<typename FinalResult,
-         typename MyData,
-         typename Chunk,
-         typename ChunkResult>
-future<FinalResult> process_data423(vector<MyData>& vec,
-                                    size_t const c_size,
-                                    Chunk process_chunk)
+// Одноразовая защёлка, как std::latch
+class scalable_latch
 {
-    size_t const chunk_size = c_size;
-    vector<future<ChunkResult>> results;
-    for (auto begin = vec.begin(), end = vec.end(); begin != end;)
+    combining_arrival_tree tree;
+    atomic<uint32_t> released;
+public:
+    explicit scalable_latch(ptrdiff_t expected):
+        tree(expected), released(expected == 0)
+    {}
+    scalable_latch(scalable_latch const&) = delete;
+    scalable_latch& operator=(scalable_latch const&) = delete;
+
+    void count_down(ptrdiff_t n = 1)
     {
-        size_t const remaining_size = end - begin;
-        size_t const this_chunk_size = min(remaining_size, chunk_size);
-        results.push_back(
-            spawn_async(process_chunk, begin, begin + this_chunk_size));
-        begin += this_chunk_size;
+        if (tree.arrive(n))
+        {
+            released.store(1, memory_order_release);
+            released.notify_all();
+        }
     }
-    return when_all(results.begin(), results.end())
-               .then([](future<vector<future<ChunkResult>>> ready_results)
-                     {
-                         vector<future<ChunkResult>> all_results = ready_results.get();
-                         vector<ChunkResult> v;
-                         v.reserve(all_results.size());
-                         for (auto& f : all_results)
-                             v.push_back(f.get());
-                         return gather_results(v);
-                     });
-}
-/* Конец листинга 4.23 */
-
-/* Листинг 4.24 (стр 153) */
-// Опять без функции запуска, собирается и ладно
+    bool try_wait() const
+    {
+        return released.load(memory_order_acquire);
+    }
+    void wait() const
+    {
+        wait_for_phase_change(released, 0);
+    }
+    void arrive_and_wait(ptrdiff_t n = 1)
+    {
+        count_down(n);
+        wait();
+    }
+};
 
-template<typename T>
-struct when_any_result {};
+struct barrier_no_completion
+{
+    void operator()() const {}
+};
 
-// Тут наши полномочия всё
-// Что тут происходит, я не понимаю
-template<typename FinalResult, typename MyData>
-future<FinalResult> find_and_process_value(vector<MyData>& data)
+// Многоразовый барьер, как std::barrier. Завершающую функцию зовёт последний
+// пришедший, до того как отпустить остальных. Если она возвращает int, это
+// число участников следующей фазы (-1 - не менять), как у flex_barrier
+template<typename Completion = barrier_no_completion>
+class scalable_barrier
 {
-    unsigned const concurrency = thread::hardware_concurrency();
-    unsigned const num_tasks = (concurrency > 0) ? concurrency : 2;
-    vector<future<MyData*>> results;
-    auto const chunk_size = (data.size() + num_tasks - 1) / num_tasks;
-    auto chunk_begin = data.begin();
-    shared_ptr<atomic<bool>> done_flag = make_shared<atomic<bool>>(false);
-    for (unsigned i = 0; i < num_tasks; ++i)
+    combining_arrival_tree tree;
+    alignas(cache_line_size) atomic<uint32_t> phase{0};
+    // Ушедшие через arrive_and_drop - вычитаются при завершении фазы
+    atomic<ptrdiff_t> dropped{0};
+    ptrdiff_t expected;
+    Completion completion;
+
+    void complete_phase(uint32_t current)
     {
-        auto chunk_end = (i < (num_tasks - 1)) ? chunk_begin + chunk_size : data.end();
-        results.push_back(spawn_async([=]
-                {
-                    for (auto entry = chunk_begin; !*done_flag && entry != chunk_end; ++entry)
-                    {
-                        if (matches_find_criteria(*entry))
-                        {
-                            *done_flag = true;
-                            return &*entry;
-                        }
-                    }
-                    return (MyData*) nullptr;
-                }));
-        chunk_begin = chunk_end;
+        ptrdiff_t next_expected = expected - dropped.exchange(0, memory_order_relaxed);
+        if constexpr (is_void_v<invoke_result_t<Completion&>>)
+            completion();
+        else
+        {
+            int const requested = completion();
+            if (requested >= 0) next_expected = requested;
+        }
+        if (next_expected != expected)
+        {
+            expected = next_expected;
+            tree.build(expected);
+        }
+        else
+            tree.reset();
+        phase.store(current + 1, memory_order_release);
+        phase.notify_all();
     }
-    shared_ptr<promise<FinalResult>> final_result = make_shared<promise<FinalResult>>();
-    struct DoneCheck {
-        shared_ptr<promise<FinalResult>> final_result;
+public:
+    typedef uint32_t arrival_token;
+
+    explicit scalable_barrier(ptrdiff_t expected_, Completion completion_ = Completion()):
+        tree(expected_), expected(expected_), completion(move(completion_))
+    {}
+    scalable_barrier(scalable_barrier const&) = delete;
+    scalable_barrier& operator=(scalable_barrier const&) = delete;
+
+    [[nodiscard]] arrival_token arrive(ptrdiff_t n = 1)
+    {
+        uint32_t const current = phase.load(memory_order_acquire);
+        if (tree.arrive(n)) complete_phase(current);
+        return current;
+    }
+    void wait(arrival_token token) const
+    {
+        wait_for_phase_change(phase, token);
+    }
+    void arrive_and_wait()
+    {
+        wait(arrive());
+    }
+    // Прийти в этой фазе и больше не участвовать
+    void arrive_and_drop()
+    {
+        dropped.fetch_add(1, memory_order_relaxed);
+        (void)arrive();
+    }
+};
 
-        DoneCheck(shared_ptr<promise<FinalResult>> final_result_) :
-            final_result(move(final_result_)){}\
+// flex_barrier из книжки: завершающая функция возвращает число участников
+// следующей фазы или -1
+class scalable_flex_barrier: public scalable_barrier<function<int()>>
+{
+public:
+    template<typename Function>
+    scalable_flex_barrier(ptrdiff_t expected, Function completion):
+        scalable_barrier<function<int()>>(expected, function<int()>(move(completion)))
+    {}
+};
 
-        void operator()(future<when_any_result<vector<future<MyData*>>>> results_param)
+// Для сравнения: один общий счётчик и флаг фазы
+class central_barrier
+{
+    alignas(cache_line_size) atomic<ptrdiff_t> remaining;
+    alignas(cache_line_size) atomic<uint32_t> phase{0};
+    ptrdiff_t const expected;
+public:
+    explicit central_barrier(ptrdiff_t expected_): remaining(expected_), expected(expected_) {}
+    void arrive_and_wait()
+    {
+        uint32_t const current = phase.load(memory_order_acquire);
+        if (remaining.fetch_sub(1, memory_order_acq_rel) == 1)
         {
-            auto results = results_param.get();
-            MyData* const ready_result = results.futures[results.index].get();
-            if (ready_result) final_result->set_value(process_found_value(*ready_result));
-            else
-            {
-                results.futures.erase(results.futures.begin() + results.index);
-                if (!results.futures.empty())
-                {
-                    when_any(results.futures.begin(), results.futures.end())
-                        .then(move(*this));
-                }
-                else
-                {
-                    final_result->set_exception(make_exception_ptr(runtime_error("Not found")));
-                }
-            }
+            remaining.store(expected, memory_order_relaxed);
+            phase.store(current + 1, memory_order_release);
+            phase.notify_all();
+            return;
         }
-    };
+        wait_for_phase_change(phase, current);
+    }
+};
 
-    when_any(results.begin(), results.end())
-        .then(DoneCheck(final_result));
-    return final_result->get_future();
+// Бенчмарк: фаз в секунду для threads потоков, дерево против общего счётчика
+template<typename Barrier>
+double barrier_phases_per_second(unsigned threads, unsigned phases)
+{
+    Barrier sync(threads);
+    double const seconds = measure_seconds([&]
+        {
+            vector<thread> workers;
+            for (unsigned t = 0; t < threads; ++t)
+                workers.emplace_back([&]{ for (unsigned p = 0; p < phases; ++p) sync.arrive_and_wait(); });
+            for (auto& w : workers)
+                w.join();
+        });
+    return phases / seconds;
 }
-/* Конец листинга 4.24 */
+
+void bench_barriers(unsigned phases = 2000)
+{
+    cout << "threads  scalable_barrier phases/s  central_barrier phases/s" << endl;
+    for (unsigned threads : {2, 4, 16, 64, 128})
+        cout << threads << "  " << (unsigned long)barrier_phases_per_second<scalable_barrier<>>(threads, phases)
+             << "  " << (unsigned long)barrier_phases_per_second<central_barrier>(threads, phases) << endl;
+}
+/* Конец доработки: защёлка и барьеры */
 
 /* Листинг 4.25 (стр 156) */
-// Без функции запуска
-void make_data(const unsigned int& i) {}
-void do_more_stuff();
+// Доработка: заглушки стали рабочими, чтобы листинг запускался на scalable_latch
+int make_data(const unsigned int& i) { return int(i * i); }
+void do_more_stuff() {}
+void process_data(int const* data, unsigned count)
+{
+    cout << "sum of squares: " << accumulate(data, data + count, 0) << endl;
+}
 
 template<typename latch, typename my_data>
 void foo425()
@@ -1760,6 +8709,12 @@ void foo425()
     done.wait();
     process_data(data, thread_count);
 }
+
+// Запуск листинга
+void run425()
+{
+    foo425<scalable_latch, int>(); // 0 + 1 + 4 + 9 = 14
+}
 /* Конец листинга 4.25 */
 
 /* Листинг 4.26 (стр ) */
@@ -1774,33 +8729,172 @@ void process_data426(data_source& source, data_sink& sink)
     unsigned const num_threads = (concurrency > 0) ? concurrency : 2;
 
     barrier sync(num_threads);
-    vector<joining_thread> threads(num_threads);
 
-    vector<data_chunk> chunks;
-    result_block result;
+    // Доработка: тип чанков - тот, что отдаёт divide_into_chunks, а не заглушка
+    // data_chunk. source.done() проверяет только поток 0 до барьера: в книжке
+    // остальные читали его, пока поток 0 брал следующий блок, и могли уйти,
+    // оставив его висеть на барьере. И потоки объявлены после данных, чтобы
+    // дождаться их раньше, чем данные разрушатся. result_block создаётся сразу
+    // на num_threads чанков, тогда set_chunk из потоков - просто запись в ячейку
+    decltype(divide_into_chunks(declval<data_block&>(), num_threads)) chunks;
+    result_block result(num_threads);
+    bool more_blocks = true;
+    vector<joining_thread> threads(num_threads);
 
     for (unsigned i = 0; i < num_threads; i++)
     {
         threads[i] = joining_thread([&, i] {
-            while (!source.done())
+            while (true)
             {
                 if (!i)
                 {
-                    data_block current_block = source.get_next_data_block();
-                    chunks = divide_into_chunks(current_block, num_threads);
+                    more_blocks = !source.done();
+                    if (more_blocks)
+                    {
+                        data_block current_block = source.get_next_data_block();
+                        chunks = divide_into_chunks(current_block, num_threads);
+                    }
                 }
                 sync.arrive_and_wait();
+                if (!more_blocks) break;
                 result.set_chunk(i, num_threads, process(chunks[i]));
                 sync.arrive_and_wait();
-                if (!i) sink.write_data(move(result));
+                if (!i)
+                {
+                    sink.write_data(move(result));
+                    result = result_block(num_threads);
+                }
             }
         });
     }
 }
+
+// Цикл по блокам из 4.26 на конвейере: чтение, обработка и запись блоков идут
+// одновременно, блоки обрабатываются параллельно, в sink уходят по порядку.
+// В памяти не больше block_capacity блоков на канал. Внутри блока - те же
+// divide_into_chunks/process/set_chunk, что и в листинге
+template<typename data_source,
+         typename data_sink,
+         typename data_block,
+         typename result_block>
+void process_data426_pipeline(data_source& source, data_sink& sink, size_t block_capacity = 4)
+{
+    unsigned const concurrency = thread::hardware_concurrency();
+    unsigned const num_threads = (concurrency > 0) ? concurrency : 2;
+    unsigned const chunks_per_block = num_threads;
+    stage_options workers;
+    workers.parallelism = num_threads;
+    workers.capacity = block_capacity;
+    workers.order = pipeline_order::ordered;
+    make_pipeline([&source]() -> optional<data_block>
+        {
+            if (source.done()) return nullopt;
+            return source.get_next_data_block();
+        })
+        .then([chunks_per_block](data_block current_block)
+            {
+                auto chunks = divide_into_chunks(current_block, chunks_per_block);
+                result_block result(chunks.size());
+                for (unsigned i = 0; i < chunks.size(); ++i)
+                    result.set_chunk(i, chunks.size(), process(chunks[i]));
+                return result;
+            }, workers)
+        .sink([&sink](result_block result){ sink.write_data(move(result)); }, workers)
+        .wait();
+}
+
+// Типы для запуска: блоки чисел, чанк - кусок блока, результат чанка - сумма
+namespace pipeline_demo
+{
+struct number_block
+{
+    vector<long long> values;
+};
+struct number_chunk
+{
+    vector<long long> values;
+};
+// Размер - число чанков - задаётся при создании блока, в одном потоке.
+// В 4.26/4.27 set_chunk зовут сразу из всех потоков, каждый пишет свою ячейку
+struct sum_block
+{
+    vector<long long> sums;
+    explicit sum_block(size_t chunk_count = 0): sums(chunk_count) {}
+    void set_chunk(size_t index, size_t, long long sum)
+    {
+        sums[index] = sum;
+    }
+};
+vector<number_chunk> divide_into_chunks(number_block const& block, size_t count)
+{
+    vector<number_chunk> chunks(count);
+    for (size_t i = 0; i < block.values.size(); ++i)
+        chunks[i * count / block.values.size()].values.push_back(block.values[i]);
+    return chunks;
+}
+long long process(number_chunk const& chunk)
+{
+    return accumulate(chunk.values.begin(), chunk.values.end(), 0ll);
+}
+class number_source
+{
+    unsigned next = 0;
+    unsigned const blocks;
+public:
+    explicit number_source(unsigned blocks_): blocks(blocks_) {}
+    bool done() const
+    {
+        return next == blocks;
+    }
+    number_block get_next_data_block()
+    {
+        number_block block;
+        for (unsigned i = 0; i < 1000; ++i)
+            block.values.push_back(next * 1000ll + i);
+        ++next;
+        return block;
+    }
+};
+struct sum_sink
+{
+    vector<long long> totals;
+    void write_data(sum_block&& block)
+    {
+        totals.push_back(accumulate(block.sums.begin(), block.sums.end(), 0ll));
+    }
+};
+}
+
+void run426_pipeline()
+{
+    using namespace pipeline_demo;
+    number_source source(8);
+    sum_sink sink;
+    process_data426_pipeline<number_source, sum_sink, number_block, sum_block>(source, sink);
+    for (long long total : sink.totals)
+        cout << total << " ";
+    cout << endl; // 499500 1499500 ... блок i: 1000000*i + 499500
+}
+
+// Запуск листинга на scalable_barrier, те же числа
+void run426()
+{
+    using namespace pipeline_demo;
+    number_source source(8);
+    sum_sink sink;
+    process_data426<number_source, sum_sink, number_block, sum_block, scalable_barrier<>>(source, sink);
+    for (long long total : sink.totals)
+        cout << total << " ";
+    cout << endl;
+}
 /* Конец листинга 4.26 */
 
 /* Листинг 4.27 (стр 160) */
 // flex_barrier - не нашёл хидер с ним, хотя по идее должен быть
+// Доработка: есть scalable_flex_barrier. Чанки - тип из divide_into_chunks.
+// В книжке последний блок терялся: завершающая функция его читала, source.done()
+// становился true, и потоки выходили, не обработав его. Теперь выход по флагу
+// "блок есть", который выставляет split_source
 template<typename data_source,
          typename data_sink,
          typename data_block,
@@ -1811,11 +8905,13 @@ void process_data427(data_source& source, data_sink& sink)
     unsigned const concurrency = thread::hardware_concurrency();
     unsigned const num_threads = (concurrency > 0) ? concurrency : 2;
 
-    vector<data_chunk> chunks;
+    decltype(divide_into_chunks(declval<data_block&>(), num_threads)) chunks;
+    bool have_block = false;
 
     auto split_source = [&]
     {
-        if (!source.done())
+        have_block = !source.done();
+        if (have_block)
         {
             data_block current_block = source.get_next_data_block();
             chunks = divide_into_chunks(current_block, num_threads);
@@ -1824,10 +8920,11 @@ void process_data427(data_source& source, data_sink& sink)
 
     split_source();
 
-    result_block result;
+    result_block result(num_threads);
 
     flex_barrier sync(num_threads, [&] {
         sink.write_data(move(result));
+        result = result_block(num_threads);
         split_source();
         return -1;
     });
@@ -1836,7 +8933,7 @@ void process_data427(data_source& source, data_sink& sink)
     for (unsigned i = 0; i < num_threads; i++)
     {
         threads[i] = joining_thread([&, i] {
-            while (!source.done())
+            while (have_block)
             {
                 result.set_chunk(i, num_threads, process(chunks[i]));
                 sync.arrive_and_wait();
@@ -1844,6 +8941,185 @@ void process_data427(data_source& source, data_sink& sink)
         });
     }
 }
+// Доработка: то же с двойной/тройной буферизацией. В process_data427 запись
+// результата и чтение следующего блока идут в завершающей функции барьера,
+// и все рабочие потоки на это время стоят. Здесь блоков в работе buffers
+// штук, а чтением и записью занят отдельный поток ввода-вывода: пока рабочие
+// считают блок N, он пишет N-1 и читает и делит N+1. Завершающей функции
+// остаётся отдать готовый слот и взять следующий (ждёт, только если
+// ввод-вывод не успевает). В sink блоки уходят по порядку
+template<typename data_source,
+         typename data_sink,
+         typename data_block,
+         typename result_block,
+         typename flex_barrier>
+void process_data427_buffered(data_source& source, data_sink& sink, size_t buffers = 2)
+{
+    unsigned const concurrency = thread::hardware_concurrency();
+    unsigned const num_threads = (concurrency > 0) ? concurrency : 2;
+    size_t const no_slot = SIZE_MAX;
+
+    struct slot
+    {
+        decltype(divide_into_chunks(declval<data_block&>(), num_threads)) chunks;
+        result_block result;
+    };
+    vector<slot> slots(max<size_t>(buffers, 2));
+    // Номера слотов: готовые к обработке и посчитанные; no_slot - блоки кончились
+    threadsafe_queue45<size_t> filled;
+    threadsafe_queue45<size_t> computed;
+
+    joining_thread io_thread([&] {
+        size_t in_flight = 0;
+        auto fill = [&](size_t index)
+        {
+            if (source.done()) return;
+            data_block current_block = source.get_next_data_block();
+            slots[index].chunks = divide_into_chunks(current_block, num_threads);
+            slots[index].result = result_block(num_threads);
+            ++in_flight;
+            filled.push(index);
+        };
+        for (size_t index = 0; index < slots.size(); ++index)
+            fill(index);
+        while (in_flight)
+        {
+            size_t index;
+            computed.wait_and_pop(index);
+            --in_flight;
+            sink.write_data(move(slots[index].result));
+            fill(index);
+        }
+        filled.push(no_slot);
+    });
+
+    size_t current;
+    filled.wait_and_pop(current);
+    if (current == no_slot) return;
+
+    flex_barrier sync(num_threads, [&] {
+        computed.push(current);
+        filled.wait_and_pop(current);
+        return -1;
+    });
+    vector<joining_thread> threads(num_threads);
+
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        threads[i] = joining_thread([&, i] {
+            while (current != no_slot)
+            {
+                slot& block = slots[current];
+                block.result.set_chunk(i, num_threads, process(block.chunks[i]));
+                sync.arrive_and_wait();
+            }
+        });
+    }
+}
+
+// Источник и приёмник на файлах для замера: блоки по block_size чисел
+// читаются из двоичного файла, суммы чанков пишутся в другой
+namespace pipeline_demo
+{
+class file_number_source
+{
+    ifstream in;
+    size_t const block_size;
+public:
+    file_number_source(string const& path, size_t block_size_):
+        in(path, ios::binary), block_size(block_size_)
+    {}
+    bool done()
+    {
+        return in.peek() == ifstream::traits_type::eof();
+    }
+    number_block get_next_data_block()
+    {
+        number_block block;
+        block.values.resize(block_size);
+        in.read(reinterpret_cast<char*>(block.values.data()), block_size * sizeof(long long));
+        block.values.resize(in.gcount() / sizeof(long long));
+        return block;
+    }
+};
+class file_sum_sink
+{
+    ofstream out;
+public:
+    long long total = 0;
+    explicit file_sum_sink(string const& path): out(path, ios::binary) {}
+    void write_data(sum_block&& block)
+    {
+        out.write(reinterpret_cast<char const*>(block.sums.data()), block.sums.size() * sizeof(long long));
+        out.flush();
+        total = accumulate(block.sums.begin(), block.sums.end(), total);
+    }
+};
+}
+
+// Бенчмарк: блоков в секунду с файла в файл - process_data427 против
+// буферизованного варианта с 2 и 3 буферами
+void bench_process_data427(size_t blocks = 400, size_t block_size = 1 << 17, string const& path = "process_data427.bin")
+{
+    using namespace pipeline_demo;
+    {
+        ofstream out(path, ios::binary);
+        vector<long long> values(block_size);
+        for (size_t b = 0; b < blocks; ++b)
+        {
+            iota(values.begin(), values.end(), (long long)(b * block_size));
+            out.write(reinterpret_cast<char const*>(values.data()), values.size() * sizeof(long long));
+        }
+    }
+    string const out_path = path + ".out";
+    long long const expected = (long long)(blocks * block_size) * (long long)(blocks * block_size - 1) / 2;
+    cout << "mode  blocks/s  MB/s" << endl;
+    auto report = [&](char const* mode, double seconds, long long total)
+    {
+        if (total != expected) cout << "MISMATCH ";
+        cout << mode << "  " << blocks / seconds << "  "
+             << blocks * block_size * sizeof(long long) / seconds / (1 << 20) << endl;
+    };
+    {
+        file_number_source source(path, block_size);
+        file_sum_sink sink(out_path);
+        double const seconds = measure_seconds([&]
+            {
+                process_data427<file_number_source, file_sum_sink, number_block, sum_block, scalable_flex_barrier>(source, sink);
+            });
+        report("serial io", seconds, sink.total);
+    }
+    for (size_t buffers : {2, 3})
+    {
+        file_number_source source(path, block_size);
+        file_sum_sink sink(out_path);
+        double const seconds = measure_seconds([&]
+            {
+                process_data427_buffered<file_number_source, file_sum_sink, number_block, sum_block, scalable_flex_barrier>(source, sink, buffers);
+            });
+        report(buffers == 2 ? "double buffered" : "triple buffered", seconds, sink.total);
+    }
+    std::remove(path.c_str());
+    std::remove(out_path.c_str());
+}
+
+// Запуск листинга на блоках чисел из 4.26
+void run427()
+{
+    using namespace pipeline_demo;
+    number_source source(8);
+    sum_sink sink;
+    process_data427<number_source, sum_sink, number_block, sum_block, scalable_flex_barrier>(source, sink);
+    for (long long total : sink.totals)
+        cout << total << " ";
+    cout << endl; // 499500 1499500 ... 7499500
+    sink.totals.clear();
+    number_source again(8);
+    process_data427_buffered<number_source, sum_sink, number_block, sum_block, scalable_flex_barrier>(again, sink, 3);
+    for (long long total : sink.totals)
+        cout << total << " ";
+    cout << endl; // то же самое
+}
 /* Конец листинга 4.27 */
 
 int main()